@@ -1,45 +1,74 @@
 #include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
 
-/* Allocate memory for a rows*cols array of floats.
+/* Allocate memory for cols columns of rows elements of size bytes each,
+ * set to zero, and point m[0..cols-1] at the columns.
  * The elements within a column are contiguous in memory, and columns
  * themselves are also contiguous in memory.
+ * calloc() leaves the pages of a large block untouched, so they are placed
+ * on a NUMA node only when first written; see first_touch().
  */
-float **alloc_floatmatrix(int cols, int rows)
+static void **alloc_columns(int cols, int rows, size_t size)
 {
     int i;
-    float **m;
-    if ((m = (float**) malloc(cols*sizeof(float*))) == NULL) {
+    char **m;
+    if ((m = (char**) malloc(cols*sizeof(char*))) == NULL) {
         return NULL;
     }
-    float *els = (float *) calloc(rows*cols, sizeof(float));
+    char *els = (char *) calloc((size_t) rows*cols, size);
     if (els == NULL) {
         return NULL;
     } 
     for (i = 0; i < cols; i++) {
-        m[i] = &els[rows * i];
+        m[i] = &els[rows * size * i];
     }
-    return m;
+    return (void **) m;
 } 
 
-/* Allocate memory for a rows*cols array of chars. */
-char **alloc_charmatrix(int cols, int rows)
+/* Zero columns il..ir of a matrix of rows elements of size bytes each,
+ * from the OpenMP threads with the same static schedule as the kernels'
+ * loops over ileft..iright, so on a NUMA machine each page of the block
+ * is placed on the node of the thread that will work on it. Call it
+ * outside any parallel region, before anything else writes the block.
+ */
+void first_touch(void *m, int il, int ir, int rows, size_t size)
 {
+    char **c = (char **) m;
     int i;
-    char **m;
-    if ((m = (char**) malloc(cols*sizeof(char*))) == NULL) {
-        return NULL;
-    }
-    char *els = (char *) malloc(rows*cols*sizeof(char));
-    if (els == NULL) {
-        return NULL;
-    } 
-    for (i = 0; i < cols; i++) {
-        m[i] = &els[rows * i];
+
+    #pragma omp parallel for schedule(static)
+    for (i = il; i <= ir; i++) {
+        memset(c[i], 0, rows*size);
     }
-    return m;
-} 
+}
+
+/* Allocate memory for a rows*cols array of floats, set to zero. */
+float **alloc_floatmatrix(int cols, int rows)
+{
+    return (float **) alloc_columns(cols, rows, sizeof(float));
+}
+
+/* Allocate memory for rows*cols arrays of the velocity and pressure
+ * types (see precision.h), set to zero.
+ */
+real **alloc_realmatrix(int cols, int rows)
+{
+    return (real **) alloc_columns(cols, rows, sizeof(real));
+}
+
+preal **alloc_prealmatrix(int cols, int rows)
+{
+    return (preal **) alloc_columns(cols, rows, sizeof(preal));
+}
+
+/* Allocate memory for a rows*cols array of chars, set to zero. */
+char **alloc_charmatrix(int cols, int rows)
+{
+    return (char **) alloc_columns(cols, rows, sizeof(char));
+}
 
-/* Free the memory of a matrix allocated with alloc_{float|char}matrix*/
+/* Free the memory of a matrix allocated with one of the functions above */
 void free_matrix(void *m)
 {
     void **els = (void **) m;
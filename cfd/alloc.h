@@ -1,3 +1,9 @@
+#include <stddef.h>
+#include "precision.h"
+
 float **alloc_floatmatrix(int cols, int rows);
+real **alloc_realmatrix(int cols, int rows);
+preal **alloc_prealmatrix(int cols, int rows);
 char **alloc_charmatrix(int cols, int rows);
+void first_touch(void *m, int il, int ir, int rows, size_t size);
 void free_matrix(void *m);
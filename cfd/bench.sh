@@ -0,0 +1,114 @@
+#!/bin/sh
+# Strong and weak scaling benchmarks of karman on one machine.
+#
+# karman is run for every combination of MPI processes (RANKS) and OpenMP
+# threads per process (THREADS), in two series:
+#   strong  the grid STRONG_GRID, whatever the number of cores
+#   weak    WEAK_GRID per core, imax growing with processes x threads
+# Each run is made WARMUP times unrecorded and then REPS times, and the
+# fastest is kept. For each run the table gives the time per timestep,
+# the cell updates per second (MLUPS), the parallel efficiency against the
+# first run of the series and the pressure solver iterations per timestep,
+# which come from karman's timing file (-M).
+#
+# The settings come from the environment, or the make command line, eg
+#   make bench RANKS="1 2 4 8" THREADS="1 2" STRONG_GRID=1320x240
+# MPIRUN and MPIFLAGS set how karman is started, and KARMAN_ARGS are
+# passed to it. The table is printed and written as CSV to OUT.
+
+RANKS=${RANKS:-"1 2 4"}
+THREADS=${THREADS:-"1"}
+STRONG_GRID=${STRONG_GRID:-660x120}
+WEAK_GRID=${WEAK_GRID:-165x120}
+T_END=${T_END:-0.2}
+WARMUP=${WARMUP:-1}
+REPS=${REPS:-3}
+KARMAN=${KARMAN:-./karman}
+KARMAN_ARGS=${KARMAN_ARGS:-}
+MPIRUN=${MPIRUN:-mpirun}
+MPIFLAGS=${MPIFLAGS:-}
+OUT=${OUT:-bench.csv}
+
+tmp=${TMPDIR:-/tmp}/bench.$$
+trap 'rm -f "$tmp".*' EXIT INT TERM
+
+# run NP THREADS IMAX JMAX: run karman once, setting step (seconds per
+# timestep), steps and iters (solver iterations)
+run() {
+    OMP_NUM_THREADS=$2 $MPIRUN -np $1 $MPIFLAGS $KARMAN -x $3 -y $4 \
+        -t "$T_END" -i none -o "" -v 0 -M "$tmp.csv" $KARMAN_ARGS \
+        > "$tmp.out" 2> "$tmp.err"
+    # The last line of karman's output is
+    # poisson time per step,time per step,loop time,processes
+    step=$(tail -n 1 "$tmp.out" | awk -F, 'NF == 4 { print $2 }')
+    steps=$(awk -F, 'NR == 2 { print $6 }' "$tmp.csv" 2>/dev/null)
+    iters=$(awk -F, 'NR == 2 { print $7 }' "$tmp.csv" 2>/dev/null)
+    if [ -z "$step" ] || [ -z "$steps" ]; then
+        echo "bench: karman failed with $1 processes, $2 threads, $3x$4:" >&2
+        cat "$tmp.out" "$tmp.err" >&2
+        exit 1
+    fi
+}
+
+# measure SERIES NP THREADS IMAX JMAX: benchmark one configuration and add
+# it to the table
+measure() {
+    n=0
+    while [ $n -lt "$WARMUP" ]; do
+        run $2 $3 $4 $5
+        n=$((n + 1))
+    done
+    best=
+    n=0
+    while [ $n -lt "$REPS" ]; do
+        run $2 $3 $4 $5
+        best=$(awk -v a="$best" -v b="$step" \
+            'BEGIN { print (a == "" || b < a) ? b : a }')
+        n=$((n + 1))
+    done
+
+    # The first run of a series is the baseline for its efficiency
+    cores=$(($2 * $3))
+    if [ -z "$base" ]; then
+        base=$best
+        base_cores=$cores
+    fi
+    awk -v s="$1" -v np=$2 -v nt=$3 -v x=$4 -v y=$5 -v t="$best" \
+        -v steps="$steps" -v iters="$iters" -v b="$base" -v bc="$base_cores" \
+        -v c=$cores 'BEGIN {
+            eff = (s == "strong") ? b*bc / (t*c) : b / t;
+            printf "%s,%d,%d,%d,%d,%d,%.6g,%.2f,%.3f,%.1f\n", s, np, nt, x, y,
+                steps, t, x*y / t / 1e6, eff, iters / steps
+        }' >> "$OUT"
+}
+
+echo "series,ranks,threads,imax,jmax,steps,sec_per_step,mlups,efficiency,sor_iters_per_step" > "$OUT"
+
+sx=${STRONG_GRID%x*}
+sy=${STRONG_GRID#*x}
+base=
+for np in $RANKS; do
+    for nt in $THREADS; do
+        measure strong $np $nt $sx $sy
+    done
+done
+
+wx=${WEAK_GRID%x*}
+wy=${WEAK_GRID#*x}
+base=
+for np in $RANKS; do
+    for nt in $THREADS; do
+        measure weak $np $nt $((wx * np * nt)) $wy
+    done
+done
+
+awk -F, 'NR == 1 {
+        printf "%-6s %5s %7s %11s %6s %12s %8s %10s %9s\n", "series", "ranks",
+            "threads", "grid", "steps", "sec/step", "MLUPS", "efficiency",
+            "iters/step"
+        next
+    }
+    {
+        printf "%-6s %5d %7d %11s %6d %12.6g %8.2f %10.3f %9.1f\n", $1, $2, $3,
+            $4 "x" $5, $6, $7, $8, $9, $10
+    }' "$OUT"
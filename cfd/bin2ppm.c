@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <getopt.h>
+#include <omp.h>
 #include "alloc.h"
 #include "datadef.h"
+#include "statemap.h"
 
 #define max(x,y) (((x)>(y))?(x):(y))
 #define min(x,y) (((x)<(y))?(x):(y))
@@ -15,6 +18,13 @@ void calc_psi_zeta(float **u, float **v, float **psi, float **zeta,
 static void print_usage(void);
 static void print_version(void);
 static void print_help(void);
+static int convert(const char *infile, const char *outfile, int outmode,
+    int verbose);
+static char *ppm_name(const char *file);
+static float **float_field(struct state *s, int f);
+static void free_fields(struct state *s, float **u, float **v, float **psi,
+    float **zeta, char **flag, unsigned char *image);
+static void make_zeta_lut(void);
 
 static char *progname;
 
@@ -25,6 +35,7 @@ static char *progname;
 static struct option long_opts[] = {
     { "help",      0, NULL, 'h' },
     { "infile",    1, NULL, 'i' },
+    { "jobs",      1, NULL, 'j' },
     { "outfile",   1, NULL, 'o' },
     { "plot-psi",  0, NULL, 'p' },
     { "plot-zeta", 0, NULL, 'z' },
@@ -32,7 +43,7 @@ static struct option long_opts[] = {
     { "verbose",   1, NULL, 'v' },
     { 0,           0, 0,    0   }
 };
-#define GETOPTS "hi:o:pv:Vz"
+#define GETOPTS "hi:j:o:pv:Vz"
 
 /* Output modes */
 #define ZETA 0
@@ -40,17 +51,11 @@ static struct option long_opts[] = {
 
 int main(int argc, char **argv)
 {
-    int i, j, imax, jmax;
-    int outmode = ZETA, verbose = 1;
-    float xlength, ylength;
-    float zmax = -1e10, zmin = 1e10;
-    float pmax = -1e10, pmin = 1e10;
-    float umax = -1e10, umin = 1e10;
-    float vmax = -1e10, vmin = 1e10;
+    int k, err = 0, nfiles;
+    int outmode = ZETA, verbose = 1, jobs = omp_get_max_threads();
 
     int show_help = 0, show_usage = 0, show_version = 0;
-    char *infile = NULL, *outfile = NULL;
-    FILE *fin = stdin, *fout = stdout;
+    char *infile = NULL, *outfile = NULL, *name;
 
     progname = argv[0];
     int optc;
@@ -77,12 +82,30 @@ int main(int argc, char **argv)
                 }
                 outfile = strdup(optarg);
                 break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1) {
+                    fprintf(stderr, "%s: Invalid number of jobs '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'p':
+                outmode = PSI;
+                break;
+            case 'z':
+                outmode = ZETA;
+                break;
             default:
                 show_usage = 1;
         }
     }
 
-    if (show_usage || optind < argc) {
+    /* Files on the command line are converted in a batch, each to a file
+     * of its own
+     */
+    nfiles = argc - optind;
+    if (show_usage || (nfiles > 0 && (infile != NULL || outfile != NULL))) {
         print_usage();
         return 1;
     }
@@ -99,38 +122,142 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    if (infile != NULL) {
-        fin = fopen(infile, "rb");
-        if (!fin) {
-            fprintf(stderr, "Could not open '%s'\n", infile);
-            return 1;
+    make_zeta_lut();
+    if (nfiles == 0) {
+        return convert(infile, outfile, outmode, verbose);
+    }
+
+    /* Up to jobs files at a time, each by one thread. A single file is
+     * drawn by all the threads instead.
+     */
+    #pragma omp parallel for schedule(dynamic) num_threads(min(jobs, nfiles)) \
+        private(name) reduction(|:err)
+    for (k = optind; k < argc; k++) {
+        if ((name = ppm_name(argv[k])) == NULL) {
+            err = 1;
+            continue;
         }
+        err |= convert(argv[k], name, outmode, verbose);
+        free(name);
+    }
+    return err;
+}
+
+/* The output file for infile in a batch: its name with the extension
+ * changed to .ppm, or with .ppm added if it has none. Free it with free().
+ */
+static char *ppm_name(const char *file)
+{
+    const char *dot = strrchr(file, '.');
+    int n = (dot != NULL && strchr(dot, '/') == NULL) ? dot - file :
+        strlen(file);
+    char *name = malloc(n + 5);
+
+    if (name != NULL) {
+        sprintf(name, "%.*s.ppm", n, file);
+    }
+    return name;
+}
+
+/* The grey level of a vorticity, which wraps round past 255 */
+static int zeta_level(float z)
+{
+    return pow(fabs(z/12.6),.4) * 255;
+}
+
+/* zeta_lut[k] is the least |zeta| with a grey level above k, found by
+ * bisecting the non-negative floats, which are ordered like their bit
+ * patterns. Looking the level up in it gives the same answer as
+ * zeta_level() without calling pow().
+ */
+static float zeta_lut[256];
+
+static void make_zeta_lut(void)
+{
+    int k;
+    float a = 100.0;                /* Well above level 255 */
+    uint32_t lo, hi, mid, top;
+
+    memcpy(&top, &a, sizeof(top));
+    for (k = 0; k < 256; k++) {
+        lo = 0;
+        hi = top;
+        while (lo < hi) {
+            mid = lo + (hi - lo)/2;
+            memcpy(&a, &mid, sizeof(a));
+            if (zeta_level(a) > k) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        memcpy(&zeta_lut[k], &lo, sizeof(float));
+    }
+}
+
+static inline int zeta_grey(float z)
+{
+    float a = fabsf(z);
+    int c = 0, s;
+
+    if (!(a < zeta_lut[255])) { return zeta_level(z); }
+    for (s = 128; s > 0; s >>= 1) {
+        if (a >= zeta_lut[c+s-1]) { c += s; }
+    }
+    return c;
+}
+
+/* Convert the state in infile (standard input if NULL) into an image in
+ * outfile (standard output if NULL). Returns non-zero on failure.
+ */
+static int convert(const char *infile, const char *outfile, int outmode,
+    int verbose)
+{
+    int i, j, imax, jmax;
+    float xlength, ylength;
+    float zmax = -1e10, zmin = 1e10;
+    float pmax = -1e10, pmin = 1e10;
+    float umax = -1e10, umin = 1e10;
+    float vmax = -1e10, vmin = 1e10;
+    FILE *fout = stdout;
+    struct state state;
+    unsigned char *image;
+    size_t size;
+    int ok;
+
+    if (state_open(infile, &state)) {
+        return 1;
     }
 
     if (outfile != NULL) {
         fout = fopen(outfile, "wb");
         if (!fout) {
             fprintf(stderr, "Could not open '%s'\n", outfile);
+            state_close(&state);
             return 1;
         }
     }
-    fread(&imax, sizeof(int), 1, fin);
-    fread(&jmax, sizeof(int), 1, fin);
+    imax = state.imax;
+    jmax = state.jmax;
+    xlength = state.xlength;
+    ylength = state.ylength;
 
-    float **u    = alloc_floatmatrix(imax+2, jmax+2);
-    float **v    = alloc_floatmatrix(imax+2, jmax+2);
-    float **p    = alloc_floatmatrix(imax+2, jmax+2);
+    /* The fields are used where they are in the file if they are floats */
+    float **u    = float_field(&state, STATE_U);
+    float **v    = float_field(&state, STATE_V);
     float **psi  = alloc_floatmatrix(imax+2, jmax+2);
     float **zeta = alloc_floatmatrix(imax+2, jmax+2);
-    char  **flag = alloc_charmatrix(imax+2, jmax+2);
+    char  **flag = (char **) state_columns(&state, STATE_FLAG);
+    size  = (size_t) imax * jmax * 3;
+    image = malloc(size);
 
-    if (!u || !v || !p || !psi || !zeta || !flag) {
+    if (!u || !v || !psi || !zeta || !flag || !image) {
         fprintf(stderr, "Couldn't allocate memory for matrices.\n");
+        if (outfile != NULL) { fclose(fout); }
+        free_fields(&state, u, v, psi, zeta, flag, image);
         return 1;
     }
 
-    fread(&xlength, sizeof(float), 1, fin);
-    fread(&ylength, sizeof(float), 1, fin);
     float delx = xlength/imax;
     float dely = ylength/jmax;
 
@@ -140,61 +267,112 @@ int main(int argc, char **argv)
         printf("xlength: %g\n", xlength);
         printf("ylength: %g\n", ylength);
     }
-    for (i = 0; i <= imax+2; i++) {
-        fread(u[i], sizeof(float), jmax+2, fin);
-        fread(v[i], sizeof(float), jmax+2, fin);
-        fread(p[i], sizeof(float), jmax+2, fin);
-        fread(flag[i], sizeof(char), jmax+2, fin);
-    }
-
     calc_psi_zeta(u, v, psi, zeta, flag, imax, jmax, delx, dely);
-    fprintf(fout, "P6 %d %d 255\n", imax, jmax);
 
+    /* The image is built in memory, a row at a time, and written in one go.
+     * Its first row is j = 1.
+     */
+    #pragma omp parallel for private(i) reduction(max:zmax,pmax,umax,vmax) \
+        reduction(min:zmin,pmin,umin,vmin)
     for (j = 1; j < jmax+1 ; j++) {
-        for (i = 1; i < imax+1 ; i++) {
-            int r, g, b;
+        unsigned char *px = image + (size_t) (j-1)*imax*3;
+        for (i = 1; i < imax+1 ; i++, px += 3) {
+            int c;
             if (!(flag[i][j] & C_F)) {
-                r = 0; b = 0; g = 255;
+                px[0] = 0; px[1] = 255; px[2] = 0;
+                continue;
+            }
+            zmax = max(zmax, zeta[i][j]);
+            zmin = min(zmin, zeta[i][j]);
+            pmax = max(pmax, psi[i][j]);
+            pmin = min(pmin, psi[i][j]);
+            umax = max(umax, u[i][j]);
+            umin = min(umin, u[i][j]);
+            vmax = max(vmax, v[i][j]);
+            vmin = min(vmin, v[i][j]);
+            if (outmode == ZETA) {
+                float z = (i < imax && j < jmax)?zeta[i][j]:0.0;
+                c = zeta_grey(z);
             } else {
-                zmax = max(zmax, zeta[i][j]);
-                zmin = min(zmin, zeta[i][j]);
-                pmax = max(pmax, psi[i][j]);
-                pmin = min(pmin, psi[i][j]);
-                umax = max(umax, u[i][j]);
-                umin = min(umin, u[i][j]);
-                vmax = max(vmax, v[i][j]);
-                vmin = min(vmin, v[i][j]);
-                if (outmode == ZETA) {
-                    float z = (i < imax && j < jmax)?zeta[i][j]:0.0;
-                    r = g = b = pow(fabs(z/12.6),.4) * 255;
-                } else if (outmode == PSI) {
-                    float p = (i < imax && j < jmax)?psi[i][j]:0.0;
-                    r = g = b = (p+3.0)/7.5 * 255; 
-                }
+                float p = (i < imax && j < jmax)?psi[i][j]:0.0;
+                c = (p+3.0)/7.5 * 255;
             }
-            fprintf(fout, "%c%c%c", r, g, b);
+            px[0] = px[1] = px[2] = c;
         }
     }
+
+    fprintf(fout, "P6 %d %d 255\n", imax, jmax);
+    ok = fwrite(image, 1, size, fout) == size;
     if (verbose > 0) {
-        printf("u:    % .5e -- % .5e\n", umin, umax);
-        printf("v:    % .5e -- % .5e\n", vmin, vmax);
-        printf("psi:  % .5e -- % .5e\n", pmin, pmax);
-        printf("zeta: % .5e -- % .5e\n", zmin, zmax);
-    }
-    fclose(fin);
-    fclose(fout);
-
-    free_matrix(u);
-    free_matrix(v);
-    free_matrix(p);
-    free_matrix(psi);
-    free_matrix(zeta);
-    free_matrix(flag);
-
-    return 0;
+        #pragma omp critical
+        {
+            if (infile != NULL && outfile != NULL) {
+                printf("%s:\n", infile);
+            }
+            printf("u:    % .5e -- % .5e\n", umin, umax);
+            printf("v:    % .5e -- % .5e\n", vmin, vmax);
+            printf("psi:  % .5e -- % .5e\n", pmin, pmax);
+            printf("zeta: % .5e -- % .5e\n", zmin, zmax);
+        }
+    }
+    if (fclose(fout) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not write '%s'\n",
+            (outfile != NULL) ? outfile : "-");
+    }
+
+    free_fields(&state, u, v, psi, zeta, flag, image);
+    return !ok;
+}
+
+/* Free what convert() allocated, any of which may be NULL, and close the
+ * state
+ */
+static void free_fields(struct state *s, float **u, float **v, float **psi,
+    float **zeta, char **flag, unsigned char *image)
+{
+    /* u and v are only column pointers into the state if it holds floats */
+    if (s->type[STATE_U] == STATE_FLOAT32) {
+        free(u);
+        free(v);
+    } else {
+        if (u != NULL) { free_matrix(u); }
+        if (v != NULL) { free_matrix(v); }
+    }
+    if (psi != NULL) { free_matrix(psi); }
+    if (zeta != NULL) { free_matrix(zeta); }
+    free(flag);
+    free(image);
+    state_close(s);
+}
+
+/* Field f of a state file as a matrix of floats: in place if it holds
+ * floats, or else converted into a matrix of its own
+ */
+static float **float_field(struct state *s, int f)
+{
+    int i, j;
+    float **m;
+
+    if (s->type[f] == STATE_FLOAT32) {
+        return (float **) state_columns(s, f);
+    }
+    if ((m = alloc_floatmatrix(s->imax+2, s->jmax+2)) != NULL) {
+        #pragma omp parallel for private(j)
+        for (i = 0; i < s->imax+2; i++) {
+            for (j = 0; j < s->jmax+2; j++) {
+                m[i][j] = state_get(s, f, (size_t) i*(s->jmax+2) + j);
+            }
+        }
+    }
+    return m;
 }
 
-/* Computation of stream function and vorticity */
+/* Computation of stream function and vorticity. The columns are
+ * independent, so they are shared out among the threads.
+ */
 void calc_psi_zeta(float **u, float **v, float **psi, float **zeta,
     char **flag, int imax, int jmax, float delx, float dely)
 {
@@ -202,6 +380,7 @@ void calc_psi_zeta(float **u, float **v, float **psi, float **zeta,
 
     /* Computation of the vorticity zeta at the upper right corner     */
     /* of cell (i,j) (only if the corner is surrounded by fluid cells) */
+    #pragma omp parallel for private(j)
     for (i=1;i<=imax-1;i++) {
         for (j=1;j<=jmax-1;j++) {
             if ( (flag[i][j] & C_F) && (flag[i+1][j] & C_F) &&
@@ -216,6 +395,7 @@ void calc_psi_zeta(float **u, float **v, float **psi, float **zeta,
 
     /* Computation of the stream function at the upper right corner    */
     /* of cell (i,j) (only if bother lower cells are fluid cells)      */
+    #pragma omp parallel for private(j)
     for (i=0;i<=imax;i++) {
         psi[i][0] = 0.0;
         for (j=1;j<=jmax;j++) {
@@ -241,7 +421,9 @@ static void print_help(void)
 {
     fprintf(stderr, "%s. Converts karman output into portable pixmaps.\n\n",
          PACKAGE);
-    fprintf(stderr, "Usage: %s [OPTIONS]...\n\n", progname);
+    fprintf(stderr, "Usage: %s [OPTIONS]... [FILE]...\n\n", progname);
+    fprintf(stderr, "Each FILE is converted into a pixmap of the same name ending\n");
+    fprintf(stderr, "in .ppm, several at a time. Without FILEs, -i and -o are used.\n\n");
     fprintf(stderr, "  -h, --help            Print a summary of the options\n");
     fprintf(stderr, "  -V, --version         Print the version number\n");
     fprintf(stderr, "  -v, --verbose=LEVEL   Set the verbosity level. 0 is silent\n");
@@ -249,6 +431,8 @@ static void print_help(void)
     fprintf(stderr, "                        (defaults to standard input)\n");
     fprintf(stderr, "  -o, --outfile=FILE    Write the image to this file\n");
     fprintf(stderr, "                        (defaults to standard output)\n");
+    fprintf(stderr, "  -j, --jobs=N          Convert up to N FILEs at once (defaults to\n");
+    fprintf(stderr, "                        the number of OpenMP threads)\n");
     fprintf(stderr, "  -p, --plot-psi        Plot psi values in the image\n");
     fprintf(stderr, "  -z, --plot-zeta       Plot zeta (vorticity) in the image\n");
 }
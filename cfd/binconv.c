@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include "statemap.h"
+
+static void print_usage(void);
+static void print_version(void);
+static void print_help(void);
+
+static char *progname;
+
+#define PACKAGE "binconv"
+#define VERSION "1.0"
+
+/* Command line options */
+static struct option long_opts[] = {
+    { "help",    0, NULL, 'h' },
+    { "to",      1, NULL, 't' },
+    { "verbose", 1, NULL, 'v' },
+    { "version", 0, NULL, 'V' },
+    { 0,         0, 0,    0   }
+};
+
+#define GETOPTS "ht:v:V"
+
+int main(int argc, char **argv)
+{
+    struct state s;
+    int to = 0, verbose = 1;
+    int show_help = 0, show_usage = 0, show_version = 0;
+    progname = argv[0];
+
+    int optc;
+    while ((optc = getopt_long(argc, argv, GETOPTS, long_opts, NULL)) != -1) {
+        switch (optc) {
+            case 'h':
+                show_help = 1;
+                break;
+            case 'V':
+                show_version = 1;
+                break;
+            case 'v':
+                verbose = atoi(optarg);
+                break;
+            case 't':
+                to = atoi(optarg);
+                if (to != 1 && to != STATE_VERSION) {
+                    fprintf(stderr, "%s: Invalid version '%s'\n", progname,
+                        optarg);
+                    show_usage = 1;
+                }
+                break;
+            default:
+                show_usage = 1;
+        }
+    }
+
+    if (show_version) {
+        print_version();
+        if (!show_help) {
+            return 0;
+        }
+    }
+
+    if (show_help) {
+        print_help();
+        return 0;
+    }
+
+    if (show_usage || optind != (argc - 2)) {
+        print_usage();
+        return 1;
+    }
+
+    if (state_open(argv[optind], &s)) {
+        return 1;
+    }
+    /* By default, to the other version */
+    if (to == 0) {
+        to = (s.version == 1) ? STATE_VERSION : 1;
+    }
+    if (verbose > 0) {
+        printf("%s: version %d, %dx%d, t:%g, step %d\n", argv[optind],
+            s.version, s.imax, s.jmax, s.t, s.iters);
+    }
+    if (state_save(argv[optind+1], &s, to) != 0) {
+        fprintf(stderr, "Could not write '%s': %s\n", argv[optind+1],
+            strerror(errno));
+        state_close(&s);
+        return 1;
+    }
+    if (verbose > 0) {
+        printf("%s: version %d\n", argv[optind+1], to);
+    }
+    state_close(&s);
+    return 0;
+}
+
+static void print_usage(void)
+{
+    fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+}
+
+static void print_version(void)
+{
+    fprintf(stderr, "%s %s\n", PACKAGE, VERSION);
+}
+
+static void print_help(void)
+{
+    fprintf(stderr, "%s. Converts karman state files between the original\n"
+        "format (version 1) and the mappable one (version 2).\n\n", PACKAGE);
+    fprintf(stderr, "Usage %s [OPTIONS] INFILE OUTFILE\n\n", progname);
+    fprintf(stderr, "  -h, --help            Print a summary of the options\n");
+    fprintf(stderr, "  -V, --version         Print the version number\n");
+    fprintf(stderr, "  -v, --verbose=LEVEL   Set the verbosity level. 0 is silent\n");
+    fprintf(stderr, "  -t, --to=VERSION      Write version 1 or 2 of the format (default\n");
+    fprintf(stderr, "                        is the version INFILE isn't). Version 1\n");
+    fprintf(stderr, "                        files hold floats and no run state\n");
+}
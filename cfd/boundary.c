@@ -1,42 +1,73 @@
 #include <stdio.h>
 #include <string.h>
 #include "datadef.h"
+#include "precision.h"
+
+#define max(x,y) ((x)>(y)?(x):(y))
+#define min(x,y) ((x)<(y)?(x):(y))
+
+extern int ileft, iright, jbottom, jtop;
 
 /* Given the boundary conditions defined by the flag matrix, update
  * the u and v velocities. Also enforce the boundary conditions at the
  * edges of the matrix.
+ * Only this process's block is updated. The u and v halos must be
+ * current on entry, and are left stale on exit.
+ * Every thread of a parallel region may call this, sharing out the loops
+ * (see simulation.c).
  */
-void apply_boundary_conditions(float **u, float **v, char **flag,
-    int imax, int jmax, float ui, float vi)
+void apply_boundary_conditions(real **u, real **v, char **flag,
+    int imax, int jmax, real ui, real vi)
 {
     int i, j;
 
-    for (j=0; j<=jmax+1; j++) {
-        /* Fluid freely flows in from the west */
-        u[0][j] = u[1][j];
-        v[0][j] = v[1][j];
+    /* Block including any external boundary cells next to it */
+    int ilo = (ileft == 1) ? 0 : ileft;
+    int ihi = (iright == imax) ? imax+1 : iright;
+    int jlo = (jbottom == 1) ? 0 : jbottom;
+    int jhi = (jtop == jmax) ? jmax+1 : jtop;
 
-        /* Fluid freely flows out to the east */
-        u[imax][j] = u[imax-1][j];
-        v[imax+1][j] = v[imax][j];
+    #pragma omp for schedule(static)
+    for (j=jlo; j<=jhi; j++) {
+        if (ileft == 1) {
+            /* Fluid freely flows in from the west */
+            u[0][j] = u[1][j];
+            v[0][j] = v[1][j];
+        }
+        if (iright == imax) {
+            /* Fluid freely flows out to the east */
+            u[imax][j] = u[imax-1][j];
+            v[imax+1][j] = v[imax][j];
+        }
     }
 
-    for (i=0; i<=imax+1; i++) {
+    #pragma omp for schedule(static)
+    for (i=ilo; i<=ihi; i++) {
         /* The vertical velocity approaches 0 at the north and south
          * boundaries, but fluid flows freely in the horizontal direction */
-        v[i][jmax] = 0.0;
-        u[i][jmax+1] = u[i][jmax];
-
-        v[i][0] = 0.0;
-        u[i][0] = u[i][1];
+        if (jtop == jmax) {
+            v[i][jmax] = 0.0;
+            u[i][jmax+1] = u[i][jmax];
+        }
+        if (jbottom == 1) {
+            v[i][0] = 0.0;
+            u[i][0] = u[i][1];
+        }
     }
 
     /* Apply no-slip boundary conditions to cells that are adjacent to
      * internal obstacle cells. This forces the u and v velocity to
      * tend towards zero in these cells.
+     * An obstacle cell just east of (or above) the block sets u in column
+     * iright (or v in row jtop), so one halo cell either side is visited
+     * as well.
+     * A cell sets velocities in the columns either side and reads ones
+     * that other cells set, so the result depends on the order the cells
+     * are visited in, and one thread does them all.
      */
-    for (i=1; i<=imax; i++) {
-        for (j=1; j<=jmax; j++) {
+    #pragma omp single
+    for (i=max(1, ileft-1); i<=min(imax, iright+1); i++) {
+        for (j=max(1, jbottom-1); j<=min(jmax, jtop+1); j++) {
             if (flag[i][j] & B_NSEW) {
                 switch (flag[i][j]) {
                     case B_N: 
@@ -91,8 +122,15 @@ void apply_boundary_conditions(float **u, float **v, char **flag,
     /* Finally, fix the horizontal velocity at the  western edge to have
      * a continual flow of fluid into the simulation.
      */
-    v[0][0] = 2*vi-v[1][0];
-    for (j=1;j<=jmax;j++) {
+    if (ileft != 1) {
+        return;
+    }
+    #pragma omp single nowait
+    if (jbottom == 1) {
+        v[0][0] = 2*vi-v[1][0];
+    }
+    #pragma omp for schedule(static)
+    for (j=jbottom;j<=jtop;j++) {
         u[0][j] = ui;
         v[0][j] = 2*vi-v[1][j];
     }
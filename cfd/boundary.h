@@ -1,2 +1,4 @@
-void apply_boundary_conditions(float **u, float **v, char **flag,
-    int imax, int jmax, float ui, float vi);
+#include "precision.h"
+
+void apply_boundary_conditions(real **u, real **v, char **flag,
+    int imax, int jmax, real ui, real vi);
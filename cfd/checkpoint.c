@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mpi.h>
+#include "checkpoint.h"
+
+extern int proc;
+extern MPI_Comm cart_comm;
+
+/* Periodic checkpoints, written while the simulation carries on. At a
+ * checkpoint each process copies its slab of the state into one of two
+ * buffers and hands it to a writer thread of its own, which writes it into
+ * a temporary file with POSIX I/O while the next timesteps run. The
+ * writer makes no MPI calls, so MPI_THREAD_FUNNELED is enough.
+ * Once every process's writer has finished, process 0 renames the
+ * temporary file to the checkpoint file, so the checkpoint file is always
+ * a complete one, and flushes the directory so that the rename survives a
+ * crash. checkpoint_poll() does that as soon as it can: each process
+ * starts a non-blocking reduction of its writer's result when the writer
+ * is done, on a communicator of its own since the processes start it at
+ * different timesteps, and tests it every timestep.
+ */
+int checkpoint_every = 0;           /* Timesteps or seconds between
+                                       checkpoints, 0 for none */
+int checkpoint_seconds = 0;         /* checkpoint_every is in seconds */
+
+static char *ckpt_file, *ckpt_tmp;
+static int ck_imax, ck_jmax;
+static real ck_xlength, ck_ylength;
+static double last_time;            /* Time of the last checkpoint */
+
+static char *bufs[2];               /* Snapshot buffers */
+static int cur;                     /* The one to fill next */
+static int pending;                 /* A checkpoint is being written */
+
+static MPI_Comm ckpt_comm;          /* For the reductions of the results */
+static MPI_Request done_req;        /* Reduction of the results */
+static int reducing;                /* done_req has been started */
+static int done_err, any_err;       /* Its input and output */
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static char *job;                   /* Buffer for the writer, or NULL */
+static int job_err;                 /* errno of its write, or 0 */
+static int quit;
+
+
+/* The writer thread: write each buffer it is given into the temporary
+ * file
+ */
+static void *write_loop(void *arg)
+{
+    char *buf;
+    int err;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (job == NULL && !quit) { pthread_cond_wait(&cond, &lock); }
+        if (job == NULL) { break; }
+        buf = job;
+        pthread_mutex_unlock(&lock);
+
+        err = state_write_slab(ckpt_tmp, buf, ck_imax, ck_jmax) ? errno : 0;
+
+        pthread_mutex_lock(&lock);
+        job_err = err;
+        job = NULL;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Flush the directory holding file, so that a rename in it is on disk.
+ * Returns 0 on success, or -1 with errno set.
+ */
+static int sync_dir(const char *file)
+{
+    char *dir, *slash;
+    int fd, ok;
+
+    if ((dir = strdup(file)) == NULL) { return -1; }
+    if ((slash = strrchr(dir, '/')) == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0) { return -1; }
+    ok = fsync(fd) == 0;
+    return (close(fd) == 0 && ok) ? 0 : -1;
+}
+
+/* Start the reduction of the writers' results once this process's writer
+ * is done, if wait is non-zero waiting for it. Returns whether it has been
+ * started.
+ */
+static int start_reduction(int wait)
+{
+    int done;
+
+    if (reducing) { return 1; }
+    pthread_mutex_lock(&lock);
+    while (wait && job != NULL) { pthread_cond_wait(&cond, &lock); }
+    done = (job == NULL);
+    done_err = job_err;
+    pthread_mutex_unlock(&lock);
+    if (!done) { return 0; }
+
+    MPI_Iallreduce(&done_err, &any_err, 1, MPI_INT, MPI_MAX, ckpt_comm,
+        &done_req);
+    reducing = 1;
+    return 1;
+}
+
+/* Once every process's writer has finished, make the checkpoint in hand
+ * the checkpoint file
+ */
+static void commit_done(void)
+{
+    if (proc == 0) {
+        if (any_err) {
+            fprintf(stderr, "Could not write checkpoint '%s': %s\n",
+                ckpt_tmp, strerror(any_err));
+        } else if (rename(ckpt_tmp, ckpt_file) != 0) {
+            fprintf(stderr, "Could not rename '%s' to '%s': %s\n", ckpt_tmp,
+                ckpt_file, strerror(errno));
+        } else if (sync_dir(ckpt_file) != 0) {
+            fprintf(stderr, "Could not flush the directory of '%s': %s\n",
+                ckpt_file, strerror(errno));
+        }
+    }
+    reducing = 0;
+    pending = 0;
+}
+
+/* Wait for every process's writer to finish the checkpoint in hand, if
+ * any, and make it the checkpoint file
+ */
+static void commit(void)
+{
+    if (!pending) { return; }
+    start_reduction(1);
+    MPI_Wait(&done_req, MPI_STATUS_IGNORE);
+    commit_done();
+}
+
+/* Make the checkpoint in hand the checkpoint file if every process's
+ * writer has finished it, without waiting. Called every timestep by every
+ * process.
+ */
+void checkpoint_poll(void)
+{
+    int done;
+
+    if (!pending || !start_reduction(0)) { return; }
+    MPI_Test(&done_req, &done, MPI_STATUS_IGNORE);
+    if (done) { commit_done(); }
+}
+
+
+/* Start the writer thread and allocate the buffers, if checkpoints are
+ * wanted. Checkpoints are saved to file.
+ */
+void checkpoint_setup(char *file, int imax, int jmax, real xlength,
+    real ylength)
+{
+    size_t size;
+
+    if (checkpoint_every <= 0) { return; }
+
+    ckpt_file = file;
+    ckpt_tmp = malloc(strlen(file) + 5);
+    size = state_slab_size(imax, jmax);
+    bufs[0] = malloc(size);
+    bufs[1] = malloc(size);
+    if (!ckpt_tmp || !bufs[0] || !bufs[1]) {
+        fprintf(stderr, "Couldn't allocate memory for checkpoints.\n");
+        exit(1);
+    }
+    sprintf(ckpt_tmp, "%s.tmp", file);
+    ck_imax = imax;
+    ck_jmax = jmax;
+    ck_xlength = xlength;
+    ck_ylength = ylength;
+
+    if (pthread_create(&writer, NULL, write_loop, NULL) != 0) {
+        fprintf(stderr, "Couldn't start the checkpoint writer.\n");
+        exit(1);
+    }
+    MPI_Comm_dup(cart_comm, &ckpt_comm);
+    last_time = MPI_Wtime();
+}
+
+/* Whether to save a checkpoint before timestep iters. Every process gets
+ * the same answer; with the interval in seconds process 0's clock decides.
+ */
+int checkpoint_due(int iters)
+{
+    int due;
+
+    if (checkpoint_every <= 0) { return 0; }
+    if (!checkpoint_seconds) { return iters % checkpoint_every == 0; }
+
+    due = (proc == 0 && MPI_Wtime() - last_time >= checkpoint_every);
+    MPI_Bcast(&due, 1, MPI_INT, 0, cart_comm);
+    return due;
+}
+
+/* Save a checkpoint of the state and of *rs. The writer thread writes it
+ * out while the caller carries on.
+ */
+void checkpoint_save(real **u, real **v, preal **p, char **flag,
+    const struct run_state *rs)
+{
+    int err = 0;
+
+    state_pack(u, v, p, flag, ck_imax, ck_jmax, bufs[cur]);
+    commit();
+
+    /* A fresh temporary file, which the writers fill in */
+    if (proc == 0) {
+        err = state_create(ckpt_tmp, ck_imax, ck_jmax, ck_xlength,
+            ck_ylength, rs) ? errno : 0;
+        if (err) {
+            fprintf(stderr, "Could not create checkpoint '%s': %s\n",
+                ckpt_tmp, strerror(err));
+        }
+    }
+    MPI_Bcast(&err, 1, MPI_INT, 0, cart_comm);
+    if (err) { return; }
+
+    pthread_mutex_lock(&lock);
+    job = bufs[cur];
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pending = 1;
+    cur = 1 - cur;
+    last_time = MPI_Wtime();
+}
+
+/* Finish writing the last checkpoint and stop the writer thread */
+void checkpoint_finish(void)
+{
+    if (checkpoint_every <= 0) { return; }
+
+    commit();
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+    MPI_Comm_free(&ckpt_comm);
+
+    free(bufs[0]);
+    free(bufs[1]);
+    free(ckpt_tmp);
+}
@@ -0,0 +1,12 @@
+#include "precision.h"
+#include "statefile.h"
+
+extern int checkpoint_every, checkpoint_seconds;
+
+void checkpoint_setup(char *file, int imax, int jmax, real xlength,
+    real ylength);
+int checkpoint_due(int iters);
+void checkpoint_save(real **u, real **v, preal **p, char **flag,
+    const struct run_state *rs);
+void checkpoint_poll(void);
+void checkpoint_finish(void);
@@ -1,141 +1,504 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
 #include <mpi.h>
 #include "alloc.h"
 
-#define ROWS 9
-#define COLS 7 
+/* A benchmark of the ways to send the halos of a matrix laid out as
+ * alloc_floatmatrix() lays it out, between two processes that exchange
+ * them as neighbouring blocks do.
+ * In this layout columns are simple to send, as column elements are
+ * contiguous in memory: they are the east/west halos. Rows, the
+ * north/south halos, are strided, with one element in each column, so
+ * they are sent with a derived MPI_Datatype (a vector, or a subarray of
+ * the whole matrix), or packed into a contiguous buffer first: by
+ * MPI_Pack, by a plain loop, or by a SIMD gather.
+ * Process 0 has the block to the south or west of process 1's. Each
+ * exchange sends the last row (or column) of process 0 and the first of
+ * process 1 into the other's halo.
+ */
+#define METHOD_COLUMN   0           /* Contiguous column */
+#define METHOD_VECTOR   1           /* Row as an MPI_Type_vector */
+#define METHOD_SUBARRAY 2           /* Row as an MPI_Type_create_subarray */
+#define METHOD_MPI_PACK 3           /* Row by MPI_Pack and MPI_Unpack */
+#define METHOD_PACK     4           /* Row packed by a loop */
+#define METHOD_SIMD     5           /* Row packed by SIMD gathers */
+#define NMETHODS        6
+
+static const char *method_names[NMETHODS] = {
+    "column", "vector", "subarray", "mpi-pack", "pack", "simd"
+};
+
+static void print_usage(void);
+static void print_version(void);
+static void print_help(void);
+
+static char *progname;
+
+#define PACKAGE "colcopy"
+#define VERSION "1.0"
+
+/* Command line options */
+static struct option long_opts[] = {
+    { "help",    0, NULL, 'h' },
+    { "version", 0, NULL, 'V' },
+    { "imax",    1, NULL, 'x' },
+    { "jmax",    1, NULL, 'y' },
+    { "count",   1, NULL, 'c' },
+    { "method",  1, NULL, 'm' },
+    { 0,         0, 0,    0   }
+};
+
+#define GETOPTS "c:hm:Vx:y:"
+
+static int imax = 660 * 2, jmax = 120 * 2;
+static float **matrix;
+static int proc, partner;
+
+/* Which of the rows and columns each process sends and receives */
+static int send_row, recv_row, send_col, recv_col;
+
+/* Derived datatypes, and the buffers of the packing methods */
+static MPI_Datatype rowtype, send_sub, recv_sub;
+static char *mpi_sendbuf, *mpi_recvbuf;
+static int mpi_packsize;
+static float *sendbuf, *recvbuf;
+
+
+/* Copy n cells of row j, from column i0 on, into buf, and back */
+static void pack_row_scalar(float **m, int j, int i0, int n, float *buf)
+{
+    int k;
+
+    for (k = 0; k < n; k++) { buf[k] = m[i0+k][j]; }
+}
+
+static void unpack_row_scalar(float **m, int j, int i0, int n,
+    const float *buf)
+{
+    int k;
+
+    for (k = 0; k < n; k++) { m[i0+k][j] = buf[k]; }
+}
+
+/* The same with gathers of a vector of cells of the row at a time, and
+ * with AVX-512 scatters to unpack them. AVX2 has no scatter, so it
+ * unpacks with the plain loop.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SIMD
+
+static __attribute__((target("avx2")))
+void pack_row_avx2(float **m, int j, int i0, int n, float *buf)
+{
+    int k, stride = m[1] - m[0];
+    __m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5,
+        6, 7), _mm256_set1_epi32(stride));
+
+    for (k = 0; k + 8 <= n; k += 8) {
+        _mm256_storeu_ps(buf + k, _mm256_i32gather_ps(&m[i0+k][j], idx, 4));
+    }
+    pack_row_scalar(m, j, i0 + k, n - k, buf + k);
+}
 
-/* A sample program that demonstrates how to time an MPI program, and how to
- * send (parts of) the rows and columns in a two-dimensional array between
- * two processes using MPI.
- * In the matrix representation used here, columns are simple to copy, as
- * column elements are contiguous in memory. Row copying is more complex as
- * consecutive row elements are not contiguous in memory and require the
- * use of derived MPI_Datatypes to perform the copy.
+static __attribute__((target("avx512f")))
+void pack_row_avx512(float **m, int j, int i0, int n, float *buf)
+{
+    int k, stride = m[1] - m[0];
+    __m512i idx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5,
+        6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+
+    for (k = 0; k + 16 <= n; k += 16) {
+        _mm512_storeu_ps(buf + k, _mm512_i32gather_ps(idx, &m[i0+k][j], 4));
+    }
+    pack_row_scalar(m, j, i0 + k, n - k, buf + k);
+}
+
+static __attribute__((target("avx512f")))
+void unpack_row_avx512(float **m, int j, int i0, int n, const float *buf)
+{
+    int k, stride = m[1] - m[0];
+    __m512i idx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5,
+        6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+
+    for (k = 0; k + 16 <= n; k += 16) {
+        _mm512_i32scatter_ps(&m[i0+k][j], idx, _mm512_loadu_ps(buf + k), 4);
+    }
+    unpack_row_scalar(m, j, i0 + k, n - k, buf + k);
+}
+#endif
+
+typedef void (*pack_fn)(float **m, int j, int i0, int n, float *buf);
+typedef void (*unpack_fn)(float **m, int j, int i0, int n,
+    const float *buf);
+
+static pack_fn pack_row_simd = pack_row_scalar;
+static unpack_fn unpack_row_simd = unpack_row_scalar;
+
+/* Pick the widest SIMD pack kernels this CPU supports. Returns their
+ * name.
  */
+static const char *select_simd(void)
+{
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        pack_row_simd = pack_row_avx512;
+        unpack_row_simd = unpack_row_avx512;
+        return "avx512";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        pack_row_simd = pack_row_avx2;
+        return "avx2";
+    }
+#endif
+    return "scalar";
+}
+
 
-void zeromatrix(float **matrix);
-void printmatrix(char *title, float **matrix);
+/* Pack the row to send, for the methods that do */
+static void pack(int method)
+{
+    int pos = 0;
+
+    switch (method) {
+        case METHOD_MPI_PACK:
+            MPI_Pack(&matrix[1][send_row], 1, rowtype, mpi_sendbuf,
+                mpi_packsize, &pos, MPI_COMM_WORLD);
+            break;
+        case METHOD_PACK:
+            pack_row_scalar(matrix, send_row, 1, imax, sendbuf);
+            break;
+        case METHOD_SIMD:
+            pack_row_simd(matrix, send_row, 1, imax, sendbuf);
+            break;
+    }
+}
+
+/* Unpack the row received, for the methods that packed it */
+static void unpack(int method)
+{
+    int pos = 0;
+
+    switch (method) {
+        case METHOD_MPI_PACK:
+            MPI_Unpack(mpi_recvbuf, mpi_packsize, &pos,
+                &matrix[1][recv_row], 1, rowtype, MPI_COMM_WORLD);
+            break;
+        case METHOD_PACK:
+            unpack_row_scalar(matrix, recv_row, 1, imax, recvbuf);
+            break;
+        case METHOD_SIMD:
+            unpack_row_simd(matrix, recv_row, 1, imax, recvbuf);
+            break;
+    }
+}
+
+/* Exchange a halo with the partner by method */
+static void exchange(int method)
+{
+    switch (method) {
+        case METHOD_COLUMN:
+            MPI_Sendrecv(&matrix[send_col][1], jmax, MPI_FLOAT, partner, 0,
+                &matrix[recv_col][1], jmax, MPI_FLOAT, partner, 0,
+                MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            break;
+        case METHOD_VECTOR:
+            MPI_Sendrecv(&matrix[1][send_row], 1, rowtype, partner, 0,
+                &matrix[1][recv_row], 1, rowtype, partner, 0,
+                MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            break;
+        case METHOD_SUBARRAY:
+            MPI_Sendrecv(matrix[0], 1, send_sub, partner, 0,
+                matrix[0], 1, recv_sub, partner, 0, MPI_COMM_WORLD,
+                MPI_STATUS_IGNORE);
+            break;
+        case METHOD_MPI_PACK:
+            pack(method);
+            MPI_Sendrecv(mpi_sendbuf, mpi_packsize, MPI_PACKED, partner, 0,
+                mpi_recvbuf, mpi_packsize, MPI_PACKED, partner, 0,
+                MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            unpack(method);
+            break;
+        case METHOD_PACK: case METHOD_SIMD:
+            pack(method);
+            MPI_Sendrecv(sendbuf, imax, MPI_FLOAT, partner, 0, recvbuf, imax,
+                MPI_FLOAT, partner, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            unpack(method);
+            break;
+    }
+}
+
+/* The value of cell (i, j) of process r's matrix */
+static float cell(int r, int i, int j)
+{
+    return r*4000000.0f + i*1000.0f + j;
+}
+
+/* Whether one exchange by method fills this process's halo with the
+ * partner's cells
+ */
+static int check(int method)
+{
+    int i, j, ok = 1;
+
+    for (i = 0; i <= imax+1; i++) {
+        for (j = 0; j <= jmax+1; j++) {
+            matrix[i][j] = (i == recv_col || j == recv_row) ? 0.0f :
+                cell(proc, i, j);
+        }
+    }
+    exchange(method);
+    if (method == METHOD_COLUMN) {
+        for (j = 1; j <= jmax; j++) {
+            ok &= matrix[recv_col][j] == cell(partner, (partner == 0) ?
+                imax : 1, j);
+        }
+    } else {
+        for (i = 1; i <= imax; i++) {
+            ok &= matrix[i][recv_row] == cell(partner, i, (partner == 0) ?
+                jmax : 1);
+        }
+    }
+    return ok;
+}
 
 int main(int argc, char **argv)
 {
-    double t;
-    int i, j, n, p;
+    int i, m, n, count = 1000, cells;
+    int want[NMETHODS];
+    int show_help = 0, show_usage = 0, show_version = 0;
+    int sizes[2], sub[2], start[2];
+    char *name;
+    const char *simd;
+    double t, tmax, tpack;
+
+    progname = argv[0];
+    for (m = 0; m < NMETHODS; m++) { want[m] = 1; }
+
+    int optc;
+    while ((optc = getopt_long(argc, argv, GETOPTS, long_opts, NULL)) != -1) {
+        switch (optc) {
+            case 'h':
+                show_help = 1;
+                break;
+            case 'V':
+                show_version = 1;
+                break;
+            case 'x':
+                imax = atoi(optarg);
+                if (imax < 1) { show_usage = 1; }
+                break;
+            case 'y':
+                jmax = atoi(optarg);
+                if (jmax < 1) { show_usage = 1; }
+                break;
+            case 'c':
+                count = atoi(optarg);
+                if (count < 1) { show_usage = 1; }
+                break;
+            case 'm':
+                for (m = 0; m < NMETHODS; m++) { want[m] = 0; }
+                for (name = strtok(optarg, ","); name;
+                    name = strtok(NULL, ",")) {
+                    for (m = 0; m < NMETHODS; m++) {
+                        if (strcasecmp(name, method_names[m]) == 0) { break; }
+                    }
+                    if (m == NMETHODS) {
+                        fprintf(stderr, "%s: Invalid method '%s'\n", progname,
+                            name);
+                        show_usage = 1;
+                    } else {
+                        want[m] = 1;
+                    }
+                }
+                break;
+            default:
+                show_usage = 1;
+        }
+    }
+
+    if (show_version) {
+        print_version();
+        if (!show_help) {
+            return 0;
+        }
+    }
+
+    if (show_help) {
+        print_help();
+        return 0;
+    }
+
+    if (show_usage || optind < argc) {
+        print_usage();
+        return 1;
+    }
+
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &n);
-    MPI_Comm_rank(MPI_COMM_WORLD, &p);
+    MPI_Comm_rank(MPI_COMM_WORLD, &proc);
 
     if (n != 2) {
-        printf("Must be run on exactly 2 processors.\n");
+        if (proc == 0) {
+            fprintf(stderr, "%s must be run on exactly 2 processors.\n",
+                progname);
+        }
         MPI_Finalize();
         return 1;
     }
+    partner = 1 - proc;
 
-    t = MPI_Wtime();
+    /* Process 0 sends its last row and column and receives into the halo
+     * after them; process 1 sends its first and receives into the halo
+     * before them
+     */
+    send_row = (proc == 0) ? jmax : 1;
+    recv_row = (proc == 0) ? jmax+1 : 0;
+    send_col = (proc == 0) ? imax : 1;
+    recv_col = (proc == 0) ? imax+1 : 0;
 
-    /* Allocate an COLS * ROWS array. */
-    float **matrix = alloc_floatmatrix(COLS, ROWS);
+    matrix = alloc_floatmatrix(imax+2, jmax+2);
+    sendbuf = malloc(imax * sizeof(float));
+    recvbuf = malloc(imax * sizeof(float));
+    if (!matrix || !sendbuf || !recvbuf) {
+        fprintf(stderr, "Couldn't allocate memory for the matrix.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
-    /* Fill processor 1's matrix with numbers */
-    for (i = 0; i < COLS; i++) {
-        for ( j = 0; j < ROWS; j++) {
-            matrix[i][j] = (i * 10) + j;
-        }
+    /* The interior cells of a row, as a vector from its first one, and as
+     * subarrays of the whole matrix. The matrix's first index, the
+     * column, varies slowest, as in C.
+     */
+    MPI_Type_vector(imax, 1, jmax+2, MPI_FLOAT, &rowtype);
+    MPI_Type_commit(&rowtype);
+    sizes[0] = imax+2;
+    sizes[1] = jmax+2;
+    sub[0] = imax;
+    sub[1] = 1;
+    start[0] = 1;
+    start[1] = send_row;
+    MPI_Type_create_subarray(2, sizes, sub, start, MPI_ORDER_C, MPI_FLOAT,
+        &send_sub);
+    MPI_Type_commit(&send_sub);
+    start[1] = recv_row;
+    MPI_Type_create_subarray(2, sizes, sub, start, MPI_ORDER_C, MPI_FLOAT,
+        &recv_sub);
+    MPI_Type_commit(&recv_sub);
+
+    MPI_Pack_size(1, rowtype, MPI_COMM_WORLD, &mpi_packsize);
+    mpi_sendbuf = malloc(mpi_packsize);
+    mpi_recvbuf = malloc(mpi_packsize);
+    if (!mpi_sendbuf || !mpi_recvbuf) {
+        fprintf(stderr, "Couldn't allocate memory for the matrix.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    simd = select_simd();
 
-    /* Define two MPI_Datatypes for rows that we use later */
-    MPI_Datatype fullrowtype, partrowtype;
-    MPI_Type_vector(ROWS, 1, ROWS, MPI_FLOAT, &fullrowtype);
-    MPI_Type_commit(&fullrowtype);
-    MPI_Type_vector(3, 1, ROWS, MPI_FLOAT, &partrowtype);
-    MPI_Type_commit(&partrowtype);
-
-    if (p == 0) {
-        MPI_Status s;
-
-        zeromatrix(matrix);
-        MPI_Recv(matrix[4], ROWS, MPI_FLOAT, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving column 4:", matrix);
-
-        zeromatrix(matrix);
-        MPI_Recv(&matrix[6][2], 4, MPI_FLOAT, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving column 6, rows 3-5:", matrix);
-
-        zeromatrix(matrix);
-        MPI_Recv(matrix[3], ROWS*2, MPI_FLOAT, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving column 3 and 4:", matrix);
-
-        zeromatrix(matrix);
-        MPI_Recv(matrix[0], ROWS*COLS, MPI_FLOAT, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving all columns:", matrix);
-
-        zeromatrix(matrix);
-        MPI_Recv(&matrix[0][6], 1, fullrowtype, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving row 6:", matrix);
-       
-        zeromatrix(matrix); 
-        MPI_Recv(&matrix[0][1], 1, partrowtype, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving row 1 cols 0-2:", matrix);
-        
-        zeromatrix(matrix); 
-        MPI_Recv(&matrix[4][1], 1, partrowtype, 1, 0, MPI_COMM_WORLD, &s);
-        printmatrix("After receiving row 1 cols 4-6:", matrix);
-    } else {
-        /* Send all of column 4 to processor 0 */
-        MPI_Send(matrix[4], ROWS, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+    if (proc == 0) {
+        printf("Matrix of %dx%d floats: columns of %d cells, rows of %d\n",
+            imax+2, jmax+2, jmax, imax);
+        printf("%-15s %6s %12s %10s %10s %6s\n", "method", "cells",
+            "latency(us)", "pack(us)", "MB/s", "check");
+    }
 
-        /* Send column 6 rows 2-5 to processor 0 */
-        MPI_Send(&matrix[6][2], 4, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+    for (m = 0; m < NMETHODS; m++) {
+        int ok, all;
 
-        /* Send columns 3 and 4 to processor 0 */
-        MPI_Send(matrix[3], ROWS*2, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+        if (!want[m]) { continue; }
+        cells = (m == METHOD_COLUMN) ? jmax : imax;
 
-        /* Send the entire matrix (ie all columns) to processor 0 */
-        MPI_Send(matrix[0], ROWS*COLS, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
+        ok = check(m);
+        MPI_Reduce(&ok, &all, 1, MPI_INT, MPI_LAND, 0, MPI_COMM_WORLD);
 
-        /* Send row 6 to processor 0 */
-        MPI_Send(&matrix[0][6], 1, fullrowtype, 0, 0, MPI_COMM_WORLD);
-        
-        /* Send row 1 cols 0-2 to processor 0 */
-        MPI_Send(&matrix[0][1], 1, partrowtype, 0, 0, MPI_COMM_WORLD);
-        
-        /* Send row 1 cols 4-6 to processor 0 */
-        MPI_Send(&matrix[4][1], 1, partrowtype, 0, 0, MPI_COMM_WORLD);
-    }
-    if (p == 0) {
+        /* Time the exchanges, after a few to warm up, and the packing and
+         * unpacking on their own
+         */
+        for (i = 0; i < (count+9) / 10; i++) { exchange(m); }
+        MPI_Barrier(MPI_COMM_WORLD);
+        t = MPI_Wtime();
+        for (i = 0; i < count; i++) { exchange(m); }
         t = MPI_Wtime() - t;
-        printf("Program took %f secs to run.\n", t);
+        MPI_Reduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+        tpack = MPI_Wtime();
+        for (i = 0; i < count; i++) {
+            pack(m);
+            unpack(m);
+        }
+        tpack = MPI_Wtime() - tpack;
+
+        /* The throughput counts the halo going both ways */
+        if (proc == 0) {
+            char label[32];
+
+            if (m == METHOD_SIMD) {
+                snprintf(label, sizeof(label), "%s (%s)", method_names[m],
+                    simd);
+            } else {
+                snprintf(label, sizeof(label), "%s", method_names[m]);
+            }
+            printf("%-15s %6d %12.3f ", label, cells, tmax / count * 1e6);
+            if (m >= METHOD_MPI_PACK) {
+                printf("%10.3f ", tpack / count * 1e6);
+            } else {
+                printf("%10s ", "-");
+            }
+            printf("%10.2f %6s\n", 2.0 * cells * sizeof(float) /
+                (tmax / count) / 1e6, all ? "ok" : "WRONG");
+        }
     }
 
     /* Free the matrix we allocated */
     free_matrix(matrix);
+    free(sendbuf);
+    free(recvbuf);
+    free(mpi_sendbuf);
+    free(mpi_recvbuf);
 
     /* Free the derived MPI_Datatypes */
-    MPI_Type_free(&fullrowtype);
-    MPI_Type_free(&partrowtype);
+    MPI_Type_free(&rowtype);
+    MPI_Type_free(&send_sub);
+    MPI_Type_free(&recv_sub);
 
     MPI_Finalize();
     return 0;
 }
 
-void zeromatrix(float **matrix)
+static void print_usage(void)
 {
-    int i, j;
-    for ( j = 0; j < ROWS; j++) {
-        for ( i = 0; i < COLS; i++) {
-            matrix[i][j] = 0.0;
-        }
-    }
+    fprintf(stderr, "Try '%s --help' for more information.\n", progname);
 }
-void printmatrix(char *title, float **matrix)
+
+static void print_version(void)
 {
-    int i, j;
-    printf("%s\n", title);
-    for ( j = 0; j < ROWS; j++) {
-        for ( i = 0; i < COLS; i++) {
-            printf("%02g ", matrix[i][j]);
-        }
-        printf("\n");
-    }
-    printf("\n");
+    fprintf(stderr, "%s %s\n", PACKAGE, VERSION);
+}
+
+static void print_help(void)
+{
+    fprintf(stderr, "%s. A benchmark of the ways to send matrix halos with MPI.\n\n",
+        PACKAGE);
+    fprintf(stderr, "Usage %s [OPTIONS]\n\n", progname);
+    fprintf(stderr, "Run on 2 processes, which exchange a halo of a (IMAX+2)x(JMAX+2)\n");
+    fprintf(stderr, "matrix COUNT times by each method. The time of an exchange, of the\n");
+    fprintf(stderr, "packing and unpacking in it and the throughput both ways are printed,\n");
+    fprintf(stderr, "and whether the right cells arrived.\n\n");
+    fprintf(stderr, "  -h, --help           Print a summary of the options\n");
+    fprintf(stderr, "  -V, --version        Print the version number\n");
+    fprintf(stderr, "  -x, --imax=IMAX      Set the number of interior cells in the X direction\n");
+    fprintf(stderr, "  -y, --jmax=JMAX      Set the number of interior cells in the Y direction\n");
+    fprintf(stderr, "  -c, --count=N        The number of exchanges by each method\n");
+    fprintf(stderr, "                       (default is 1000)\n");
+    fprintf(stderr, "  -m, --method=LIST    Use the comma separated LIST of methods (default\n");
+    fprintf(stderr, "                       is all of them):\n");
+    fprintf(stderr, "                       'column'    a contiguous column\n");
+    fprintf(stderr, "                       'vector'    a row as an MPI_Type_vector\n");
+    fprintf(stderr, "                       'subarray'  a row as an MPI_Type_create_subarray\n");
+    fprintf(stderr, "                       'mpi-pack'  a row packed by MPI_Pack\n");
+    fprintf(stderr, "                       'pack'      a row packed by a loop\n");
+    fprintf(stderr, "                       'simd'      a row packed by SIMD gathers\n");
 }
@@ -2,13 +2,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
-#include <errno.h>
 #include <math.h>
+#include <sys/mman.h>
+#include "statemap.h"
 
 static void print_usage(void);
 static void print_version(void);
 static void print_help(void);
 
+/* How far a field of the second file is from the first's */
+struct norms {
+    double max;                     /* Largest absolute difference */
+    size_t at;                      /* The first cell with it */
+    double rms;                     /* Root mean square difference */
+    double rel;                     /* Relative L2 norm of the difference */
+    size_t nan;                     /* Cells differing by NaN */
+};
+static void field_norms(const struct state *s1, const struct state *s2,
+    int f, struct norms *n);
+static int compare_fields(struct state *s1, struct state *s2, float epsilon,
+    int report);
+
 static char *progname;
 
 #define PACKAGE "diffbin"
@@ -30,14 +44,13 @@ static struct option long_opts[] = {
 #define MODE_OUTPUT_V 2 
 #define MODE_OUTPUT_P 3 
 #define MODE_OUTPUT_FLAGS 4 
+#define MODE_NORMS 5
 
 int main(int argc, char **argv)
 {
-    FILE *f1, *f2;
+    struct state s1, s2;
     int imax, jmax, i, j;
-
-    float *u1, *u2, *v1, *v2, *p1, *p2;
-    char *flags1, *flags2;
+    size_t k;
     float epsilon = 1e-7;
     int mode = MODE_DIFF;
     int show_help = 0, show_usage = 0, show_version = 0;
@@ -66,6 +79,8 @@ int main(int argc, char **argv)
                     mode = MODE_OUTPUT_P;
                 } else if (strcasecmp(optarg, "plot-flags") == 0) {
                     mode = MODE_OUTPUT_FLAGS;
+                } else if (strcasecmp(optarg, "norms") == 0) {
+                    mode = MODE_NORMS;
                 } else {
                     fprintf(stderr, "%s: Invalid mode '%s'\n", progname, optarg);
                     show_usage = 1;
@@ -94,99 +109,245 @@ int main(int argc, char **argv)
     }
 
 
-    if ((f1 = fopen(argv[optind], "rb"))  == NULL) {
-        fprintf(stderr, "Could not open '%s': %s\n", argv[optind],
-            strerror(errno));
-        return 1;
-    }
-    if ((f2 = fopen(argv[optind+1], "rb"))  == NULL) {
-        fprintf(stderr, "Could not open '%s': %s\n", argv[optind+1],
-            strerror(errno));
+    /* Either version of the format; version 2 files are mapped, and
+     * their fields compared in place
+     */
+    if (state_open(argv[optind], &s1) || state_open(argv[optind+1], &s2)) {
         return 1;
     }
 
-    fread(&imax, sizeof(int), 1, f1);
-    fread(&jmax, sizeof(int), 1, f1);
-    fread(&i, sizeof(int), 1, f2);
-    fread(&j, sizeof(int), 1, f2);
-    if (i != imax || j != jmax) {
-        printf("Number of cells differ! (%dx%d vs %dx%d)\n", imax, jmax, i, j);
+    imax = s1.imax;
+    jmax = s1.jmax;
+    if (s2.imax != imax || s2.jmax != jmax) {
+        printf("Number of cells differ! (%dx%d vs %dx%d)\n", imax, jmax,
+            s2.imax, s2.jmax);
         return 1;
     }
 
-    float xlength1, ylength1, xlength2, ylength2;
-    fread(&xlength1, sizeof(float), 1, f1);
-    fread(&ylength1, sizeof(float), 1, f1);
-    fread(&xlength2, sizeof(float), 1, f2);
-    fread(&ylength2, sizeof(float), 1, f2);
-    if (xlength1 != xlength2 || ylength1 != ylength2) {
+    if ((float) s1.xlength != (float) s2.xlength ||
+        (float) s1.ylength != (float) s2.ylength) {
         printf("Image domain dimensions differ! (%gx%g vs %gx%g)\n",
-            xlength1, ylength1, xlength2, ylength2);
-        return 1;
-    }
-
-    u1 = malloc(sizeof(float) * (jmax + 2));
-    u2 = malloc(sizeof(float) * (jmax + 2));
-    v1 = malloc(sizeof(float) * (jmax + 2));
-    v2 = malloc(sizeof(float) * (jmax + 2));
-    p1 = malloc(sizeof(float) * (jmax + 2));
-    p2 = malloc(sizeof(float) * (jmax + 2));
-    flags1 = malloc(jmax + 2);
-    flags2 = malloc(jmax + 2);
-    if (!u1 || !u2 || !v1 || !v2 || !p1 || !p2 || !flags1 || !flags2) {
-        fprintf(stderr, "Couldn't allocate enough memory.\n");
+            s1.xlength, s1.ylength, s2.xlength, s2.ylength);
         return 1;
     }
 
     int diff_found = 0;
-    for (i = 0; i < imax + 2 && !diff_found; i++) {
-        fread(u1, sizeof(float), jmax + 2, f1);
-        fread(v1, sizeof(float), jmax + 2, f1);
-        fread(p1, sizeof(float), jmax + 2, f1);
-        fread(flags1, 1, jmax + 2, f1);
-        fread(u2, sizeof(float), jmax + 2, f2);
-        fread(v2, sizeof(float), jmax + 2, f2);
-        fread(p2, sizeof(float), jmax + 2, f2);
-        fread(flags2, 1, jmax + 2, f2);
-        for (j = 0; j < jmax + 2 && !diff_found; j++) {
-            float du, dv, dp;
-            int dflags;
-            du = u1[j] - u2[j];
-            dv = v1[j] - v2[j];
-            dp = p1[j] - p2[j];
-            dflags = flags1[j] - flags2[j];
-            switch (mode) {
-                case MODE_DIFF:
-                    if (fabs(du) > epsilon || fabs(dv) > epsilon ||
-                        fabs(dp) > epsilon || fabs(dflags) > epsilon) {
-                        diff_found = 1; 
-                    }
-                    break;
-                case MODE_OUTPUT_U:
-                    printf("%g%c", du, (j==jmax+1)?'\n':' ');
-                    break;
-                case MODE_OUTPUT_V:
-                    printf("%g%c", dv, (j==jmax+1)?'\n':' ');
-                    break;
-                case MODE_OUTPUT_P:
-                    printf("%g%c", dp, (j==jmax+1)?'\n':' ');
-                    break;
-                case MODE_OUTPUT_FLAGS:
-                    printf("%d%c", dflags, (j==jmax+1)?'\n':' ');
-                    break;
+    if (mode == MODE_DIFF || mode == MODE_NORMS) {
+        diff_found = compare_fields(&s1, &s2, epsilon, mode == MODE_NORMS);
+    } else {
+        for (i = 0; i < imax + 2; i++) {
+            for (j = 0; j < jmax + 2; j++) {
+                float du, dv, dp;
+                int dflags;
+                k = (size_t) i*(jmax + 2) + j;
+                du = state_get(&s1, STATE_U, k) - state_get(&s2, STATE_U, k);
+                dv = state_get(&s1, STATE_V, k) - state_get(&s2, STATE_V, k);
+                dp = state_get(&s1, STATE_P, k) - state_get(&s2, STATE_P, k);
+                dflags = ((char *) s1.field[STATE_FLAG])[k] -
+                    ((char *) s2.field[STATE_FLAG])[k];
+                switch (mode) {
+                    case MODE_OUTPUT_U:
+                        printf("%g%c", du, (j==jmax+1)?'\n':' ');
+                        break;
+                    case MODE_OUTPUT_V:
+                        printf("%g%c", dv, (j==jmax+1)?'\n':' ');
+                        break;
+                    case MODE_OUTPUT_P:
+                        printf("%g%c", dp, (j==jmax+1)?'\n':' ');
+                        break;
+                    case MODE_OUTPUT_FLAGS:
+                        printf("%d%c", dflags, (j==jmax+1)?'\n':' ');
+                        break;
+                }
             }
         }
     }
+    state_close(&s1);
+    state_close(&s2);
     if (diff_found) {
         printf("Files differ.\n");
         return 1;
     }
-    if (mode == MODE_DIFF) {
+    if (mode == MODE_DIFF || mode == MODE_NORMS) {
         printf("Files identical.\n");
     }
     return 0;
 }
 
+/* Compare the fields of two states, and print their norms if report is
+ * set. Returns non-zero if they differ by more than epsilon.
+ */
+static int compare_fields(struct state *s1, struct state *s2, float epsilon,
+    int report)
+{
+    struct norms n[STATE_NFIELDS];
+    static const char *names[STATE_NFIELDS] = { "u", "v", "p", "flag" };
+    int f, i, j, diff_found = 0;
+
+    /* The whole of both files is read */
+    for (f = 0; f < 2; f++) {
+        struct state *s = (f == 0) ? s1 : s2;
+        if (s->map != NULL) {
+            madvise(s->map, s->maplen, MADV_WILLNEED);
+        }
+    }
+    if (report) {
+        printf("field      max abs         at (i, j)          rms"
+            "       rel L2\n");
+    }
+    for (f = 0; f < STATE_NFIELDS; f++) {
+        field_norms(s1, s2, f, &n[f]);
+        if (n[f].max > epsilon || n[f].nan > 0) {
+            diff_found = 1;
+        }
+        if (!report) {
+            continue;
+        }
+        i = n[f].at / (s1->jmax + 2);
+        j = n[f].at % (s1->jmax + 2);
+        printf("%-5s %12.5e  (%5d, %5d) %12.5e %12.5e", names[f],
+            n[f].max, i, j, n[f].rms, n[f].rel);
+        if (n[f].nan > 0) {
+            printf("  %zu NaN", n[f].nan);
+        }
+        printf("\n");
+    }
+    return diff_found;
+}
+
+/* The fields are compared a block of cells at a time. For each pair of
+ * element types there is a kernel that adds up the squares of the
+ * differences and of the first file's values over cells k0..k1-1, counts
+ * the NaN differences and returns the largest absolute difference, and
+ * one that finds the first cell with a given difference. The loops are
+ * vectorised; only a block with a new largest difference is looked at
+ * again.
+ */
+#define BLOCK 4096
+
+struct block_sums {
+    double sum2, ref2;
+    size_t nan;
+};
+
+#define NORMS_KERNELS(name, T1, T2)                                         \
+static double name ## _max(const void *f1, const void *f2, size_t k0,       \
+    size_t k1, struct block_sums *b)                                        \
+{                                                                           \
+    const T1 *x = f1;                                                       \
+    const T2 *y = f2;                                                       \
+    double m = 0.0, s = 0.0, r = 0.0;                                       \
+    size_t k, nan = 0;                                                      \
+                                                                            \
+    _Pragma("omp simd reduction(max:m) reduction(+:s,r,nan)")               \
+    for (k = k0; k < k1; k++) {                                             \
+        double d = (double) x[k] - (double) y[k];                          \
+        s += d*d;                                                           \
+        r += (double) x[k] * x[k];                                          \
+        nan += (d != d);                                                    \
+        d = fabs(d);                                                        \
+        m = (d > m) ? d : m;                                                \
+    }                                                                       \
+    b->sum2 = s;                                                            \
+    b->ref2 = r;                                                            \
+    b->nan = nan;                                                           \
+    return m;                                                               \
+}                                                                           \
+                                                                            \
+static size_t name ## _find(const void *f1, const void *f2, size_t k0,      \
+    size_t k1, double m)                                                    \
+{                                                                           \
+    const T1 *x = f1;                                                       \
+    const T2 *y = f2;                                                       \
+    size_t k;                                                               \
+                                                                            \
+    for (k = k0; k < k1; k++) {                                             \
+        if (fabs((double) x[k] - (double) y[k]) == m) { break; }           \
+    }                                                                       \
+    return k;                                                               \
+}
+
+NORMS_KERNELS(ff, float, float)
+NORMS_KERNELS(fd, float, double)
+NORMS_KERNELS(df, double, float)
+NORMS_KERNELS(dd, double, double)
+NORMS_KERNELS(cc, char, char)
+
+typedef double (*max_kernel)(const void *, const void *, size_t, size_t,
+    struct block_sums *);
+typedef size_t (*find_kernel)(const void *, const void *, size_t, size_t,
+    double);
+
+/* Compare field f of two states, sharing the blocks out among the threads.
+ * The sums are kept per block and added up in order, so the results don't
+ * depend on the number of threads.
+ */
+static void field_norms(const struct state *s1, const struct state *s2,
+    int f, struct norms *n)
+{
+    static const max_kernel maxes[2][2] = {
+        { ff_max, fd_max }, { df_max, dd_max }
+    };
+    static const find_kernel finds[2][2] = {
+        { ff_find, fd_find }, { df_find, dd_find }
+    };
+    size_t cells = (size_t) (s1->imax+2) * (s1->jmax+2);
+    long b, nblocks = (cells + BLOCK-1) / BLOCK;
+    max_kernel kmax = cc_max;
+    find_kernel kfind = cc_find;
+    const void *f1 = s1->field[f], *f2 = s2->field[f];
+    struct block_sums *sums = malloc(nblocks * sizeof(*sums));
+    double sum2 = 0.0, ref2 = 0.0;
+
+    if (f != STATE_FLAG) {
+        int t1 = (s1->type[f] == STATE_FLOAT64);
+        int t2 = (s2->type[f] == STATE_FLOAT64);
+        kmax = maxes[t1][t2];
+        kfind = finds[t1][t2];
+    }
+    if (sums == NULL) {
+        fprintf(stderr, "Couldn't allocate memory.\n");
+        exit(1);
+    }
+    n->max = -1.0;
+    n->at = 0;
+
+    #pragma omp parallel
+    {
+        double m, best = -1.0;
+        size_t at = 0, k0, k1;
+
+        /* Each thread has a run of blocks, so its first worst cell is the
+         * first in the run
+         */
+        #pragma omp for schedule(static)
+        for (b = 0; b < nblocks; b++) {
+            k0 = (size_t) b * BLOCK;
+            k1 = (k0 + BLOCK < cells) ? k0 + BLOCK : cells;
+            m = kmax(f1, f2, k0, k1, &sums[b]);
+            if (m > best) {
+                best = m;
+                at = kfind(f1, f2, k0, k1, m);
+            }
+        }
+        #pragma omp critical
+        if (best > n->max || (best == n->max && at < n->at)) {
+            n->max = best;
+            n->at = at;
+        }
+    }
+
+    n->nan = 0;
+    for (b = 0; b < nblocks; b++) {
+        sum2 += sums[b].sum2;
+        ref2 += sums[b].ref2;
+        n->nan += sums[b].nan;
+    }
+    free(sums);
+    n->rms = sqrt(sum2 / cells);
+    n->rel = (sum2 == 0.0) ? 0.0 : sqrt(sum2 / ref2);
+}
+
 static void print_usage(void)
 {
     fprintf(stderr, "Try '%s --help' for more information.\n", progname);
@@ -205,9 +366,14 @@ static void print_help(void)
     fprintf(stderr, "  -h, --help            Print a summary of the options\n");
     fprintf(stderr, "  -V, --version         Print the version number\n");
     fprintf(stderr, "  -e, --epsilon=EPSILON Set epsilon: the maximum allowed difference\n");
-    fprintf(stderr, "  -m, --mode=MODE       Set the mode, may be one of 'diff', 'plot-u',\n");
-    fprintf(stderr, "                        'plot-v', 'plot-p', or 'plot-flags'. The plot\n");
-    fprintf(stderr, "                        modes produce output ready to be used by the\n");
+    fprintf(stderr, "  -m, --mode=MODE       Set the mode, may be one of 'diff', 'norms',\n");
+    fprintf(stderr, "                        'plot-u', 'plot-v', 'plot-p', or 'plot-flags'.\n");
+    fprintf(stderr, "                        'norms' reports the largest absolute difference\n");
+    fprintf(stderr, "                        in each field and where it is, the RMS\n");
+    fprintf(stderr, "                        difference and the L2 norm of the difference\n");
+    fprintf(stderr, "                        relative to FILE1. Like 'diff', it fails if a\n");
+    fprintf(stderr, "                        difference is over epsilon. The plot modes\n");
+    fprintf(stderr, "                        produce output ready to be used by the\n");
     fprintf(stderr, "                        'splot matrix' command in gnuplot.\n");
 }
 
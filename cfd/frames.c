@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <mpi.h>
+#include "datadef.h"
+#include "frames.h"
+
+extern int ileft, iright, jbottom, jtop;
+extern int nprocs, proc;
+extern MPI_Comm cart_comm;
+extern int nbr_south, nbr_north;
+
+/* Images of the flow, drawn while the simulation runs instead of from
+ * saved states with bin2ppm. Each process draws its own block of the
+ * image the way bin2ppm draws the whole of it, so a frame matches the
+ * bin2ppm image of the same state. The blocks are put together either by
+ * one collective MPI-IO write per frame, or, with a frame writer, by the
+ * last process of MPI_COMM_WORLD, which is left out of the process grid
+ * and receives each block straight into its place in the image.
+ */
+int frame_every = 0;                /* Timesteps between frames, 0 for
+                                       none */
+int frame_plot = FRAME_ZETA;        /* What the frames show */
+int frame_writer = 0;               /* The last process writes the frames */
+char *frame_file = "frame.ppm";     /* Frames are written to this with the
+                                       step number before the extension.
+                                       A .pgm one is greyscale */
+
+#define TAG_HEAD   20               /* Step number and block of a frame */
+#define TAG_PIXELS 21
+#define TAG_PSI    22
+
+static int fr_imax, fr_jmax;
+static float fr_delx, fr_dely;
+static int bpp;                     /* Bytes per pixel */
+static int width, height;           /* Of this process's block */
+static unsigned char *pixels;       /* The block of the image */
+static float *psi_row;              /* psi along the top of a block */
+static MPI_Datatype slab;           /* The block's place in the image */
+static int head[5];
+static MPI_Request reqs[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+
+
+/* Bytes per pixel in the frames: 1 for a PGM file, or 3 for a PPM one */
+static int frame_bpp(void)
+{
+    const char *dot = strrchr(frame_file, '.');
+
+    return (dot != NULL && strcasecmp(dot, ".pgm") == 0) ? 1 : 3;
+}
+
+/* The file name for the frame of timestep iters. Free it with free(). */
+static char *frame_name(int iters)
+{
+    const char *dot = strrchr(frame_file, '.');
+    int n = (dot != NULL && strchr(dot, '/') == NULL) ? dot - frame_file :
+        strlen(frame_file);
+    char *name = malloc(strlen(frame_file) + 16);
+
+    if (name != NULL) {
+        sprintf(name, "%.*s-%06d%s", n, frame_file, iters, frame_file + n);
+    }
+    return name;
+}
+
+/* Write the header of a frame into buf. Returns its length. */
+static int frame_header(char *buf, size_t size, int imax, int jmax)
+{
+    return snprintf(buf, size, "P%d %d %d 255\n", (bpp == 1) ? 5 : 6,
+        imax, jmax);
+}
+
+/* The block of cells il..ir x jb..jt within the pixels of an image, in
+ * bytes. The image's first row is j = 1, as bin2ppm writes it.
+ */
+static MPI_Datatype image_block(int imax, int jmax, int il, int ir, int jb,
+    int jt)
+{
+    int sizes[2] = { jmax, imax*bpp };
+    int sub[2] = { jt-jb+1, (ir-il+1)*bpp };
+    int start[2] = { jb-1, (il-1)*bpp };
+    MPI_Datatype block;
+
+    MPI_Type_create_subarray(2, sizes, sub, start, MPI_ORDER_C, MPI_BYTE,
+        &block);
+    MPI_Type_commit(&block);
+    return block;
+}
+
+
+/* Allocate the block of the image, if frames are wanted */
+void frame_setup(int imax, int jmax, real delx, real dely)
+{
+    if (frame_every <= 0) { return; }
+
+    fr_imax = imax;
+    fr_jmax = jmax;
+    fr_delx = delx;
+    fr_dely = dely;
+    bpp = frame_bpp();
+    width = iright - ileft + 1;
+    height = jtop - jbottom + 1;
+    pixels = malloc((size_t) width * height * bpp);
+    psi_row = malloc(width * sizeof(float));
+    if (!pixels || !psi_row) {
+        fprintf(stderr, "Couldn't allocate memory for frames.\n");
+        exit(1);
+    }
+    slab = image_block(imax, jmax, ileft, iright, jbottom, jtop);
+}
+
+/* Whether to draw a frame of the state before timestep iters */
+int frame_due(int iters)
+{
+    return frame_every > 0 && iters % frame_every == 0;
+}
+
+/* Draw this process's block of the image from the velocities, in single
+ * precision like bin2ppm. The vorticity needs only the halos, but the
+ * stream function sums u up each column, so the blocks of a column of the
+ * process grid take their turns from the bottom up.
+ */
+static void render(real **u, real **v, char **flag)
+{
+    int i, imax = fr_imax, jmax = fr_jmax;
+
+    if (frame_plot == FRAME_PSI) {
+        for (i = 0; i < width; i++) { psi_row[i] = 0.0; }
+        MPI_Recv(psi_row, width, MPI_FLOAT, nbr_south, TAG_PSI, cart_comm,
+            MPI_STATUS_IGNORE);
+    }
+
+    #pragma omp parallel for
+    for (i = ileft; i <= iright; i++) {
+        int j, c;
+        float z, psi = psi_row[i-ileft];
+        unsigned char *px = pixels + (i-ileft)*bpp;
+
+        for (j = jbottom; j <= jtop; j++, px += width*bpp) {
+            if (frame_plot == FRAME_PSI &&
+                ((flag[i][j] & C_F) || (flag[i+1][j] & C_F))) {
+                psi += (float) u[i][j]*fr_dely;
+            }
+            if (!(flag[i][j] & C_F)) {
+                /* Obstacles are green, or black in greyscale */
+                memset(px, 0, bpp);
+                if (bpp == 3) { px[1] = 255; }
+                continue;
+            }
+
+            z = 0.0;
+            if (i < imax && j < jmax) {
+                if (frame_plot == FRAME_PSI) {
+                    z = psi;
+                } else if ((flag[i+1][j] & C_F) && (flag[i][j+1] & C_F) &&
+                    (flag[i+1][j+1] & C_F)) {
+                    z = ((float) u[i][j+1] - (float) u[i][j])/fr_dely
+                       -((float) v[i+1][j] - (float) v[i][j])/fr_delx;
+                }
+            }
+            if (frame_plot == FRAME_PSI) {
+                c = (z+3.0)/7.5 * 255;
+            } else {
+                c = pow(fabs(z/12.6), .4) * 255;
+            }
+            memset(px, c, bpp);
+        }
+        psi_row[i-ileft] = psi;
+    }
+
+    if (frame_plot == FRAME_PSI) {
+        MPI_Send(psi_row, width, MPI_FLOAT, nbr_north, TAG_PSI, cart_comm);
+    }
+}
+
+/* Write a frame with every process writing its own block */
+static void write_frame(char *file)
+{
+    char header[64], msg[MPI_MAX_ERROR_STRING];
+    int len = frame_header(header, sizeof(header), fr_imax, fr_jmax);
+    int err, n;
+    MPI_File fh;
+
+    err = MPI_File_open(cart_comm, file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        MPI_INFO_NULL, &fh);
+    if (err == MPI_SUCCESS) {
+        MPI_File_set_size(fh, 0);
+        if (proc == 0) {
+            MPI_File_write_at(fh, 0, header, len, MPI_BYTE,
+                MPI_STATUS_IGNORE);
+        }
+        MPI_File_set_view(fh, len, MPI_BYTE, slab, "native", MPI_INFO_NULL);
+        err = MPI_File_write_all(fh, pixels, width*height*bpp, MPI_BYTE,
+            MPI_STATUS_IGNORE);
+        MPI_File_close(&fh);
+    }
+    if (err != MPI_SUCCESS && proc == 0) {
+        MPI_Error_string(err, msg, &n);
+        fprintf(stderr, "Could not write frame '%s': %s\n", file, msg);
+    }
+}
+
+/* Draw and save a frame of the state before timestep iters. With a frame
+ * writer the block is sent to it and the caller carries on.
+ */
+void frame_save(real **u, real **v, char **flag, int iters)
+{
+    char *name;
+
+    /* The last frame's block has to have gone before it is overwritten */
+    MPI_Waitall(2, reqs, MPI_STATUSES_IGNORE);
+    render(u, v, flag);
+
+    if (frame_writer) {
+        head[0] = iters;
+        head[1] = ileft;
+        head[2] = iright;
+        head[3] = jbottom;
+        head[4] = jtop;
+        MPI_Isend(head, 5, MPI_INT, nprocs, TAG_HEAD, MPI_COMM_WORLD,
+            &reqs[0]);
+        MPI_Isend(pixels, width*height*bpp, MPI_BYTE, nprocs, TAG_PIXELS,
+            MPI_COMM_WORLD, &reqs[1]);
+    } else if ((name = frame_name(iters)) != NULL) {
+        write_frame(name);
+        free(name);
+    }
+}
+
+/* Finish sending the last frame and tell the frame writer there are no
+ * more
+ */
+void frame_finish(void)
+{
+    if (frame_every <= 0) { return; }
+
+    MPI_Waitall(2, reqs, MPI_STATUSES_IGNORE);
+    if (frame_writer) {
+        head[0] = -1;
+        MPI_Send(head, 5, MPI_INT, nprocs, TAG_HEAD, MPI_COMM_WORLD);
+    }
+    free(pixels);
+    free(psi_row);
+    MPI_Type_free(&slab);
+}
+
+/* Run the frame writer: put together each frame from the blocks the
+ * nprocs processes of the grid send, and write it out, until they have
+ * finished
+ */
+void frame_writer_loop(int imax, int jmax)
+{
+    char header[64], *name;
+    int r, len, h[5];
+    size_t size;
+    unsigned char *image;
+    MPI_Datatype block;
+    FILE *fp;
+
+    bpp = frame_bpp();
+    len = frame_header(header, sizeof(header), imax, jmax);
+    size = (size_t) imax * jmax * bpp;
+    if ((image = malloc(size)) == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for frames.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (;;) {
+        for (r = 0; r < nprocs; r++) {
+            MPI_Recv(h, 5, MPI_INT, r, TAG_HEAD, MPI_COMM_WORLD,
+                MPI_STATUS_IGNORE);
+            if (h[0] < 0) { continue; }
+            block = image_block(imax, jmax, h[1], h[2], h[3], h[4]);
+            MPI_Recv(image, 1, block, r, TAG_PIXELS, MPI_COMM_WORLD,
+                MPI_STATUS_IGNORE);
+            MPI_Type_free(&block);
+        }
+        if (h[0] < 0) { break; }
+
+        if ((name = frame_name(h[0])) == NULL) { continue; }
+        fp = fopen(name, "wb");
+        if (fp == NULL || fwrite(header, 1, len, fp) != len ||
+            fwrite(image, 1, size, fp) != size) {
+            fprintf(stderr, "Could not write frame '%s'\n", name);
+        }
+        if (fp != NULL) { fclose(fp); }
+        free(name);
+    }
+    free(image);
+}
@@ -0,0 +1,14 @@
+#include "precision.h"
+
+/* What the frames show */
+#define FRAME_ZETA 0                /* Vorticity */
+#define FRAME_PSI  1                /* Stream function */
+
+extern int frame_every, frame_plot, frame_writer;
+extern char *frame_file;
+
+void frame_setup(int imax, int jmax, real delx, real dely);
+int frame_due(int iters);
+void frame_save(real **u, real **v, char **flag, int iters);
+void frame_finish(void);
+void frame_writer_loop(int imax, int jmax);
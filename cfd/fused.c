@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+#include "datadef.h"
+#include "fused.h"
+#include "kernels.h"
+
+#define max(x,y) ((x)>(y)?(x):(y))
+#define min(x,y) ((x)<(y)?(x):(y))
+
+extern int ileft, iright, jbottom, jtop;
+
+/* Fused timestep kernels. fused_tentative_rhs() computes f, g and the
+ * right hand side column by column while the columns are in cache, and
+ * fused_update_velocity() picks up the velocity maxima for the next
+ * timestep as it writes u and v.
+ * set_timestep_interval() takes the maxima over the block and its
+ * external boundary cells after the boundary conditions. The update only
+ * sees the cells it writes; the others are either rewritten by
+ * apply_boundary_conditions() or never change, and since the flags are
+ * static they are listed once here and scanned by fused_boundary_max().
+ * Like the kernels in simulation.c these can be called by every thread of
+ * a parallel region, and return once the whole team has finished.
+ */
+struct cell {
+    int i, j;
+};
+
+static struct cell *ucells, *vcells;
+static int nucells, nvcells;
+static real team_max[2];            /* Velocity maxima of the team */
+
+
+/* u at (i,j) is written by update_velocity() */
+static int u_updated(char **flag, int imax, int i, int j)
+{
+    return i >= max(1, ileft) && i <= min(imax-1, iright) &&
+        j >= jbottom && j <= jtop && (flag[i][j] & C_F) &&
+        (flag[i+1][j] & C_F);
+}
+
+/* v at (i,j) is written by update_velocity() */
+static int v_updated(char **flag, int jmax, int i, int j)
+{
+    return i >= ileft && i <= iright &&
+        j >= jbottom && j <= min(jmax-1, jtop) && (flag[i][j] & C_F) &&
+        (flag[i][j+1] & C_F);
+}
+
+/* List the cells of this process's block, and the external boundary
+ * cells next to it, whose velocities are not written by the update
+ */
+void fused_setup(char **flag, int imax, int jmax)
+{
+    int i, j;
+    int ilo = (ileft == 1) ? 0 : ileft;
+    int ihi = (iright == imax) ? imax+1 : iright;
+    int jlo = (jbottom == 1) ? 0 : jbottom;
+    int jhi = (jtop == jmax) ? jmax+1 : jtop;
+    int ncells = (ihi-ilo+1) * (jhi-jlo+1);
+
+    ucells = malloc(ncells * sizeof(struct cell));
+    vcells = malloc(ncells * sizeof(struct cell));
+    if (!ucells || !vcells) {
+        fprintf(stderr, "Couldn't allocate memory for the fused kernels.\n");
+        exit(1);
+    }
+
+    /* The same ranges as set_timestep_interval() */
+    nucells = nvcells = 0;
+    for (i=ilo; i<=ihi; i++) {
+        for (j=max(1, jlo); j<=jhi; j++) {
+            if (!u_updated(flag, imax, i, j)) {
+                ucells[nucells].i = i;
+                ucells[nucells++].j = j;
+            }
+        }
+    }
+    for (i=max(1, ilo); i<=ihi; i++) {
+        for (j=jlo; j<=jhi; j++) {
+            if (!v_updated(flag, jmax, i, j)) {
+                vcells[nvcells].i = i;
+                vcells[nvcells++].j = j;
+            }
+        }
+    }
+}
+
+
+/* The columns lo..hi that this thread takes under a static schedule,
+ * i0..i1, which is empty for some threads if there are few columns
+ */
+static void team_range(int lo, int hi, int *i0, int *i1)
+{
+    int n = hi - lo + 1, nt = omp_get_num_threads(), t = omp_get_thread_num();
+    int chunk = n / nt, extra = n % nt;
+
+    *i0 = lo + t*chunk + min(t, extra);
+    *i1 = *i0 + chunk - 1 + (t < extra ? 1 : 0);
+}
+
+/* Fold a thread's velocity maxima into the team's. Once the team has
+ * passed a barrier team_max holds the maxima over all its threads.
+ */
+static void team_fold_max(real umax, real vmax)
+{
+    #pragma omp critical (fused_max)
+    {
+        team_max[0] = max(umax, team_max[0]);
+        team_max[1] = max(vmax, team_max[1]);
+    }
+}
+
+
+/* The right hand side of the pressure equation at (i,j), as compute_rhs() */
+static void rhs_cell(real **f, real **g, preal **rhs, char **flag, int i,
+    int j, real del_t, real delx, real dely)
+{
+    if (flag[i][j] & C_F) {
+        rhs[i][j] = (
+                     (f[i][j]-f[i-1][j])/delx +
+                     (g[i][j]-g[i][j-1])/dely
+                   ) / del_t;
+    }
+}
+
+/* compute_tentative_velocity() and compute_rhs() in one pass over the
+ * block. The right hand side of the western column and southern row of
+ * the block needs f and g from the neighbouring blocks, so if there are
+ * any those cells are left for fused_rhs_edges() after the halo exchange.
+ * Each thread takes a contiguous range of columns. The right hand side of
+ * its first column needs f from the column before, which may be another
+ * thread's, so it waits for the team to finish.
+ */
+void fused_tentative_rhs(real **u, real **v, real **f, real **g,
+    preal **rhs, char **flag, int imax, int jmax, real del_t, real delx,
+    real dely, real gamma, real Re)
+{
+    int i, j, i0, i1;
+    int ifirst = (ileft == 1) ? 1 : ileft+1;
+    int j0 = (jbottom == 1) ? 1 : jbottom+1;
+
+    team_range(ileft, iright, &i0, &i1);
+    for (i=i0; i<=i1; i++) {
+        /* f & g at external boundaries, which the right hand side reads */
+        if (i == 1) {
+            for (j=jbottom; j<=jtop; j++) { f[0][j] = u[0][j]; }
+        }
+        if (i >= 1 && i <= imax-1) {
+            f_column(u, v, f, flag, i, jbottom, jtop, del_t, delx, dely,
+                gamma, Re);
+        }
+        if (i == imax) {
+            for (j=jbottom; j<=jtop; j++) { f[imax][j] = u[imax][j]; }
+        }
+        g_column(u, v, g, flag, i, jbottom, min(jmax-1, jtop), del_t, delx,
+            dely, gamma, Re);
+        if (jbottom == 1) { g[i][0]    = v[i][0]; }
+        if (jtop == jmax) { g[i][jmax] = v[i][jmax]; }
+
+        if (i == i0 || i < ifirst) { continue; }
+        for (j=j0; j<=jtop; j++) {
+            rhs_cell(f, g, rhs, flag, i, j, del_t, delx, dely);
+        }
+    }
+    #pragma omp barrier
+    if (i0 <= i1 && i0 >= ifirst) {
+        for (j=j0; j<=jtop; j++) {
+            rhs_cell(f, g, rhs, flag, i0, j, del_t, delx, dely);
+        }
+    }
+    #pragma omp barrier
+}
+
+/* The right hand side cells left out by fused_tentative_rhs(); the f and g
+ * halos must be current.
+ */
+void fused_rhs_edges(real **f, real **g, preal **rhs, char **flag,
+    real del_t, real delx, real dely)
+{
+    int i, j;
+
+    if (ileft > 1) {
+        #pragma omp for schedule(static)
+        for (j=jbottom; j<=jtop; j++) {
+            rhs_cell(f, g, rhs, flag, ileft, j, del_t, delx, dely);
+        }
+    }
+    if (jbottom > 1) {
+        #pragma omp for schedule(static)
+        for (i=(ileft > 1) ? ileft+1 : ileft; i<=iright; i++) {
+            rhs_cell(f, g, rhs, flag, i, jbottom, del_t, delx, dely);
+        }
+    }
+}
+
+
+/* update_velocity(), also setting *umax and *vmax to the largest
+ * magnitudes of the velocities it writes (at least 1.0e-10)
+ */
+void fused_update_velocity(real **u, real **v, real **f, real **g,
+    preal **p, char **flag, int imax, int jmax, real del_t, real delx,
+    real dely, real *umax, real *vmax)
+{
+    int i, j;
+    real um = 1.0e-10, vm = 1.0e-10;
+
+    #pragma omp single
+    team_max[0] = team_max[1] = 1.0e-10;
+    #pragma omp for schedule(static) nowait
+    for (i=ileft; i<=iright; i++) {
+        if (i >= 1 && i <= imax-1) {
+            u_column(u, f, p, flag, i, jbottom, jtop, del_t, delx);
+            for (j=jbottom; j<=jtop; j++) {
+                if (flag[i][j] & flag[i+1][j] & C_F) {
+                    um = max(fabs(u[i][j]), um);
+                }
+            }
+        }
+        v_column(v, g, p, flag, i, jbottom, min(jmax-1, jtop), del_t, dely);
+        for (j=jbottom; j<=min(jmax-1, jtop); j++) {
+            if (flag[i][j] & flag[i][j+1] & C_F) {
+                vm = max(fabs(v[i][j]), vm);
+            }
+        }
+    }
+    team_fold_max(um, vm);
+    #pragma omp barrier
+    #pragma omp master
+    {
+        *umax = team_max[0];
+        *vmax = team_max[1];
+    }
+    #pragma omp barrier
+}
+
+/* Fold the velocities that fused_update_velocity() did not write into
+ * *umax and *vmax. Call after apply_boundary_conditions().
+ */
+void fused_boundary_max(real **u, real **v, real *umax, real *vmax)
+{
+    int k;
+    real um = 1.0e-10, vm = 1.0e-10;
+
+    #pragma omp single
+    {
+        team_max[0] = *umax;
+        team_max[1] = *vmax;
+    }
+    #pragma omp for schedule(static) nowait
+    for (k = 0; k < nucells; k++) {
+        um = max(fabs(u[ucells[k].i][ucells[k].j]), um);
+    }
+    #pragma omp for schedule(static) nowait
+    for (k = 0; k < nvcells; k++) {
+        vm = max(fabs(v[vcells[k].i][vcells[k].j]), vm);
+    }
+    team_fold_max(um, vm);
+    #pragma omp barrier
+    #pragma omp master
+    {
+        *umax = team_max[0];
+        *vmax = team_max[1];
+    }
+    #pragma omp barrier
+}
+
+/* Free the cell lists */
+void fused_free(void)
+{
+    free(ucells);
+    free(vcells);
+}
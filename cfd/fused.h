@@ -0,0 +1,13 @@
+#include "precision.h"
+
+void fused_setup(char **flag, int imax, int jmax);
+void fused_tentative_rhs(real **u, real **v, real **f, real **g,
+    preal **rhs, char **flag, int imax, int jmax, real del_t, real delx,
+    real dely, real gamma, real Re);
+void fused_rhs_edges(real **f, real **g, preal **rhs, char **flag,
+    real del_t, real delx, real dely);
+void fused_update_velocity(real **u, real **v, real **f, real **g,
+    preal **p, char **flag, int imax, int jmax, real del_t, real delx,
+    real dely, real *umax, real *vmax);
+void fused_boundary_max(real **u, real **v, real *umax, real *vmax);
+void fused_free(void);
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+#include "halo.h"
+#include "precision.h"
+#include "timing.h"
+
+extern int ileft, iright, jbottom, jtop;
+extern int nprocs, proc;
+extern MPI_Comm cart_comm;
+extern int nbr_west, nbr_east, nbr_south, nbr_north;
+
+static int dims[2];                 /* Processes in the X and Y directions */
+
+/* Compute the cells owned by the process at Cartesian coordinates
+ * (cx, cy): columns il..ir and rows jb..jt.
+ */
+static void block_bounds(int cx, int cy, int imax, int jmax,
+    int *il, int *ir, int *jb, int *jt)
+{
+    *il = cx * imax/dims[0] + 1;
+    *ir = (cx + 1) * imax/dims[0];
+    *jb = cy * jmax/dims[1] + 1;
+    *jt = (cy + 1) * jmax/dims[1];
+}
+
+/* Pick the process grid for nprocs processes. Without an override the
+ * factorisation px*py with the least total length of cuts through the
+ * imax x jmax grid is used, since that is the amount of halo data that
+ * has to be exchanged. A partial override (eg 4x0) is completed by
+ * MPI_Dims_create.
+ * Returns non-zero if the requested grid cannot be used.
+ */
+static int choose_dims(int imax, int jmax, int px, int py)
+{
+    int p;
+    long cut, best = -1;
+
+    dims[0] = px;
+    dims[1] = py;
+    if (px == 0 && py == 0) {
+        for (p = 1; p <= nprocs; p++) {
+            if (nprocs % p != 0) { continue; }
+            cut = (long) (p-1)*jmax + (long) (nprocs/p-1)*imax;
+            if (best < 0 || cut < best) {
+                best = cut;
+                dims[0] = p;
+                dims[1] = nprocs/p;
+            }
+        }
+    } else if (px < 0 || py < 0 || (px > 0 && nprocs % px != 0) ||
+               (py > 0 && nprocs % py != 0) ||
+               (px > 0 && py > 0 && px*py != nprocs)) {
+        return 1;
+    }
+    MPI_Dims_create(nprocs, 2, dims);
+    return dims[0] > imax || dims[1] > jmax;
+}
+
+/* Split the imax x jmax grid into a px x py Cartesian grid of blocks (0
+ * meaning "choose automatically") and set ileft, iright, jbottom, jtop,
+ * cart_comm and the neighbour ranks for this process.
+ * Returns non-zero if the process grid is unusable.
+ */
+int decompose_domain(int imax, int jmax, int px, int py)
+{
+    int periods[2] = { 0, 0 };
+    int coords[2];
+
+    if (choose_dims(imax, jmax, px, py)) {
+        if (proc == 0) {
+            fprintf(stderr, "Cannot split a %dx%d grid over a %dx%d grid of "
+                "%d processes.\n", imax, jmax, px, py, nprocs);
+        }
+        return 1;
+    }
+
+    /* No reordering, so ranks in cart_comm match MPI_COMM_WORLD. A process
+     * beyond the grid (the frame writer) gets no block.
+     */
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &cart_comm);
+    if (cart_comm == MPI_COMM_NULL) { return 0; }
+    MPI_Cart_coords(cart_comm, proc, 2, coords);
+    MPI_Cart_shift(cart_comm, 0, 1, &nbr_west, &nbr_east);
+    MPI_Cart_shift(cart_comm, 1, 1, &nbr_south, &nbr_north);
+
+    block_bounds(coords[0], coords[1], imax, jmax,
+        &ileft, &iright, &jbottom, &jtop);
+    return 0;
+}
+
+/* Return the number of processes in the X (dim 0) or Y (dim 1) direction */
+int decomposition_dim(int dim)
+{
+    return dims[dim];
+}
+
+/* The functions below work on matrices of either floating point type,
+ * given the MPI datatype of the elements and the first element m0 of the
+ * matrix. The matrices are allocated as one block of columns of jmax+2
+ * elements each, so element (i,j) is at AT(i,j).
+ */
+#define AT(i, j) ((char *) m0 + ((size_t) (i)*(jmax+2) + (j))*size)
+
+/* Swap the edges of the block il..ir x jb..jt of an imax x jmax grid with
+ * the neighbouring blocks, so that the halo columns il-1 and ir+1 and rows
+ * jb-1 and jt+1 hold the neighbours' current values.
+ * Rows are exchanged first, and then columns including the halo rows, so
+ * the diagonal corner cells are filled in as well.
+ */
+static void halo_block(void *m0, MPI_Datatype type, int il, int ir, int jb,
+    int jt, int imax, int jmax)
+{
+    MPI_Datatype rowtype;
+    int size;
+
+    /* A block on the edge of the domain also owns the external boundary
+     * cells next to it, which the neighbours' corners need.
+     */
+    int ilo = (il == 1) ? 0 : il;
+    int ihi = (ir == imax) ? imax+1 : ir;
+
+    MPI_Type_size(type, &size);
+
+    /* Consecutive elements of a row are jmax+2 elements apart */
+    MPI_Type_vector(ihi-ilo+1, 1, jmax+2, type, &rowtype);
+    MPI_Type_commit(&rowtype);
+
+    MPI_Sendrecv(AT(ilo, jt), 1, rowtype, nbr_north, 0,
+        AT(ilo, jb-1), 1, rowtype, nbr_south, 0,
+        cart_comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(AT(ilo, jb), 1, rowtype, nbr_south, 1,
+        AT(ilo, jt+1), 1, rowtype, nbr_north, 1,
+        cart_comm, MPI_STATUS_IGNORE);
+
+    /* The slice of a column is contiguous, so no derived datatype is
+     * needed. Using MPI_Sendrecv avoids the chain of blocking sends
+     * serialising across the processes.
+     */
+    MPI_Sendrecv(AT(ir, jb-1), jt-jb+3, type, nbr_east, 2,
+        AT(il-1, jb-1), jt-jb+3, type, nbr_west, 2,
+        cart_comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(AT(il, jb-1), jt-jb+3, type, nbr_west, 3,
+        AT(ir+1, jb-1), jt-jb+3, type, nbr_east, 3,
+        cart_comm, MPI_STATUS_IGNORE);
+
+    MPI_Type_free(&rowtype);
+}
+
+/* Swap the depth cells along each edge of this process's block with its
+ * neighbours, filling a halo that many cells deep, corners included.
+ * The neighbouring blocks must be at least depth cells wide and high.
+ */
+static void halo_deep(void *m0, MPI_Datatype type, int depth, int imax,
+    int jmax)
+{
+    MPI_Datatype rowtype, coltype;
+    int size;
+
+    int ilo = (ileft == 1) ? 0 : ileft;
+    int ihi = (iright == imax) ? imax+1 : iright;
+    /* The halo rows, or the external boundary row at the domain's edge */
+    int jlo = (jbottom == 1) ? 0 : jbottom-depth;
+    int jhi = (jtop == jmax) ? jmax+1 : jtop+depth;
+
+    /* depth rows of the block, then depth columns including the halo
+     * rows
+     */
+    MPI_Type_size(type, &size);
+    MPI_Type_vector(ihi-ilo+1, depth, jmax+2, type, &rowtype);
+    MPI_Type_vector(depth, jhi-jlo+1, jmax+2, type, &coltype);
+    MPI_Type_commit(&rowtype);
+    MPI_Type_commit(&coltype);
+
+    MPI_Sendrecv(AT(ilo, jtop-depth+1), 1, rowtype, nbr_north, 0,
+        AT(ilo, jlo), 1, rowtype, nbr_south, 0,
+        cart_comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(AT(ilo, jbottom), 1, rowtype, nbr_south, 1,
+        AT(ilo, jtop+1), 1, rowtype, nbr_north, 1,
+        cart_comm, MPI_STATUS_IGNORE);
+
+    MPI_Sendrecv(AT(iright-depth+1, jlo), 1, coltype, nbr_east, 2,
+        AT((ileft == 1) ? 0 : ileft-depth, jlo), 1, coltype, nbr_west, 2,
+        cart_comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(AT(ileft, jlo), 1, coltype, nbr_west, 3,
+        AT(iright+1, jlo), 1, coltype, nbr_east, 3,
+        cart_comm, MPI_STATUS_IGNORE);
+
+    MPI_Type_free(&rowtype);
+    MPI_Type_free(&coltype);
+}
+
+/* Collect every process's block on process 0. Blocks on the edge of the
+ * domain include the external boundary cells next to them.
+ */
+static void gather(void *m0, MPI_Datatype type, int imax, int jmax)
+{
+    int r, il, ir, jb, jt, size;
+    int coords[2];
+    MPI_Datatype blocktype;
+
+    MPI_Type_size(type, &size);
+
+    for (r = 0; r < nprocs; r++) {
+        if (r != proc && proc != 0) { continue; }
+        MPI_Cart_coords(cart_comm, r, 2, coords);
+        block_bounds(coords[0], coords[1], imax, jmax, &il, &ir, &jb, &jt);
+        if (il == 1) { il = 0; }
+        if (ir == imax) { ir = imax+1; }
+        if (jb == 1) { jb = 0; }
+        if (jt == jmax) { jt = jmax+1; }
+
+        MPI_Type_vector(ir-il+1, jt-jb+1, jmax+2, type, &blocktype);
+        MPI_Type_commit(&blocktype);
+        if (proc == 0 && r != 0) {
+            MPI_Recv(AT(il, jb), 1, blocktype, r, 0, cart_comm,
+                MPI_STATUS_IGNORE);
+        } else if (proc != 0) {
+            MPI_Send(AT(il, jb), 1, blocktype, 0, 0, cart_comm);
+        }
+        MPI_Type_free(&blocktype);
+    }
+}
+
+#undef AT
+
+
+/* Swap the edges of this process's block of the velocity matrix m with
+ * its neighbours
+ */
+void exchange_halo(real **m, int imax, int jmax)
+{
+    timer_push(PH_HALO);
+    halo_block(m[0], REAL_MPI, ileft, iright, jbottom, jtop, imax, jmax);
+    timer_pop();
+}
+
+/* Collect every process's block of the velocity matrix m on process 0 */
+void gather_matrix(real **m, int imax, int jmax)
+{
+    gather(m[0], REAL_MPI, imax, jmax);
+}
+
+/* The same for the pressure matrices. exchange_halo_block_p() swaps the
+ * edges of the block il..ir x jb..jt of an imax x jmax grid, and
+ * exchange_halo_deep_p() a halo depth cells deep.
+ */
+void exchange_halo_p(preal **m, int imax, int jmax)
+{
+    timer_push(PH_HALO);
+    halo_block(m[0], PREAL_MPI, ileft, iright, jbottom, jtop, imax, jmax);
+    timer_pop();
+}
+
+void exchange_halo_block_p(preal **m, int il, int ir, int jb, int jt,
+    int imax, int jmax)
+{
+    timer_push(PH_HALO);
+    halo_block(m[0], PREAL_MPI, il, ir, jb, jt, imax, jmax);
+    timer_pop();
+}
+
+void exchange_halo_deep_p(preal **m, int depth, int imax, int jmax)
+{
+    timer_push(PH_HALO);
+    halo_deep(m[0], PREAL_MPI, depth, imax, jmax);
+    timer_pop();
+}
+
+void gather_matrix_p(preal **m, int imax, int jmax)
+{
+    gather(m[0], PREAL_MPI, imax, jmax);
+}
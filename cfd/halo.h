@@ -0,0 +1,11 @@
+#include "precision.h"
+
+int decompose_domain(int imax, int jmax, int px, int py);
+int decomposition_dim(int dim);
+void exchange_halo(real **m, int imax, int jmax);
+void gather_matrix(real **m, int imax, int jmax);
+void exchange_halo_p(preal **m, int imax, int jmax);
+void exchange_halo_block_p(preal **m, int il, int ir, int jb, int jt,
+    int imax, int jmax);
+void exchange_halo_deep_p(preal **m, int depth, int imax, int jmax);
+void gather_matrix_p(preal **m, int imax, int jmax);
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include "datadef.h"
+#include "precision.h"
 
 void load_flag_from_pgm(char **flag, int imax, int jmax, char *filename)
 {
@@ -48,11 +49,11 @@ void load_flag_from_pgm(char **flag, int imax, int jmax, char *filename)
  * as boundaries. The cells adjacent to boundary cells have their relevant
  * flags set too.
  */
-void init_flag(char **flag, int imax, int jmax, float delx, float dely,
+void init_flag(char **flag, int imax, int jmax, real delx, real dely,
     int *ibound)
 {
     int i, j;
-    float mx, my, x, y, rad1;
+    real mx, my, x, y, rad1;
 
     /* Mark a circular obstacle as boundary cells, the rest as fluid */
     mx = 20.0/41.0*jmax*dely;
@@ -1,3 +1,5 @@
+#include "precision.h"
+
 void load_flag_from_pgm(char **flag, int imax, int jmax, char *filename);
-void init_flag(char **flag, int imax, int jmax, float delx, float dely,
+void init_flag(char **flag, int imax, int jmax, real delx, real dely,
     int *ibound);
@@ -1,24 +1,38 @@
+#define _GNU_SOURCE                 /* For sched_getcpu() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
-#include <errno.h>
+#include <sched.h>
 #include "alloc.h"
 #include "boundary.h"
+#include "checkpoint.h"
 #include "datadef.h"
+#include "frames.h"
+#include "fused.h"
+#include "halo.h"
 #include "init.h"
+#include "kernels.h"
+#include "multigrid.h"
+#include "pcg.h"
+#include "precision.h"
+#include "redblack.h"
 #include "simulation.h"
+#include "statefile.h"
+#include "stencil.h"
+#include "tiled.h"
+#include "timing.h"
 #include <mpi.h>
-
-void write_bin(float **u, float **v, float **p, char **flag,
-     int imax, int jmax, float xlength, float ylength, char *file);
-
-int read_bin(float **u, float **v, float **p, char **flag,
-    int imax, int jmax, float xlength, float ylength, char *file);
+#include <omp.h>
 
 static void print_usage(void);
 static void print_version(void);
 static void print_help(void);
+static void report_binding(int provided);
+static void team_exchange(real **a, real **b, int imax, int jmax);
+static void finish_timestep(real **u, real **v, real **f, real **g,
+    preal **p, char **flag, int imax, int jmax, real del_t, real delx,
+    real dely, real ui, real vi, int fused, real *umax, real *vmax);
 
 static char *progname;
 
@@ -26,6 +40,27 @@ int proc = 0;                       /* Rank of the current process */
 int nprocs = 0;                /* Number of processes in communicator */
 
 int ileft, iright;           /* Array bounds for each processor */
+int jbottom, jtop;
+
+MPI_Comm cart_comm;                 /* Cartesian grid of the processes */
+int nbr_west, nbr_east;             /* Ranks of the neighbouring blocks, */
+int nbr_south, nbr_north;           /* or MPI_PROC_NULL at the edges */
+
+int sor_overlap = 0;                /* Hide the SOR halo exchange behind
+                                       the interior sweep */
+int sor_split = 0;                  /* Keep p and rhs in separate red and
+                                       black arrays during SOR */
+int sor_check = 1;                  /* SOR iterations between residual
+                                       checks */
+int mg_cycle = 1;                   /* Multigrid cycles per level: 1 for
+                                       V-cycles, 2 for W-cycles */
+int pcg_precond = PRECOND_IC;       /* Preconditioner for PCG */
+
+/* Pressure solvers */
+#define SOLVER_SOR 0
+#define SOLVER_MG  1
+#define SOLVER_PCG 2
+static const char *solver_names[] = { "SOR", "MG", "PCG" };
 
 double startt, endt;
 double totalt = 0;
@@ -35,32 +70,52 @@ double totalt = 0;
 
 /* Command line options */
 static struct option long_opts[] = {
+    { "check-every", 1, NULL, 'C' },
+    { "checkpoint-every", 1, NULL, 'e' },
     { "del-t",   1, NULL, 'd' },
+    { "frame-every", 1, NULL, 'f' },
+    { "frame-file", 1, NULL, 'g' },
+    { "frame-writer", 0, NULL, 'W' },
+    { "fused",   0, NULL, 'F' },
     { "help",    0, NULL, 'h' },
     { "imax",    1, NULL, 'x' },
     { "infile",  1, NULL, 'i' },
+    { "itermax", 1, NULL, 'I' },
     { "jmax",    1, NULL, 'y' },
+    { "mg-cycle", 1, NULL, 'c' },
     { "outfile", 1, NULL, 'o' },
+    { "overlap", 0, NULL, 'O' },
+    { "plot",    1, NULL, 'p' },
+    { "precond", 1, NULL, 'k' },
+    { "procs",   1, NULL, 'P' },
+    { "restart", 2, NULL, 'R' },
+    { "simd",    1, NULL, 'm' },
+    { "solver",  1, NULL, 's' },
+    { "split",   0, NULL, 'S' },
     { "t-end",   1, NULL, 't' },
+    { "tile",    1, NULL, 'T' },
+    { "timing",  1, NULL, 'M' },
     { "verbose", 1, NULL, 'v' },
     { "version", 1, NULL, 'V' },
     { 0,         0, 0,    0   }
 };
-#define GETOPTS "d:hi:o:t:v:Vx:y:"
+#define GETOPTS "c:C:d:e:f:Fg:hi:I:k:m:M:o:Op:P:R::s:St:T:v:VWx:y:"
 
 int main(int argc, char *argv[])
 {
 
 //initialsation of communication world, size and rank
-  MPI_Init(&argc,&argv);
+  //only the master thread of each process calls MPI
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   MPI_Comm_size(MPI_COMM_WORLD,&nprocs);
   MPI_Comm_rank(MPI_COMM_WORLD,&proc);
 
  // const int numCPUs = atoi(getenv("OMP_NUM_THREADS"));
   // printf("%d,",numCPUs);
     int verbose = 1;          /* Verbosity level */
-    float xlength = 22.0;     /* Width of simulated domain */
-    float ylength = 4.1;      /* Height of simulated domain */
+    real xlength = 22.0;      /* Width of simulated domain */
+    real ylength = 4.1;       /* Height of simulated domain */
   //*2 for the bigger cfd computation
     int imax = 660 * 2;           /* Number of cells horizontally */
     int jmax = 120 * 2;           /* Number of cells vertically */
@@ -68,27 +123,42 @@ int main(int argc, char *argv[])
     char *infile;             /* Input raw initial conditions */
     char *outfile;            /* Output raw simulation results */
 
-    float t_end = 2.1;        /* Simulation runtime */
-    float del_t = 0.003;      /* Duration of each timestep */
-    float tau = 0.5;          /* Safety factor for timestep control */
+    real t_end = 2.1;         /* Simulation runtime */
+    real del_t = 0.003;       /* Duration of each timestep */
+    real tau = 0.5;           /* Safety factor for timestep control */
 
-    int itermax = 100;        /* Maximum number of iterations in SOR */
-    float eps = 0.001;        /* Stopping error threshold for SOR */
-    float omega = 1.7;        /* Relaxation parameter for SOR */
-    float gamma = 0.9;        /* Upwind differencing factor in PDE
+    int itermax = 100;        /* Maximum number of solver iterations */
+    real eps = 0.001;         /* Stopping error threshold for SOR */
+    real omega = 1.7;         /* Relaxation parameter for SOR */
+    real gamma = 0.9;         /* Upwind differencing factor in PDE
                                  discretisation */
 
-    float Re = 150.0;         /* Reynolds number */
-    float ui = 1.0;           /* Initial X velocity */
-    float vi = 0.0;           /* Initial Y velocity */
+    real Re = 150.0;          /* Reynolds number */
+    real ui = 1.0;            /* Initial X velocity */
+    real vi = 0.0;            /* Initial Y velocity */
 
-    float t, delx, dely;
+    real t = 0.0, delx, dely;
     int  i, j, itersor = 0, ifluid = 0, ibound = 0;
-    float res;
-    float **u, **v, **p, **rhs, **f, **g;
+    long solver_iters = 0;    /* Pressure solver iterations in all */
+    double res;
+    real **u, **v, **f, **g;
+    preal **p, **rhs;
     char  **flag;
     int init_case, iters = 0;
+    int iter0 = 0;            /* First timestep of this run */
+    int steps;                /* Timesteps run */
+    char *restart = NULL;     /* Checkpoint to resume from */
+    char *ckptfile;           /* Checkpoints of this run */
+    struct run_state rs;
     int show_help = 0, show_usage = 0, show_version = 0;
+    int px = 0, py = 0;       /* Process grid, 0 to choose automatically */
+    int solver = SOLVER_SOR;  /* Pressure solver */
+    char *simd = "auto";      /* Instruction set for the momentum kernels */
+    const char *kernels;
+    int fused = 0;            /* Use the fused timestep kernels */
+    int margin;               /* Cells around the block for the stencil */
+    real umax = 0.0, vmax = 0.0;
+    char *end;
 
     progname = argv[0];
     infile = strdup("karman.bin");
@@ -126,6 +196,116 @@ int main(int argc, char *argv[])
             case 't':
                 t_end = atof(optarg);
                 break;
+            case 's':
+                if (strcasecmp(optarg, "sor") == 0) {
+                    solver = SOLVER_SOR;
+                } else if (strcasecmp(optarg, "mg") == 0) {
+                    solver = SOLVER_MG;
+                } else if (strcasecmp(optarg, "pcg") == 0) {
+                    solver = SOLVER_PCG;
+                } else {
+                    fprintf(stderr, "%s: Invalid solver '%s'\n", progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'c':
+                if (strcasecmp(optarg, "v") == 0) {
+                    mg_cycle = 1;
+                } else if (strcasecmp(optarg, "w") == 0) {
+                    mg_cycle = 2;
+                } else {
+                    fprintf(stderr, "%s: Invalid cycle '%s'\n", progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'I':
+                itermax = atoi(optarg);
+                break;
+            case 'C':
+                sor_check = atoi(optarg);
+                if (sor_check < 1) {
+                    fprintf(stderr, "%s: Invalid check interval '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'T':
+                sor_tile = atoi(optarg);
+                if (sor_tile < 0) {
+                    fprintf(stderr, "%s: Invalid tile size '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'k':
+                if (strcasecmp(optarg, "jacobi") == 0) {
+                    pcg_precond = PRECOND_JACOBI;
+                } else if (strcasecmp(optarg, "ic") == 0) {
+                    pcg_precond = PRECOND_IC;
+                } else {
+                    fprintf(stderr, "%s: Invalid preconditioner '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'O':
+                sor_overlap = 1;
+                break;
+            case 'S':
+                sor_split = 1;
+                break;
+            case 'm':
+                simd = optarg;
+                break;
+            case 'F':
+                fused = 1;
+                break;
+            case 'e':
+                checkpoint_every = strtol(optarg, &end, 10);
+                checkpoint_seconds = (*end == 's');
+                if (checkpoint_every < 1 || *(end + checkpoint_seconds)) {
+                    fprintf(stderr, "%s: Invalid checkpoint interval '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'f':
+                frame_every = atoi(optarg);
+                if (frame_every < 1) {
+                    fprintf(stderr, "%s: Invalid frame interval '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'g':
+                frame_file = optarg;
+                break;
+            case 'p':
+                if (strcasecmp(optarg, "zeta") == 0) {
+                    frame_plot = FRAME_ZETA;
+                } else if (strcasecmp(optarg, "psi") == 0) {
+                    frame_plot = FRAME_PSI;
+                } else {
+                    fprintf(stderr, "%s: Invalid plot '%s'\n", progname,
+                        optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'W':
+                frame_writer = 1;
+                break;
+            case 'M':
+                timing_file = optarg;
+                break;
+            case 'R':
+                free(restart);
+                restart = strdup(optarg ? optarg : "");
+                break;
+            case 'P':
+                if (sscanf(optarg, "%dx%d", &px, &py) != 2) {
+                    show_usage = 1;
+                }
+                break;
             default:
                 show_usage = 1;
         }
@@ -147,16 +327,38 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    /* Checkpoints go next to the output, as <outfile>.ckpt */
+    ckptfile = malloc(strlen(outfile) + 16);
+    sprintf(ckptfile, "%s.ckpt", (*outfile != '\0') ? outfile : "karman.bin");
+    if (restart != NULL && *restart == '\0') {
+        free(restart);
+        restart = strdup(ckptfile);
+    }
+
     delx = xlength/imax;
     dely = ylength/jmax;
 
+    /* With a frame writer the last process only writes the frames, and the
+     * others run the simulation
+     */
+    if (frame_every == 0) { frame_writer = 0; }
+    if (frame_writer) {
+        if (nprocs < 2) {
+            fprintf(stderr, "%s: A frame writer needs at least two "
+                "processes\n", progname);
+            MPI_Finalize();
+            return 1;
+        }
+        nprocs--;
+    }
+
     /* Allocate arrays */
-    u    = alloc_floatmatrix(imax+2, jmax+2);
-    v    = alloc_floatmatrix(imax+2, jmax+2);
-    f    = alloc_floatmatrix(imax+2, jmax+2);
-    g    = alloc_floatmatrix(imax+2, jmax+2);
-    p    = alloc_floatmatrix(imax+2, jmax+2);
-    rhs  = alloc_floatmatrix(imax+2, jmax+2);
+    u    = alloc_realmatrix(imax+2, jmax+2);
+    v    = alloc_realmatrix(imax+2, jmax+2);
+    f    = alloc_realmatrix(imax+2, jmax+2);
+    g    = alloc_realmatrix(imax+2, jmax+2);
+    p    = alloc_prealmatrix(imax+2, jmax+2);
+    rhs  = alloc_prealmatrix(imax+2, jmax+2);
     flag = alloc_charmatrix(imax+2, jmax+2);
 
     if (!u || !v || !f || !g || !p || !rhs || !flag) {
@@ -164,14 +366,78 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    /* Read in initial values from a file if it exists */
-    init_case = read_bin(u, v, p, flag, imax, jmax, xlength, ylength, infile);
+    /* Define the values of ileft, iright, jbottom and jtop: each process
+     * owns one block of a 2D Cartesian grid, for every phase of the
+     * timestep.
+     */
+    if (decompose_domain(imax, jmax, px, py)) {
+        MPI_Finalize();
+        return 1;
+    }
+    if (cart_comm == MPI_COMM_NULL) {
+        frame_writer_loop(imax, jmax);
+        MPI_Finalize();
+        return 0;
+    }
+    if (proc == 0 && verbose > 1) {
+        printf("Process grid: %dx%d\n", decomposition_dim(0),
+            decomposition_dim(1));
+    }
+
+    /* Place the pages of this process's block on the NUMA nodes of the
+     * threads that will compute them
+     */
+    first_touch(u, ileft, iright, jmax+2, sizeof(real));
+    first_touch(v, ileft, iright, jmax+2, sizeof(real));
+    first_touch(f, ileft, iright, jmax+2, sizeof(real));
+    first_touch(g, ileft, iright, jmax+2, sizeof(real));
+    first_touch(p, ileft, iright, jmax+2, sizeof(preal));
+    first_touch(rhs, ileft, iright, jmax+2, sizeof(preal));
+    first_touch(flag, ileft, iright, jmax+2, sizeof(char));
+
+    /* Read in initial values from a file if it exists, or resume from a
+     * checkpoint. Each process reads its own block.
+     */
+    if (restart != NULL) {
+        init_case = read_checkpoint(u, v, p, flag, imax, jmax, xlength,
+            ylength, restart, &rs);
+        if (init_case == 0) {
+            t = rs.t;
+            del_t = rs.del_t;
+            iters = iter0 = rs.iters;
+            ibound = rs.ibound;
+            if (proc == 0 && verbose > 1) {
+                printf("Restarting from %s at step %d, t:%g\n", restart,
+                    iters, t);
+            }
+        }
+    } else {
+        init_case = read_bin(u, v, p, flag, imax, jmax, xlength, ylength,
+            infile);
+    }
 
     if (init_case > 0) {
         /* Error while reading file */
+        MPI_Finalize();
         return 1;
     }
 
+    if ((kernels = select_kernels(simd, jmax)) == NULL) {
+        if (proc == 0) {
+            fprintf(stderr, "%s: Instruction set '%s' is not available\n",
+                progname, simd);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (proc == 0 && verbose > 1) {
+        printf("Precision: %s\n", PRECISION_NAME);
+        printf("Momentum kernels: %s\n", kernels);
+    }
+    if (verbose > 1) {
+        report_binding(provided);
+    }
+
     if (init_case < 0) {
         /* Set initial values if file doesn't exist */
         for (i=0;i<=imax+1;i++) {
@@ -183,87 +449,186 @@ int main(int argc, char *argv[])
         }
         init_flag(flag, imax, jmax, delx, dely, &ibound);
         apply_boundary_conditions(u, v, flag, imax, jmax, ui, vi);
+        exchange_halo(u, imax, jmax);
+        exchange_halo(v, imax, jmax);
     }
-//create p2 matrix in order to re populate the grid with MPI_ALLgather  
-    float **p2;
-
-    p2 = alloc_floatmatrix(imax + 2, jmax + 2);
-//loop through the grid
-    for(i=0; i<=imax + 1;i++){
-
-      for(j=0; j<=jmax + 1;j++){
-
-        p2[i][j] = 0;
 
-      }
-
-    }
+    /* The flags are final now, so the pressure stencil and the split
+     * layout can be built
+     */
+    margin = tiled_setup(imax, jmax);
+    build_stencil(flag, imax, jmax, delx, dely, omega, margin);
+    if (sor_split && !sor_tile) { rb_setup(flag, imax, jmax); }
+    if (fused) { fused_setup(flag, imax, jmax); }
+    checkpoint_setup(ckptfile, imax, jmax, xlength, ylength);
+    frame_setup(imax, jmax, delx, dely);
 
     /* Main loop */
-//Define the values of ileft and iright 
-    ileft = proc * imax/nprocs + 1;
-    iright = (proc + 1)* imax/nprocs;
 //Define Timers
     double mainStart, mainEnd;
     double mainTotal = 0;
     //main loop start time-stamp
     mainStart = MPI_Wtime();
-    for (t = 0.0; t < t_end; t += del_t, iters++) {
-        set_timestep_interval(&del_t, imax, jmax, delx, dely, u, v, Re, tau);
+    timer_begin();
+    for (; t < t_end; t += del_t, iters++) {
         //printf("proc: %d, iteration %d, t: %f \n",proc, iters, t);
         ifluid = (imax * jmax) - ibound;
 
-        compute_tentative_velocity(u, v, f, g, flag, imax, jmax,
-            del_t, delx, dely, gamma, Re);
+        /* Each timestep runs in one parallel region. The kernels share out
+         * their loops among the team, and the master thread exchanges the
+         * halos (see simulation.c). The PCG solver has parallel loops of
+         * its own, so with it the region ends before the pressure solve and
+         * a second one finishes the timestep.
+         */
+        #pragma omp parallel
+        {
+            int n;
+
+            /* The fused update leaves the velocity maxima of the last step */
+            timer_push(PH_TIMESTEP);
+            if (fused && iters > iter0) {
+                #pragma omp master
+                set_timestep_from_max(&del_t, delx, dely, umax, vmax, Re,
+                    tau);
+                #pragma omp barrier
+            } else {
+                set_timestep_interval(&del_t, imax, jmax, delx, dely, u, v,
+                    Re, tau);
+            }
+            timer_pop();
+
+            timer_push(PH_TENTATIVE);
+            if (fused) {
+                fused_tentative_rhs(u, v, f, g, rhs, flag, imax, jmax, del_t,
+                    delx, dely, gamma, Re);
+                team_exchange(f, g, imax, jmax);
+                timer_pop();
+                timer_push(PH_RHS);
+                fused_rhs_edges(f, g, rhs, flag, del_t, delx, dely);
+            } else {
+                compute_tentative_velocity(u, v, f, g, flag, imax, jmax,
+                    del_t, delx, dely, gamma, Re);
+                /* compute_rhs looks across columns through f and rows
+                 * through g
+                 */
+                team_exchange(f, g, imax, jmax);
+                timer_pop();
+
+                timer_push(PH_RHS);
+                compute_rhs(f, g, rhs, flag, imax, jmax, del_t, delx, dely);
+            }
+            timer_pop();
+
+            if (solver != SOLVER_PCG) {
+                //start poisson time-stamp
+                #pragma omp master
+                startt = MPI_Wtime();
+
+                timer_push(PH_SOLVER);
+                if (ifluid == 0) {
+                    n = 0;
+                } else if (solver == SOLVER_MG) {
+                    n = multigrid(p, rhs, flag, imax, jmax, delx, dely, eps,
+                        itermax, &res, ifluid);
+                } else {
+                    n = poisson(p, rhs, flag, imax, jmax, delx, dely, eps,
+                        itermax, omega, &res, ifluid);
+                }
+                timer_pop();
+
+                //poisson loop end time-stamp
+                #pragma omp master
+                {
+                    itersor = n;
+                    endt = MPI_Wtime();
+                }
+                finish_timestep(u, v, f, g, p, flag, imax, jmax, del_t, delx,
+                    dely, ui, vi, fused, &umax, &vmax);
+            }
+        }
 
-        compute_rhs(f, g, rhs, flag, imax, jmax, del_t, delx, dely);
-        //start poisson time-stamp
-        startt = MPI_Wtime();
+        if (solver == SOLVER_PCG) {
+            //start poisson time-stamp
+            startt = MPI_Wtime();
+            timer_push(PH_SOLVER);
+            if (ifluid > 0) {
+                itersor = pcg(p, rhs, flag, imax, jmax, delx, dely,
+                            eps, itermax, &res, ifluid);
+            } else {
+                itersor = 0;
+            }
+            timer_pop();
+            //poisson loop end time-stamp
+            endt = MPI_Wtime();
 
-        if (ifluid > 0) {
-            itersor = poisson(p, rhs, flag, imax, jmax, delx, dely,
-                        eps, itermax, omega, &res, ifluid);
-        } else {
-            itersor = 0;
+            #pragma omp parallel
+            finish_timestep(u, v, f, g, p, flag, imax, jmax, del_t, delx,
+                dely, ui, vi, fused, &umax, &vmax);
         }
-        //gather the ileft values and populate p2 with them. 
-        MPI_Allgather(p[ileft], (imax/nprocs) * (jmax + 2), MPI_FLOAT, p2[1], (imax/nprocs) * (jmax + 2), MPI_FLOAT, MPI_COMM_WORLD);
-
-        for(i=1; i<=imax;i++){
-          for(j=0; j<=jmax + 1;j++){
-            p[i][j] = p2[i][j];
-          }
-        }	
-        //poisson loop end time-stamp
-        endt = MPI_Wtime();
+        /* The pressure solvers leave the p halo columns current, so there
+         * is no need to reassemble the whole pressure field every timestep.
+         */
 
         if (proc == 0 && verbose > 1) {
-            printf("%d t:%g, del_t:%g, SOR iters:%3d, res:%e, bcells:%d\n",
-                iters, t+del_t, del_t, itersor, res, ibound);
+            printf("%d t:%g, del_t:%g, %s iters:%3d, res:%e, bcells:%d\n",
+                iters, t+del_t, del_t, solver_names[solver], itersor, res,
+                ibound);
         }
-
-        update_velocity(u, v, f, g, p, flag, imax, jmax, del_t, delx, dely);
-
-        apply_boundary_conditions(u, v, flag, imax, jmax, ui, vi);
         //calculate total poisson time.
         totalt += (endt-startt);
+        solver_iters += itersor;
+
+        /* Snapshot the state for the next timestep, which the checkpoint
+         * writer saves in the background
+         */
+        checkpoint_poll();
+        if (checkpoint_due(iters+1)) {
+            rs.t = t+del_t;
+            rs.del_t = del_t;
+            rs.iters = iters+1;
+            rs.ibound = ibound;
+            timer_push(PH_CHECKPOINT);
+            checkpoint_save(u, v, p, flag, &rs);
+            timer_pop();
+        }
+        if (frame_due(iters+1)) {
+            timer_push(PH_FRAMES);
+            frame_save(u, v, flag, iters+1);
+            timer_pop();
+        }
 
     } /* End of main loop */
     //end main loop time-stamp
     mainEnd = MPI_Wtime();
+    timer_end();
     //calculate main loop time total.
     mainTotal += mainEnd - mainStart;
 
-    if (outfile != NULL && strcmp(outfile, "") != 0 && proc == 0) {
-        write_bin(u, v, p, flag, imax, jmax, xlength, ylength, outfile);
+    checkpoint_finish();
+    frame_finish();
+
+    /* Each process writes its own block of the final state */
+    if (outfile != NULL && strcmp(outfile, "") != 0) {
+        rs.t = t;
+        rs.del_t = del_t;
+        rs.iters = iters;
+        rs.ibound = ibound;
+        write_bin(u, v, p, flag, imax, jmax, xlength, ylength, &rs,
+            outfile);
     }
     //define a double variable that reduce can populate
     double global;
     //reduce totalt by summing it and setting it to global.
-    MPI_Reduce(&totalt, &global, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&totalt, &global, 1, MPI_DOUBLE, MPI_SUM, 0, cart_comm);
+
+    timing_report(iters - iter0, solver_iters, imax, jmax);
 
+    /* Averages over the timesteps of this run, which after a restart do
+     * not start at 0
+     */
+    steps = (iters > iter0) ? iters - iter0 : 1;
     if(proc == 0 ){
-      printf("%g,%g,%g,%d\n",(global/(iters*nprocs)),((mainTotal)/iters), (mainTotal), nprocs);
+      printf("%g,%g,%g,%d\n",(global/(steps*nprocs)),((mainTotal)/steps), (mainTotal), nprocs);
     //  printf("Average Poisson Loop Time: %g \n", global/(iters*nprocs));
     //  printf("Average Total Main Loop Time: %g \n", (mainEnd-mainStart)/iters);
 
@@ -277,83 +642,99 @@ int main(int argc, char *argv[])
     free_matrix(p);
     free_matrix(rhs);
     free_matrix(flag);
+    multigrid_free();
+    free_stencil();
+    if (sor_split && !sor_tile) { rb_free(); }
+    if (fused) { fused_free(); }
+    pcg_free();
 
+    MPI_Finalize();
     return 0;
 }
 
-/* Save the simulation state to a file */
-void write_bin(float **u, float **v, float **p, char **flag,
-    int imax, int jmax, float xlength, float ylength, char* file)
+/* Exchange the halos of a and b with the neighbouring blocks. Inside a
+ * parallel region the master thread does it, once the kernel that wrote
+ * them has returned, and the team waits for it.
+ */
+static void team_exchange(real **a, real **b, int imax, int jmax)
 {
-    int i;
-    FILE *fp;
-
-    fp = fopen(file, "wb");
-
-    if (fp == NULL) {
-        fprintf(stderr, "Could not open file '%s': %s\n", file,
-            strerror(errno));
-        return;
+    #pragma omp master
+    {
+        exchange_halo(a, imax, jmax);
+        exchange_halo(b, imax, jmax);
     }
-
-    fwrite(&imax, sizeof(int), 1, fp);
-    fwrite(&jmax, sizeof(int), 1, fp);
-    fwrite(&xlength, sizeof(float), 1, fp);
-    fwrite(&ylength, sizeof(float), 1, fp);
-
-    for (i=0;i<imax+2;i++) {
-        fwrite(u[i], sizeof(float), jmax+2, fp);
-        fwrite(v[i], sizeof(float), jmax+2, fp);
-        fwrite(p[i], sizeof(float), jmax+2, fp);
-        fwrite(flag[i], sizeof(char), jmax+2, fp);
-    }
-    fclose(fp);
+    #pragma omp barrier
 }
 
-/* Read the simulation state from a file */
-int read_bin(float **u, float **v, float **p, char **flag,
-    int imax, int jmax, float xlength, float ylength, char* file)
+/* Update the velocities from the new pressure and apply the boundary
+ * conditions, leaving the u and v halos current. Called by every thread
+ * of the team.
+ */
+static void finish_timestep(real **u, real **v, real **f, real **g,
+    preal **p, char **flag, int imax, int jmax, real del_t, real delx,
+    real dely, real ui, real vi, int fused, real *umax, real *vmax)
 {
-    int i,j;
-    FILE *fp;
-
-    if (file == NULL) return -1;
-
-    if ((fp = fopen(file, "rb")) == NULL) {
-        fprintf(stderr, "Could not open file '%s': %s\n", file,
-            strerror(errno));
-        fprintf(stderr, "Generating default state instead.\n");
-        return -1;
+    timer_push(PH_UPDATE);
+    if (fused) {
+        fused_update_velocity(u, v, f, g, p, flag, imax, jmax, del_t,
+            delx, dely, umax, vmax);
+    } else {
+        update_velocity(u, v, f, g, p, flag, imax, jmax, del_t, delx,
+            dely);
     }
+    timer_pop();
+    team_exchange(u, v, imax, jmax);
+
+    timer_push(PH_BOUNDARY);
+    apply_boundary_conditions(u, v, flag, imax, jmax, ui, vi);
+    if (fused) { fused_boundary_max(u, v, umax, vmax); }
+    timer_pop();
+    team_exchange(u, v, imax, jmax);
+}
 
-    fread(&i, sizeof(int), 1, fp);
-    fread(&j, sizeof(int), 1, fp);
-    float xl, yl;
-    fread(&xl, sizeof(float), 1, fp);
-    fread(&yl, sizeof(float), 1, fp);
+/* Print the CPU each OpenMP thread of each process runs on, and how the
+ * threads are bound, so that the placement of a hybrid run can be checked
+ */
+#define BINDING_LINE 256
 
-    if (i!=imax || j!=jmax) {
-        fprintf(stderr, "Warning: imax/jmax have wrong values in %s\n", file);
-        fprintf(stderr, "%s's imax = %d, jmax = %d\n", file, i, j);
-        fprintf(stderr, "Program's imax = %d, jmax = %d\n", imax, jmax);
-        return 1;
+static void report_binding(int provided)
+{
+    static const char *binds[] = { "false", "true", "master", "close",
+        "spread" };
+    char line[BINDING_LINE], *lines = NULL;
+    int *cpus, nthreads = omp_get_max_threads(), bind = omp_get_proc_bind();
+    int k, n, r;
+
+    if ((cpus = malloc(nthreads * sizeof(int))) == NULL) {
+        return;
     }
-    if (xl!=xlength || yl!=ylength) {
-        fprintf(stderr, "Warning: xlength/ylength have wrong values in %s\n", file);
-        fprintf(stderr, "%s's xlength = %g,  ylength = %g\n", file, xl, yl);
-        fprintf(stderr, "Program's xlength = %g, ylength = %g\n", xlength,
-            ylength);
-        return 1;
+    #pragma omp parallel
+    cpus[omp_get_thread_num()] = sched_getcpu();
+
+    n = snprintf(line, sizeof(line), "Process %d: %d thread%s, bind %s, "
+        "CPU%s", proc, nthreads, (nthreads == 1) ? "" : "s",
+        (bind >= 0 && bind <= 4) ? binds[bind] : "?",
+        (nthreads == 1) ? "" : "s");
+    for (k = 0; k < nthreads && n < BINDING_LINE; k++) {
+        n += snprintf(line+n, sizeof(line)-n, "%s%d", (k > 0) ? "," : " ",
+            cpus[k]);
     }
+    free(cpus);
 
-    for (i=0; i<imax+2; i++) {
-        fread(u[i], sizeof(float), jmax+2, fp);
-        fread(v[i], sizeof(float), jmax+2, fp);
-        fread(p[i], sizeof(float), jmax+2, fp);
-        fread(flag[i], sizeof(char), jmax+2, fp);
+    if (proc == 0) {
+        lines = malloc(nprocs * BINDING_LINE);
+        if (provided < MPI_THREAD_FUNNELED) {
+            printf("MPI does not support MPI_THREAD_FUNNELED\n");
+        }
+    }
+    MPI_Gather(line, BINDING_LINE, MPI_CHAR, lines, BINDING_LINE, MPI_CHAR, 0,
+        cart_comm);
+    if (proc == 0 && lines != NULL) {
+        for (r = 0; r < nprocs; r++) {
+            printf("%s\n", &lines[r * BINDING_LINE]);
+        }
+        free(lines);
     }
-    fclose(fp);
-    return 0;
 }
 
 static void print_usage(void)
@@ -378,8 +759,56 @@ static void print_help(void)
     fprintf(stderr, "  -y, --jmax=JMAX       Set the number of interior cells in the Y direction\n");
     fprintf(stderr, "  -t, --t-end=TEND      Set the simulation end time\n");
     fprintf(stderr, "  -d, --del-t=DELT      Set the simulation timestep size\n");
+    fprintf(stderr, "  -s, --solver=SOLVER   Set the pressure solver: 'sor' for red/black\n");
+    fprintf(stderr, "                        SOR, 'mg' for multigrid or 'pcg' for\n");
+    fprintf(stderr, "                        preconditioned conjugate gradients\n");
+    fprintf(stderr, "                        (default is 'sor')\n");
+    fprintf(stderr, "  -c, --mg-cycle=CYCLE  Set the multigrid cycle, 'v' or 'w'\n");
+    fprintf(stderr, "                        (default is 'v')\n");
+    fprintf(stderr, "  -I, --itermax=N       Set the most pressure solver iterations per\n");
+    fprintf(stderr, "                        timestep (default is 100)\n");
+    fprintf(stderr, "  -k, --precond=PRECOND Set the PCG preconditioner, 'jacobi' or 'ic'\n");
+    fprintf(stderr, "                        for block incomplete Cholesky (default is 'ic')\n");
+    fprintf(stderr, "  -C, --check-every=N   Check the SOR residual every N iterations\n");
+    fprintf(stderr, "                        (default is 1)\n");
+    fprintf(stderr, "  -O, --overlap         Overlap the SOR halo exchange with the sweep\n");
+    fprintf(stderr, "                        of the interior of each block\n");
+    fprintf(stderr, "  -S, --split           Store the SOR pressure and right hand side\n");
+    fprintf(stderr, "                        as separate red and black arrays\n");
+    fprintf(stderr, "  -T, --tile=N          Run N SOR iterations at a time as one pass\n");
+    fprintf(stderr, "                        over the block, 0 for off (default is 0).\n");
+    fprintf(stderr, "                        Overrides -O and -S\n");
+    fprintf(stderr, "  -F, --fused           Compute f, g and the right hand side in one\n");
+    fprintf(stderr, "                        pass, and the velocity maxima with the update\n");
+    fprintf(stderr, "  -m, --simd=ISA        Set the instruction set of the momentum\n");
+    fprintf(stderr, "                        kernels: 'scalar', 'sse2', 'avx2', 'avx512'\n");
+    fprintf(stderr, "                        or 'auto' for the best available (default).\n");
+    fprintf(stderr, "                        karman-fixed has kernels specialised for\n");
+    fprintf(stderr, "                        jmax 120, 240 and 480, which 'auto' picks\n");
+    fprintf(stderr, "  -P, --procs=PXxPY     Split the grid over PX by PY processes. A 0 is\n");
+    fprintf(stderr, "                        chosen automatically (default is 0x0, picked\n");
+    fprintf(stderr, "                        from imax and jmax)\n");
     fprintf(stderr, "  -i, --infile=FILE     Read the initial simulation state from this file\n");
     fprintf(stderr, "                        (default is 'karman.bin')\n");
     fprintf(stderr, "  -o, --outfile=FILE    Write the final simulation state to this file\n");
     fprintf(stderr, "                        (default is 'karman.bin')\n");
+    fprintf(stderr, "  -e, --checkpoint-every=N\n");
+    fprintf(stderr, "                        Save a checkpoint every N timesteps, or every N\n");
+    fprintf(stderr, "                        seconds if N ends in 's', to OUTFILE.ckpt. It is\n");
+    fprintf(stderr, "                        written in the background\n");
+    fprintf(stderr, "  -R, --restart[=FILE]  Resume from a checkpoint (default is\n");
+    fprintf(stderr, "                        OUTFILE.ckpt) instead of reading INFILE\n");
+    fprintf(stderr, "  -f, --frame-every=N   Draw an image of the flow every N timesteps\n");
+    fprintf(stderr, "  -g, --frame-file=FILE Write the images to FILE with the step number\n");
+    fprintf(stderr, "                        before its extension (default is 'frame.ppm',\n");
+    fprintf(stderr, "                        giving frame-000010.ppm ...). A '.pgm' FILE\n");
+    fprintf(stderr, "                        gives greyscale images\n");
+    fprintf(stderr, "  -p, --plot=PLOT       Draw 'zeta' (vorticity, the default) or 'psi'\n");
+    fprintf(stderr, "                        (the stream function) in the images\n");
+    fprintf(stderr, "  -W, --frame-writer    Leave the last process out of the grid to put\n");
+    fprintf(stderr, "                        the images together and write them\n");
+    fprintf(stderr, "  -M, --timing=FILE     Write the time each process spent in each phase\n");
+    fprintf(stderr, "                        of the timesteps to FILE, with the minimum,\n");
+    fprintf(stderr, "                        average and maximum over the processes. As CSV\n");
+    fprintf(stderr, "                        if FILE ends in '.csv', or else as JSON\n");
 }
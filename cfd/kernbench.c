@@ -0,0 +1,704 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <math.h>
+#include "alloc.h"
+#include "boundary.h"
+#include "datadef.h"
+#include "fused.h"
+#include "halo.h"
+#include "init.h"
+#include "kernels.h"
+#include "precision.h"
+#include "redblack.h"
+#include "simulation.h"
+#include "statefile.h"
+#include "statemap.h"
+#include "stencil.h"
+#include "tiled.h"
+#include <mpi.h>
+#include <omp.h>
+
+/* Microbenchmarks of the timestep kernels, one at a time, on one process.
+ * Each kernel is run on the same state, synthetic or read from a state
+ * file, by a team of threads the way karman runs it, and timed over a
+ * number of runs. A run repeats the kernel until it has taken long
+ * enough to time. For each kernel the time per cell is given, with its
+ * spread over the runs, and the memory bandwidth it achieved, counting
+ * each array it reads or writes once per call, against the bandwidth of
+ * a STREAM triad on the same machine.
+ * The kernels timed are the ones picked by the options, as karman's are.
+ * Each is first checked against the reference version on the same input:
+ * the scalar momentum kernels, the unfused kernels and plain red/black
+ * SOR. The largest difference in its output is given.
+ */
+static void print_usage(void);
+static void print_version(void);
+static void print_help(void);
+
+static char *progname;
+
+/* The globals of karman.c that the kernels use */
+int proc = 0;
+int nprocs = 0;
+int ileft, iright;
+int jbottom, jtop;
+MPI_Comm cart_comm;
+int nbr_west, nbr_east;
+int nbr_south, nbr_north;
+int sor_overlap = 0;
+int sor_split = 0;
+int sor_check = 1;
+int mg_cycle = 1;
+int pcg_precond = 0;
+
+#define PACKAGE "kernbench"
+#define VERSION "1.0"
+
+/* Command line options */
+static struct option long_opts[] = {
+    { "check-every", 1, NULL, 'C' },
+    { "help",    0, NULL, 'h' },
+    { "imax",    1, NULL, 'x' },
+    { "infile",  1, NULL, 'i' },
+    { "iters",   1, NULL, 'I' },
+    { "jmax",    1, NULL, 'y' },
+    { "kernels", 1, NULL, 'k' },
+    { "min-time", 1, NULL, 't' },
+    { "overlap", 0, NULL, 'O' },
+    { "runs",    1, NULL, 'n' },
+    { "simd",    1, NULL, 'm' },
+    { "split",   0, NULL, 'S' },
+    { "stream",  1, NULL, 's' },
+    { "tile",    1, NULL, 'T' },
+    { "version", 0, NULL, 'V' },
+    { 0,         0, 0,    0   }
+};
+#define GETOPTS "C:hi:I:k:m:n:Os:St:T:Vx:y:"
+
+/* The kernels, with the arrays each reads or writes per cell: reals,
+ * preals and flags. The pressure solver's are per iteration.
+ */
+#define K_TIMESTEP     0
+#define K_TENTATIVE    1
+#define K_RHS          2
+#define K_FUSED        3
+#define K_POISSON      4
+#define K_UPDATE       5
+#define K_FUSED_UPDATE 6
+#define K_BOUNDARY     7
+#define NKERNELS       8
+
+static const struct kernel {
+    const char *name;
+    int nreal, npreal, nflag;
+} kernel_list[NKERNELS] = {
+    { "timestep",     2, 0, 0 },    /* Reads u, v */
+    { "tentative",    4, 0, 1 },    /* Reads u, v, flag; writes f, g */
+    { "rhs",          2, 1, 1 },    /* Reads f, g, flag; writes rhs */
+    { "fused",        4, 1, 1 },    /* tentative and rhs in one pass */
+    { "poisson",      0, 2, 1 },    /* Reads p, rhs, flag; writes p */
+    { "update",       4, 1, 1 },    /* Reads f, g, p, flag; writes u, v */
+    { "fused-update", 4, 1, 1 },    /* update, and the velocity maxima */
+    { "boundary",     2, 0, 1 }     /* Reads u, v, flag */
+};
+
+/* The state the kernels run on */
+static int imax = 660 * 2, jmax = 120 * 2;
+static real **u, **v, **f, **g;
+static preal **p, **rhs;
+static char **flag;
+static real delx, dely, del_t, ts_del_t;
+static real upwind = 0.9;           /* gamma, for upwind differencing */
+static real Re = 150.0, tau = 0.5, omega = 1.7;
+static real ui = 1.0, vi = 0.0;
+static int ifluid, poisson_iters = 50, iters_done;
+static real umax, vmax;
+
+/* Copies of the input, and the reference kernels' output */
+static real **u0, **v0, **f0, **g0, **ref_u, **ref_v, **ref_f, **ref_g;
+static preal **p0, **rhs0, **ref_p, **ref_rhs;
+
+static size_t ncells(void)
+{
+    return (size_t) (imax+2) * (jmax+2);
+}
+
+static void copy_real(real **to, real **from)
+{
+    memcpy(to[0], from[0], ncells() * sizeof(real));
+}
+
+static void copy_preal(preal **to, preal **from)
+{
+    memcpy(to[0], from[0], ncells() * sizeof(preal));
+}
+
+static double diff_real(real **a, real **b)
+{
+    size_t k;
+    double d, dmax = 0.0;
+
+    for (k = 0; k < ncells(); k++) {
+        d = fabs((double) a[0][k] - (double) b[0][k]);
+        if (d > dmax || d != d) { dmax = d; }
+    }
+    return dmax;
+}
+
+static double diff_preal(preal **a, preal **b)
+{
+    size_t k;
+    double d, dmax = 0.0;
+
+    for (k = 0; k < ncells(); k++) {
+        d = fabs((double) a[0][k] - (double) b[0][k]);
+        if (d > dmax || d != d) { dmax = d; }
+    }
+    return dmax;
+}
+
+/* Put the input back */
+static void restore(void)
+{
+    copy_real(u, u0);
+    copy_real(v, v0);
+    copy_real(f, f0);
+    copy_real(g, g0);
+    copy_preal(p, p0);
+    copy_preal(rhs, rhs0);
+}
+
+/* Run kernel k once. Called by every thread of the team. The reference
+ * runs the unfused kernels in place of the fused ones.
+ */
+static void run_kernel(int k, int reference)
+{
+    int n;
+
+    switch (k) {
+        case K_TIMESTEP:
+            set_timestep_interval(&ts_del_t, imax, jmax, delx, dely, u, v,
+                Re, tau);
+            break;
+        case K_FUSED:
+            if (!reference) {
+                fused_tentative_rhs(u, v, f, g, rhs, flag, imax, jmax,
+                    del_t, delx, dely, upwind, Re);
+                fused_rhs_edges(f, g, rhs, flag, del_t, delx, dely);
+                break;
+            }
+            /* Fall through */
+        case K_TENTATIVE:
+            compute_tentative_velocity(u, v, f, g, flag, imax, jmax, del_t,
+                delx, dely, upwind, Re);
+            if (k == K_TENTATIVE) { break; }
+            /* Fall through */
+        case K_RHS:
+            compute_rhs(f, g, rhs, flag, imax, jmax, del_t, delx, dely);
+            break;
+        case K_POISSON:
+            {
+                double res;
+
+                n = poisson(p, rhs, flag, imax, jmax, delx, dely, 0.0,
+                    poisson_iters, omega, &res, ifluid);
+                #pragma omp master
+                iters_done = n;
+            }
+            break;
+        case K_FUSED_UPDATE:
+            if (!reference) {
+                fused_update_velocity(u, v, f, g, p, flag, imax, jmax,
+                    del_t, delx, dely, &umax, &vmax);
+                break;
+            }
+            /* Fall through */
+        case K_UPDATE:
+            update_velocity(u, v, f, g, p, flag, imax, jmax, del_t, delx,
+                dely);
+            break;
+        case K_BOUNDARY:
+            apply_boundary_conditions(u, v, flag, imax, jmax, ui, vi);
+            break;
+    }
+    #pragma omp barrier
+}
+
+/* The reference kernels, or the ones picked by the options */
+static const char *isa = "auto";
+static int var_overlap, var_split, var_tile;
+
+static void use_kernels(int reference)
+{
+    select_kernels(reference ? "scalar" : isa, jmax);
+    sor_overlap = reference ? 0 : var_overlap;
+    sor_split = reference ? 0 : var_split;
+    sor_tile = reference ? 0 : var_tile;
+}
+
+/* Run kernel k once from the input, as the reference if reference is
+ * non-zero, and keep or compare the output. Returns the largest
+ * difference from the reference's output, or -1 if the kernel has no
+ * other version to compare.
+ */
+static double check_kernel(int k, int reference)
+{
+    double d = 0.0;
+
+    use_kernels(reference);
+    restore();
+    #pragma omp parallel
+    run_kernel(k, reference);
+
+    switch (k) {
+        case K_TENTATIVE: case K_RHS: case K_FUSED:
+            if (reference) {
+                copy_real(ref_f, f);
+                copy_real(ref_g, g);
+                copy_preal(ref_rhs, rhs);
+            } else {
+                d = fmax(diff_real(f, ref_f), diff_real(g, ref_g));
+                d = fmax(d, diff_preal(rhs, ref_rhs));
+            }
+            return (k == K_RHS) ? -1 : d;
+        case K_POISSON:
+            if (reference) {
+                copy_preal(ref_p, p);
+            } else {
+                d = diff_preal(p, ref_p);
+            }
+            return d;
+        case K_UPDATE: case K_FUSED_UPDATE: case K_BOUNDARY:
+            if (reference) {
+                copy_real(ref_u, u);
+                copy_real(ref_v, v);
+            } else {
+                d = fmax(diff_real(u, ref_u), diff_real(v, ref_v));
+            }
+            return (k == K_BOUNDARY) ? -1 : d;
+    }
+    return -1;
+}
+
+/* Time reps calls of kernel k, all in one parallel region as in a
+ * timestep. The solver starts from the input pressure each time.
+ */
+static double time_kernel(int k, int reps)
+{
+    double t0;
+    int r;
+
+    if (k == K_POISSON) { copy_preal(p, p0); }
+    t0 = MPI_Wtime();
+    #pragma omp parallel private(r)
+    for (r = 0; r < reps; r++) {
+        run_kernel(k, 0);
+    }
+    return MPI_Wtime() - t0;
+}
+
+/* Bandwidth of a STREAM triad, a[i] = b[i] + s*c[i], on arrays of mib
+ * MiB each, counting 24 bytes per element. The best of runs, in GB/s.
+ */
+static double stream_triad(int mib, int runs)
+{
+    size_t n = (size_t) mib * 1024 * 1024 / sizeof(double), i;
+    double *a = malloc(n * sizeof(double));
+    double *b = malloc(n * sizeof(double));
+    double *c = malloc(n * sizeof(double));
+    double s = 3.0, t, best = HUGE_VAL;
+    int r;
+
+    if (!a || !b || !c) {
+        free(a);
+        free(b);
+        free(c);
+        return 0.0;
+    }
+    /* Each thread's part of the arrays is in its own memory */
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < n; i++) {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+    for (r = 0; r <= runs; r++) {
+        t = MPI_Wtime();
+        #pragma omp parallel for schedule(static)
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] + s*c[i];
+        }
+        t = MPI_Wtime() - t;
+        /* The first run only warms up */
+        if (r > 0 && t < best) { best = t; }
+    }
+    if (a[n/2] != 7.0) { best = HUGE_VAL; }
+    free(a);
+    free(b);
+    free(c);
+    return 3.0 * n * sizeof(double) / best / 1e9;
+}
+
+/* Set up the synthetic state: the flow of a fresh run, disturbed so that
+ * the kernels do not see a uniform field, and a smooth pressure
+ */
+static void synthetic_state(void)
+{
+    int i, j, ibound = 0;
+
+    for (i = 0; i <= imax+1; i++) {
+        for (j = 0; j <= jmax+1; j++) {
+            double x = (double) i/(imax+1), y = (double) j/(jmax+1);
+            u[i][j] = ui + 0.1*sin(6.283185307*3*x)*sin(3.141592654*y);
+            v[i][j] = vi + 0.1*cos(6.283185307*2*x)*sin(6.283185307*y);
+            p[i][j] = 0.01*cos(3.141592654*x)*cos(3.141592654*y);
+        }
+    }
+    init_flag(flag, imax, jmax, delx, dely, &ibound);
+    #pragma omp parallel
+    apply_boundary_conditions(u, v, flag, imax, jmax, ui, vi);
+}
+
+int main(int argc, char *argv[])
+{
+    int provided;
+    real xlength = 22.0, ylength = 4.1;
+    char *infile = NULL;
+    char *klist = NULL, *name;
+    int want[NKERNELS];
+    int runs = 10, stream_mib = 64;
+    double min_time = 0.02, peak;
+    int show_help = 0, show_usage = 0, show_version = 0;
+    const char *kernels;
+    struct state s;
+    int i, j, k, r, reps, optc;
+    double t, sum, sum2, tmin, mean, sd, bytes, work, diff;
+
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_Comm_rank(MPI_COMM_WORLD, &proc);
+    progname = argv[0];
+
+    while ((optc = getopt_long(argc, argv, GETOPTS, long_opts, NULL)) != -1) {
+        switch (optc) {
+            case 'h':
+                show_help = 1;
+                break;
+            case 'V':
+                show_version = 1;
+                break;
+            case 'x':
+                imax = atoi(optarg);
+                break;
+            case 'y':
+                jmax = atoi(optarg);
+                break;
+            case 'i':
+                infile = optarg;
+                break;
+            case 'k':
+                klist = optarg;
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                if (runs < 1) {
+                    fprintf(stderr, "%s: Invalid number of runs '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 't':
+                min_time = atof(optarg);
+                break;
+            case 'I':
+                poisson_iters = atoi(optarg);
+                if (poisson_iters < 1) {
+                    fprintf(stderr, "%s: Invalid number of iterations "
+                        "'%s'\n", progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 's':
+                stream_mib = atoi(optarg);
+                break;
+            case 'm':
+                isa = optarg;
+                break;
+            case 'C':
+                sor_check = atoi(optarg);
+                if (sor_check < 1) {
+                    fprintf(stderr, "%s: Invalid check interval '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            case 'O':
+                var_overlap = 1;
+                break;
+            case 'S':
+                var_split = 1;
+                break;
+            case 'T':
+                sor_tile = atoi(optarg);
+                if (sor_tile < 0) {
+                    fprintf(stderr, "%s: Invalid tile size '%s'\n",
+                        progname, optarg);
+                    show_usage = 1;
+                }
+                break;
+            default:
+                show_usage = 1;
+        }
+    }
+
+    /* The kernels to run, all of them by default */
+    for (k = 0; k < NKERNELS; k++) { want[k] = (klist == NULL); }
+    if (klist != NULL) {
+        for (name = strtok(klist, ","); name; name = strtok(NULL, ",")) {
+            for (k = 0; k < NKERNELS; k++) {
+                if (strcasecmp(name, kernel_list[k].name) == 0) { break; }
+            }
+            if (k == NKERNELS) {
+                fprintf(stderr, "%s: Unknown kernel '%s'\n", progname, name);
+                show_usage = 1;
+            } else {
+                want[k] = 1;
+            }
+        }
+    }
+
+    if (show_usage || optind < argc) {
+        print_usage();
+        MPI_Finalize();
+        return 1;
+    }
+    if (show_version) {
+        print_version();
+        if (!show_help) {
+            MPI_Finalize();
+            return 0;
+        }
+    }
+    if (show_help) {
+        print_help();
+        MPI_Finalize();
+        return 0;
+    }
+    if (nprocs != 1) {
+        if (proc == 0) {
+            fprintf(stderr, "%s: Runs on one process, with threads\n",
+                progname);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    /* A state file sets the size of the grid */
+    if (infile != NULL) {
+        if (state_open(infile, &s)) {
+            MPI_Finalize();
+            return 1;
+        }
+        imax = s.imax;
+        jmax = s.jmax;
+        xlength = s.xlength;
+        ylength = s.ylength;
+        state_close(&s);
+    }
+    delx = xlength/imax;
+    dely = ylength/jmax;
+
+    u    = alloc_realmatrix(imax+2, jmax+2);
+    v    = alloc_realmatrix(imax+2, jmax+2);
+    f    = alloc_realmatrix(imax+2, jmax+2);
+    g    = alloc_realmatrix(imax+2, jmax+2);
+    p    = alloc_prealmatrix(imax+2, jmax+2);
+    rhs  = alloc_prealmatrix(imax+2, jmax+2);
+    flag = alloc_charmatrix(imax+2, jmax+2);
+    u0 = alloc_realmatrix(imax+2, jmax+2);
+    v0 = alloc_realmatrix(imax+2, jmax+2);
+    f0 = alloc_realmatrix(imax+2, jmax+2);
+    g0 = alloc_realmatrix(imax+2, jmax+2);
+    p0 = alloc_prealmatrix(imax+2, jmax+2);
+    rhs0 = alloc_prealmatrix(imax+2, jmax+2);
+    ref_u = alloc_realmatrix(imax+2, jmax+2);
+    ref_v = alloc_realmatrix(imax+2, jmax+2);
+    ref_f = alloc_realmatrix(imax+2, jmax+2);
+    ref_g = alloc_realmatrix(imax+2, jmax+2);
+    ref_p = alloc_prealmatrix(imax+2, jmax+2);
+    ref_rhs = alloc_prealmatrix(imax+2, jmax+2);
+    if (!u || !v || !f || !g || !p || !rhs || !flag || !u0 || !v0 || !f0 ||
+        !g0 || !p0 || !rhs0 || !ref_u || !ref_v || !ref_f || !ref_g ||
+        !ref_p || !ref_rhs) {
+        fprintf(stderr, "Couldn't allocate memory for matrices.\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (decompose_domain(imax, jmax, 1, 1)) {
+        MPI_Finalize();
+        return 1;
+    }
+    /* The kernels work on the pages placed as karman places them */
+    first_touch(u, ileft, iright, jmax+2, sizeof(real));
+    first_touch(v, ileft, iright, jmax+2, sizeof(real));
+    first_touch(f, ileft, iright, jmax+2, sizeof(real));
+    first_touch(g, ileft, iright, jmax+2, sizeof(real));
+    first_touch(p, ileft, iright, jmax+2, sizeof(preal));
+    first_touch(rhs, ileft, iright, jmax+2, sizeof(preal));
+    first_touch(flag, ileft, iright, jmax+2, sizeof(char));
+    if (infile == NULL) {
+        synthetic_state();
+    } else if (read_bin(u, v, p, flag, imax, jmax, xlength, ylength,
+            infile) != 0) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    if ((kernels = select_kernels(isa, jmax)) == NULL) {
+        fprintf(stderr, "%s: Instruction set '%s' is not available\n",
+            progname, isa);
+        MPI_Finalize();
+        return 1;
+    }
+    build_stencil(flag, imax, jmax, delx, dely, omega, tiled_setup(imax,
+        jmax));
+    var_tile = sor_tile;
+    if (var_split && !var_tile) { rb_setup(flag, imax, jmax); }
+    fused_setup(flag, imax, jmax);
+
+    ifluid = 0;
+    for (i = 1; i <= imax; i++) {
+        for (j = 1; j <= jmax; j++) {
+            if (flag[i][j] & C_F) { ifluid++; }
+        }
+    }
+
+    /* The input of each kernel is what the timestep before it leaves */
+    use_kernels(1);
+    del_t = 0.003;
+    #pragma omp parallel
+    {
+        set_timestep_interval(&del_t, imax, jmax, delx, dely, u, v, Re,
+            tau);
+        run_kernel(K_FUSED, 1);
+    }
+    copy_real(u0, u);
+    copy_real(v0, v);
+    copy_real(f0, f);
+    copy_real(g0, g);
+    copy_preal(p0, p);
+    copy_preal(rhs0, rhs);
+
+    peak = (stream_mib > 0) ? stream_triad(stream_mib, runs) : 0.0;
+
+    printf("Grid %dx%d from %s, %s precision, %s kernels, %d thread%s\n",
+        imax, jmax, (infile != NULL) ? infile : "a synthetic state",
+        PRECISION_NAME, kernels, omp_get_max_threads(),
+        (omp_get_max_threads() == 1) ? "" : "s");
+    if (peak > 0.0) {
+        printf("STREAM triad on %d MiB arrays: %.2f GB/s\n", stream_mib,
+            peak);
+    }
+    printf("Poisson: %d iterations per call, ns/cell per iteration\n",
+        poisson_iters);
+    printf("Differences from the scalar, unfused, plain SOR reference\n\n");
+    printf("%-13s %9s %9s %9s %6s %8s %6s %10s\n", "kernel", "ns/cell",
+        "min", "stddev", "cv%", "GB/s", "%peak", "maxdiff");
+
+    for (k = 0; k < NKERNELS; k++) {
+        if (!want[k]) { continue; }
+
+        check_kernel(k, 1);
+        diff = check_kernel(k, 0);
+
+        /* Find how many calls make a run long enough to time */
+        restore();
+        for (reps = 1; reps < (1 << 20); reps *= 2) {
+            if (k == K_POISSON || time_kernel(k, reps) >= min_time) {
+                break;
+            }
+        }
+
+        sum = sum2 = 0.0;
+        tmin = HUGE_VAL;
+        for (r = 0; r < runs; r++) {
+            t = time_kernel(k, reps) / reps;
+            if (k == K_POISSON) { t /= iters_done; }
+            t = t / ((double) imax * jmax) * 1e9;
+            sum += t;
+            sum2 += t*t;
+            if (t < tmin) { tmin = t; }
+        }
+        mean = sum / runs;
+        sd = (runs > 1) ? sqrt(fmax(0.0, (sum2 - sum*mean) / (runs-1))) :
+            0.0;
+        bytes = kernel_list[k].nreal * sizeof(real) +
+            kernel_list[k].npreal * sizeof(preal) + kernel_list[k].nflag;
+        work = bytes / tmin;
+
+        printf("%-13s %9.3f %9.3f %9.3f %6.1f %8.2f ", kernel_list[k].name,
+            mean, tmin, sd, 100.0 * sd / mean, work);
+        if (peak > 0.0) {
+            printf("%6.1f ", 100.0 * work / peak);
+        } else {
+            printf("%6s ", "-");
+        }
+        if (diff < 0.0) {
+            printf("%10s\n", "-");
+        } else {
+            printf("%10.3g\n", diff);
+        }
+    }
+
+    free_stencil();
+    if (var_split && !var_tile) { rb_free(); }
+    fused_free();
+    MPI_Finalize();
+    return 0;
+}
+
+static void print_usage(void)
+{
+    fprintf(stderr, "Try '%s --help' for more information.\n", progname);
+}
+
+static void print_version(void)
+{
+    fprintf(stderr, "%s %s\n", PACKAGE, VERSION);
+}
+
+static void print_help(void)
+{
+    fprintf(stderr, "%s. Microbenchmarks of karman's timestep kernels.\n\n",
+        PACKAGE);
+    fprintf(stderr, "Usage: %s [OPTIONS]...\n\n", progname);
+    fprintf(stderr, "Each kernel is timed on one process, with OMP_NUM_THREADS threads,\n");
+    fprintf(stderr, "and checked against the reference kernels on the same input.\n\n");
+    fprintf(stderr, "  -h, --help            Print a summary of the options\n");
+    fprintf(stderr, "  -V, --version         Print the version number\n");
+    fprintf(stderr, "  -x, --imax=IMAX       Set the number of interior cells in the X direction\n");
+    fprintf(stderr, "  -y, --jmax=JMAX       Set the number of interior cells in the Y direction\n");
+    fprintf(stderr, "  -i, --infile=FILE     Run the kernels on the state in FILE, which sets\n");
+    fprintf(stderr, "                        the grid, instead of on a synthetic one\n");
+    fprintf(stderr, "  -k, --kernels=LIST    Run the kernels in the comma separated LIST, of\n");
+    fprintf(stderr, "                        'timestep', 'tentative', 'rhs', 'fused',\n");
+    fprintf(stderr, "                        'poisson', 'update', 'fused-update' and\n");
+    fprintf(stderr, "                        'boundary' (default is all of them)\n");
+    fprintf(stderr, "  -n, --runs=N          Time each kernel N times (default is 10)\n");
+    fprintf(stderr, "  -t, --min-time=SECS   Repeat a kernel within a run until it takes\n");
+    fprintf(stderr, "                        SECS (default is 0.02)\n");
+    fprintf(stderr, "  -I, --iters=N         Run N SOR iterations per call (default is 50)\n");
+    fprintf(stderr, "  -s, --stream=MIB      Measure the memory bandwidth with MIB MiB arrays,\n");
+    fprintf(stderr, "                        0 for not at all (default is 64)\n");
+    fprintf(stderr, "  -m, --simd=ISA        Set the instruction set of the momentum\n");
+    fprintf(stderr, "                        kernels, as for karman (default is 'auto')\n");
+    fprintf(stderr, "  -C, --check-every=N   Check the SOR residual every N iterations\n");
+    fprintf(stderr, "  -O, --overlap         Overlap the SOR halo exchange with the sweep\n");
+    fprintf(stderr, "  -S, --split           Store the SOR pressure and right hand side\n");
+    fprintf(stderr, "                        as separate red and black arrays\n");
+    fprintf(stderr, "  -T, --tile=N          Run N SOR iterations at a time as one pass\n");
+}
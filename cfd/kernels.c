@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "datadef.h"
+#include "kernels.h"
+
+/* Scalar column kernels. The SIMD versions must give the same results, so
+ * they repeat the arithmetic below exactly: the convective terms and the
+ * Laplacians are evaluated in double (fabs() and the 2.0 and 4.0 literals
+ * promote them), and the rest in float.
+ */
+
+/* f for cells j0..j1 of column i */
+static void f_column_scalar(real **u, real **v, real **f, char **flag,
+    int i, int j0, int j1, real del_t, real delx, real dely, real gamma,
+    real Re)
+{
+    int j;
+    real du2dx, duvdy, laplu;
+
+    for (j=j0; j<=j1; j++) {
+        /* only if both adjacent cells are fluid cells */
+        if ((flag[i][j] & C_F) && (flag[i+1][j] & C_F)) {
+            du2dx = ((u[i][j]+u[i+1][j])*(u[i][j]+u[i+1][j])+
+                gamma*fabs(u[i][j]+u[i+1][j])*(u[i][j]-u[i+1][j])-
+                (u[i-1][j]+u[i][j])*(u[i-1][j]+u[i][j])-
+                gamma*fabs(u[i-1][j]+u[i][j])*(u[i-1][j]-u[i][j]))
+                /(4.0*delx);
+            duvdy = ((v[i][j]+v[i+1][j])*(u[i][j]+u[i][j+1])+
+                gamma*fabs(v[i][j]+v[i+1][j])*(u[i][j]-u[i][j+1])-
+                (v[i][j-1]+v[i+1][j-1])*(u[i][j-1]+u[i][j])-
+                gamma*fabs(v[i][j-1]+v[i+1][j-1])*(u[i][j-1]-u[i][j]))
+                /(4.0*dely);
+            laplu = (u[i+1][j]-2.0*u[i][j]+u[i-1][j])/delx/delx+
+                (u[i][j+1]-2.0*u[i][j]+u[i][j-1])/dely/dely;
+
+            f[i][j] = u[i][j]+del_t*(laplu/Re-du2dx-duvdy);
+        } else {
+            f[i][j] = u[i][j];
+        }
+    }
+}
+
+/* g for cells j0..j1 of column i */
+static void g_column_scalar(real **u, real **v, real **g, char **flag,
+    int i, int j0, int j1, real del_t, real delx, real dely, real gamma,
+    real Re)
+{
+    int j;
+    real duvdx, dv2dy, laplv;
+
+    for (j=j0; j<=j1; j++) {
+        /* only if both adjacent cells are fluid cells */
+        if ((flag[i][j] & C_F) && (flag[i][j+1] & C_F)) {
+            duvdx = ((u[i][j]+u[i][j+1])*(v[i][j]+v[i+1][j])+
+                gamma*fabs(u[i][j]+u[i][j+1])*(v[i][j]-v[i+1][j])-
+                (u[i-1][j]+u[i-1][j+1])*(v[i-1][j]+v[i][j])-
+                gamma*fabs(u[i-1][j]+u[i-1][j+1])*(v[i-1][j]-v[i][j]))
+                /(4.0*delx);
+            dv2dy = ((v[i][j]+v[i][j+1])*(v[i][j]+v[i][j+1])+
+                gamma*fabs(v[i][j]+v[i][j+1])*(v[i][j]-v[i][j+1])-
+                (v[i][j-1]+v[i][j])*(v[i][j-1]+v[i][j])-
+                gamma*fabs(v[i][j-1]+v[i][j])*(v[i][j-1]-v[i][j]))
+                /(4.0*dely);
+
+            laplv = (v[i+1][j]-2.0*v[i][j]+v[i-1][j])/delx/delx+
+                (v[i][j+1]-2.0*v[i][j]+v[i][j-1])/dely/dely;
+
+            g[i][j] = v[i][j]+del_t*(laplv/Re-duvdx-dv2dy);
+        } else {
+            g[i][j] = v[i][j];
+        }
+    }
+}
+
+/* u for cells j0..j1 of column i */
+static void u_column_scalar(real **u, real **f, preal **p, char **flag,
+    int i, int j0, int j1, real del_t, real delx)
+{
+    int j;
+
+    for (j=j0; j<=j1; j++) {
+        /* only if both adjacent cells are fluid cells */
+        if ((flag[i][j] & C_F) && (flag[i+1][j] & C_F)) {
+            u[i][j] = f[i][j]-(p[i+1][j]-p[i][j])*del_t/delx;
+        }
+    }
+}
+
+/* v for cells j0..j1 of column i */
+static void v_column_scalar(real **v, real **g, preal **p, char **flag,
+    int i, int j0, int j1, real del_t, real dely)
+{
+    int j;
+
+    for (j=j0; j<=j1; j++) {
+        /* only if both adjacent cells are fluid cells */
+        if ((flag[i][j] & C_F) && (flag[i][j+1] & C_F)) {
+            v[i][j] = g[i][j]-(p[i][j+1]-p[i][j])*del_t/dely;
+        }
+    }
+}
+
+
+/* The SIMD kernels are for float velocities; the double precision build
+ * only has the scalar ones.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(REAL_DOUBLE)
+#include <immintrin.h>
+#define HAVE_SIMD
+
+/* The SIMD kernels handle W cells at a time. Float values are held in a
+ * vector of W floats and widened to a vector of W doubles for the parts
+ * that the scalar code evaluates in double, so the rounding is the same.
+ * The flag masks select between the fluid-cell result and the old value.
+ * kernels_simd.h is instantiated once per instruction set; GCC must not
+ * contract the separate multiplies and adds into FMAs (see CFLAGS).
+ * In the mixed precision build LDP loads W double pressures for the
+ * update kernels.
+ */
+
+/* SSE2: 2 cells, floats in the low half of an __m128 */
+static inline __m128 fluid_mask_sse2(const char *a, const char *b)
+{
+    unsigned short x, y;
+    __m128i m, z = _mm_setzero_si128();
+
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    m = _mm_cvtsi32_si128(x & y & (C_F * 0x0101));
+    m = _mm_unpacklo_epi16(_mm_unpacklo_epi8(m, z), z);
+    return _mm_castsi128_ps(_mm_cmpgt_epi32(m, z));
+}
+
+#define ISA        sse2
+#define TARGET     __attribute__((target("sse2")))
+#define W          2
+#define FV         __m128
+#define DV         __m128d
+#define LDF(p)     _mm_castpd_ps(_mm_load_sd((const double *) (p)))
+#define STF(p, x)  _mm_store_sd((double *) (p), _mm_castps_pd(x))
+#define LDP(p)     _mm_loadu_pd(p)
+#define F1(x)      _mm_set1_ps(x)
+#define FADD       _mm_add_ps
+#define FSUB       _mm_sub_ps
+#define FMUL       _mm_mul_ps
+#define FDIV       _mm_div_ps
+#define D1(x)      _mm_set1_pd(x)
+#define DADD       _mm_add_pd
+#define DSUB       _mm_sub_pd
+#define DMUL       _mm_mul_pd
+#define DDIV       _mm_div_pd
+#define DABS(x)    _mm_andnot_pd(_mm_set1_pd(-0.0), x)
+#define TOD(x)     _mm_cvtps_pd(x)
+#define TOF(x)     _mm_cvtpd_ps(x)
+#define FLUID(a, b) fluid_mask_sse2(a, b)
+#define BLEND(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#include "kernels_simd.h"
+
+/* AVX2: 4 cells, floats in an __m128 and doubles in an __m256d */
+static inline __attribute__((target("avx2")))
+__m128 fluid_mask_avx2(const char *a, const char *b)
+{
+    unsigned int x, y;
+    __m128i m;
+
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    m = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(x & y & (C_F * 0x01010101u)));
+    return _mm_castsi128_ps(_mm_cmpgt_epi32(m, _mm_setzero_si128()));
+}
+
+#define ISA        avx2
+#define TARGET     __attribute__((target("avx2")))
+#define W          4
+#define FV         __m128
+#define DV         __m256d
+#define LDF(p)     _mm_loadu_ps(p)
+#define STF(p, x)  _mm_storeu_ps(p, x)
+#define LDP(p)     _mm256_loadu_pd(p)
+#define F1(x)      _mm_set1_ps(x)
+#define FADD       _mm_add_ps
+#define FSUB       _mm_sub_ps
+#define FMUL       _mm_mul_ps
+#define FDIV       _mm_div_ps
+#define D1(x)      _mm256_set1_pd(x)
+#define DADD       _mm256_add_pd
+#define DSUB       _mm256_sub_pd
+#define DMUL       _mm256_mul_pd
+#define DDIV       _mm256_div_pd
+#define DABS(x)    _mm256_andnot_pd(_mm256_set1_pd(-0.0), x)
+#define TOD(x)     _mm256_cvtps_pd(x)
+#define TOF(x)     _mm256_cvtpd_ps(x)
+#define FLUID(a, b) fluid_mask_avx2(a, b)
+#define BLEND(m, a, b) _mm_blendv_ps(b, a, m)
+#include "kernels_simd.h"
+
+/* AVX-512: 8 cells, floats in an __m256 and doubles in an __m512d */
+static inline __attribute__((target("avx512f")))
+__m256 fluid_mask_avx512(const char *a, const char *b)
+{
+    unsigned long long x, y;
+    __m256i m;
+
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    m = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(
+        x & y & (C_F * 0x0101010101010101ull)));
+    return _mm256_castsi256_ps(_mm256_cmpgt_epi32(m, _mm256_setzero_si256()));
+}
+
+#define ISA        avx512
+#define TARGET     __attribute__((target("avx512f")))
+#define W          8
+#define FV         __m256
+#define DV         __m512d
+#define LDF(p)     _mm256_loadu_ps(p)
+#define STF(p, x)  _mm256_storeu_ps(p, x)
+#define LDP(p)     _mm512_loadu_pd(p)
+#define F1(x)      _mm256_set1_ps(x)
+#define FADD       _mm256_add_ps
+#define FSUB       _mm256_sub_ps
+#define FMUL       _mm256_mul_ps
+#define FDIV       _mm256_div_ps
+#define D1(x)      _mm512_set1_pd(x)
+#define DADD       _mm512_add_pd
+#define DSUB       _mm512_sub_pd
+#define DMUL       _mm512_mul_pd
+#define DDIV       _mm512_div_pd
+#define DABS(x)    _mm512_abs_pd(x)
+#define TOD(x)     _mm512_cvtps_pd(x)
+#define TOF(x)     _mm512_cvtpd_ps(x)
+#define FLUID(a, b) fluid_mask_avx512(a, b)
+#define BLEND(m, a, b) _mm256_blendv_ps(b, a, m)
+#include "kernels_simd.h"
+#endif
+
+
+/* Kernels for the production grids, built when FIXED_KERNELS is defined
+ * (see the Makefile)
+ */
+#ifdef FIXED_KERNELS
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FIXED_TARGET \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define FIXED_TARGET
+#endif
+
+#define JMAX 120
+#include "kernels_fixed.h"
+#define JMAX 240
+#include "kernels_fixed.h"
+#define JMAX 480
+#include "kernels_fixed.h"
+
+#define FIXED_GRID(jm) { jm, f_column_fixed_ ## jm, g_column_fixed_ ## jm, \
+    u_column_fixed_ ## jm, v_column_fixed_ ## jm }
+#endif
+
+static const struct fixed_kernels {
+    int jmax;
+    tentative_column f, g;
+    update_column u, v;
+} fixed[] = {
+#ifdef FIXED_KERNELS
+    FIXED_GRID(120),
+    FIXED_GRID(240),
+    FIXED_GRID(480),
+#endif
+    { 0, NULL, NULL, NULL, NULL }
+};
+
+
+tentative_column f_column = f_column_scalar, g_column = g_column_scalar;
+update_column u_column = u_column_scalar, v_column = v_column_scalar;
+
+/* Point the column kernels at the versions for isa, which is one of
+ * "scalar", "sse2", "avx2", "avx512", or "auto" for the best this CPU
+ * supports: the kernels specialised for grids jmax cells high if this
+ * build has them, and otherwise the widest SIMD ones. Returns the name of
+ * the kernels chosen, or NULL if isa is unknown or not supported here.
+ */
+const char *select_kernels(const char *isa, int jmax)
+{
+    static char name[32];
+    int k, automatic = strcasecmp(isa, "auto") == 0;
+
+    for (k = 0; automatic && fixed[k].jmax > 0; k++) {
+        if (fixed[k].jmax == jmax) {
+            f_column = fixed[k].f;
+            g_column = fixed[k].g;
+            u_column = fixed[k].u;
+            v_column = fixed[k].v;
+            snprintf(name, sizeof(name), "fixed for jmax %d", jmax);
+            return name;
+        }
+    }
+
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if ((automatic || strcasecmp(isa, "avx512") == 0) &&
+        __builtin_cpu_supports("avx512f")) {
+        f_column = f_column_avx512;
+        g_column = g_column_avx512;
+        u_column = u_column_avx512;
+        v_column = v_column_avx512;
+        return "avx512";
+    }
+    if ((automatic || strcasecmp(isa, "avx2") == 0) &&
+        __builtin_cpu_supports("avx2")) {
+        f_column = f_column_avx2;
+        g_column = g_column_avx2;
+        u_column = u_column_avx2;
+        v_column = v_column_avx2;
+        return "avx2";
+    }
+    if ((automatic || strcasecmp(isa, "sse2") == 0) &&
+        __builtin_cpu_supports("sse2")) {
+        f_column = f_column_sse2;
+        g_column = g_column_sse2;
+        u_column = u_column_sse2;
+        v_column = v_column_sse2;
+        return "sse2";
+    }
+#endif
+    if (automatic || strcasecmp(isa, "scalar") == 0) {
+        f_column = f_column_scalar;
+        g_column = g_column_scalar;
+        u_column = u_column_scalar;
+        v_column = v_column_scalar;
+        return "scalar";
+    }
+    return NULL;
+}
@@ -0,0 +1,17 @@
+#include "precision.h"
+
+/* Column kernels for the momentum equations. Each computes cells j0..j1
+ * of column i of one of the loops in compute_tentative_velocity() or
+ * update_velocity(); select_kernels() points them at the scalar versions
+ * or at SIMD versions for the instruction set picked.
+ */
+typedef void (*tentative_column)(real **u, real **v, real **fg,
+    char **flag, int i, int j0, int j1, real del_t, real delx, real dely,
+    real gamma, real Re);
+typedef void (*update_column)(real **uv, real **fg, preal **p,
+    char **flag, int i, int j0, int j1, real del_t, real delxy);
+
+extern tentative_column f_column, g_column;
+extern update_column u_column, v_column;
+
+const char *select_kernels(const char *isa, int jmax);
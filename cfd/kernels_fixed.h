@@ -0,0 +1,131 @@
+/* Column kernels specialised for grids of JMAX cells vertically, included
+ * by kernels.c once per production grid with JMAX defined. The matrices
+ * are addressed as flat arrays through restrict-qualified pointers, with
+ * a compile-time column stride S, so the compiler can vectorise the loops
+ * without aliasing checks and fold the neighbours' offsets into the
+ * addressing. The arithmetic is the scalar kernels', in the same order,
+ * and a cell that is not updated is written back unchanged so the loops
+ * have no branches. FIXED_TARGET has GCC build a clone of each kernel for
+ * each instruction set and pick one when the program starts.
+ */
+#define CAT2(a, b) a ## _ ## b
+#define CAT(a, b)  CAT2(a, b)
+#define S          (JMAX+2)
+
+static inline void CAT(f_fixed, JMAX)(const real *restrict u,
+    const real *restrict v, real *restrict f, const char *restrict flag,
+    int i, int j0, int j1, real del_t, real delx, real dely, real gamma,
+    real Re)
+{
+    int j, k;
+    real du2dx, duvdy, laplu;
+
+    for (j=j0; j<=j1; j++) {
+        k = i*S + j;
+        du2dx = ((u[k]+u[k+S])*(u[k]+u[k+S])+
+            gamma*fabs(u[k]+u[k+S])*(u[k]-u[k+S])-
+            (u[k-S]+u[k])*(u[k-S]+u[k])-
+            gamma*fabs(u[k-S]+u[k])*(u[k-S]-u[k]))
+            /(4.0*delx);
+        duvdy = ((v[k]+v[k+S])*(u[k]+u[k+1])+
+            gamma*fabs(v[k]+v[k+S])*(u[k]-u[k+1])-
+            (v[k-1]+v[k+S-1])*(u[k-1]+u[k])-
+            gamma*fabs(v[k-1]+v[k+S-1])*(u[k-1]-u[k]))
+            /(4.0*dely);
+        laplu = (u[k+S]-2.0*u[k]+u[k-S])/delx/delx+
+            (u[k+1]-2.0*u[k]+u[k-1])/dely/dely;
+
+        f[k] = ((flag[k] & flag[k+S] & C_F) ?
+            u[k]+del_t*(laplu/Re-du2dx-duvdy) : u[k]);
+    }
+}
+
+static inline void CAT(g_fixed, JMAX)(const real *restrict u,
+    const real *restrict v, real *restrict g, const char *restrict flag,
+    int i, int j0, int j1, real del_t, real delx, real dely, real gamma,
+    real Re)
+{
+    int j, k;
+    real duvdx, dv2dy, laplv;
+
+    for (j=j0; j<=j1; j++) {
+        k = i*S + j;
+        duvdx = ((u[k]+u[k+1])*(v[k]+v[k+S])+
+            gamma*fabs(u[k]+u[k+1])*(v[k]-v[k+S])-
+            (u[k-S]+u[k-S+1])*(v[k-S]+v[k])-
+            gamma*fabs(u[k-S]+u[k-S+1])*(v[k-S]-v[k]))
+            /(4.0*delx);
+        dv2dy = ((v[k]+v[k+1])*(v[k]+v[k+1])+
+            gamma*fabs(v[k]+v[k+1])*(v[k]-v[k+1])-
+            (v[k-1]+v[k])*(v[k-1]+v[k])-
+            gamma*fabs(v[k-1]+v[k])*(v[k-1]-v[k]))
+            /(4.0*dely);
+        laplv = (v[k+S]-2.0*v[k]+v[k-S])/delx/delx+
+            (v[k+1]-2.0*v[k]+v[k-1])/dely/dely;
+
+        g[k] = ((flag[k] & flag[k+1] & C_F) ?
+            v[k]+del_t*(laplv/Re-duvdx-dv2dy) : v[k]);
+    }
+}
+
+static inline void CAT(u_fixed, JMAX)(real *restrict u,
+    const real *restrict f, const preal *restrict p,
+    const char *restrict flag, int i, int j0, int j1, real del_t, real delx)
+{
+    int j, k;
+
+    for (j=j0; j<=j1; j++) {
+        k = i*S + j;
+        u[k] = ((flag[k] & flag[k+S] & C_F) ?
+            f[k]-(p[k+S]-p[k])*del_t/delx : u[k]);
+    }
+}
+
+static inline void CAT(v_fixed, JMAX)(real *restrict v,
+    const real *restrict g, const preal *restrict p,
+    const char *restrict flag, int i, int j0, int j1, real del_t, real dely)
+{
+    int j, k;
+
+    for (j=j0; j<=j1; j++) {
+        k = i*S + j;
+        v[k] = ((flag[k] & flag[k+1] & C_F) ?
+            g[k]-(p[k+1]-p[k])*del_t/dely : v[k]);
+    }
+}
+
+/* The column kernels proper, which hand the matrices' elements to the
+ * loops above as restrict-qualified parameters
+ */
+static FIXED_TARGET void CAT(f_column_fixed, JMAX)(real **u, real **v,
+    real **f, char **flag, int i, int j0, int j1, real del_t, real delx,
+    real dely, real gamma, real Re)
+{
+    CAT(f_fixed, JMAX)(u[0], v[0], f[0], flag[0], i, j0, j1, del_t, delx,
+        dely, gamma, Re);
+}
+
+static FIXED_TARGET void CAT(g_column_fixed, JMAX)(real **u, real **v,
+    real **g, char **flag, int i, int j0, int j1, real del_t, real delx,
+    real dely, real gamma, real Re)
+{
+    CAT(g_fixed, JMAX)(u[0], v[0], g[0], flag[0], i, j0, j1, del_t, delx,
+        dely, gamma, Re);
+}
+
+static FIXED_TARGET void CAT(u_column_fixed, JMAX)(real **u, real **f,
+    preal **p, char **flag, int i, int j0, int j1, real del_t, real delx)
+{
+    CAT(u_fixed, JMAX)(u[0], f[0], p[0], flag[0], i, j0, j1, del_t, delx);
+}
+
+static FIXED_TARGET void CAT(v_column_fixed, JMAX)(real **v, real **g,
+    preal **p, char **flag, int i, int j0, int j1, real del_t, real dely)
+{
+    CAT(v_fixed, JMAX)(v[0], g[0], p[0], flag[0], i, j0, j1, del_t, dely);
+}
+
+#undef CAT
+#undef CAT2
+#undef S
+#undef JMAX
@@ -0,0 +1,180 @@
+/* SIMD versions of the column kernels, included by kernels.c once per
+ * instruction set with ISA, TARGET, W and the vector operations defined.
+ * The arithmetic follows the scalar kernels operation for operation; the
+ * last j1-j0+1 mod W cells are left to the scalar kernels. The velocities
+ * are float; the pressure may be double (see precision.h).
+ */
+#define CAT2(a, b) a ## _ ## b
+#define CAT(a, b)  CAT2(a, b)
+
+static TARGET void CAT(f_column, ISA)(float **u, float **v, float **f,
+    char **flag, int i, int j0, int j1, float del_t, float delx, float dely,
+    float gamma, float Re)
+{
+    int j;
+    FV uc, ue, uw, un, us, vc, ve, vs, vse, s1, s0, du2dx, duvdy, laplu;
+    DV t, x, y;
+    FV dt = F1(del_t), re = F1(Re);
+    DV g = D1(gamma), two = D1(2.0), dx = D1(delx), dy = D1(dely);
+    DV four_dx = D1(4.0*delx), four_dy = D1(4.0*dely);
+
+    for (j = j0; j + W-1 <= j1; j += W) {
+        uc = LDF(&u[i][j]);
+        ue = LDF(&u[i+1][j]);
+        uw = LDF(&u[i-1][j]);
+        un = LDF(&u[i][j+1]);
+        us = LDF(&u[i][j-1]);
+        vc = LDF(&v[i][j]);
+        ve = LDF(&v[i+1][j]);
+        vs = LDF(&v[i][j-1]);
+        vse = LDF(&v[i+1][j-1]);
+
+        s1 = FADD(uc, ue);
+        s0 = FADD(uw, uc);
+        t = DADD(TOD(FMUL(s1, s1)),
+            DMUL(DMUL(g, DABS(TOD(s1))), TOD(FSUB(uc, ue))));
+        t = DSUB(t, TOD(FMUL(s0, s0)));
+        t = DSUB(t, DMUL(DMUL(g, DABS(TOD(s0))), TOD(FSUB(uw, uc))));
+        du2dx = TOF(DDIV(t, four_dx));
+
+        s1 = FADD(vc, ve);
+        s0 = FADD(vs, vse);
+        t = DADD(TOD(FMUL(s1, FADD(uc, un))),
+            DMUL(DMUL(g, DABS(TOD(s1))), TOD(FSUB(uc, un))));
+        t = DSUB(t, TOD(FMUL(s0, FADD(us, uc))));
+        t = DSUB(t, DMUL(DMUL(g, DABS(TOD(s0))), TOD(FSUB(us, uc))));
+        duvdy = TOF(DDIV(t, four_dy));
+
+        x = DADD(DSUB(TOD(ue), DMUL(two, TOD(uc))), TOD(uw));
+        y = DADD(DSUB(TOD(un), DMUL(two, TOD(uc))), TOD(us));
+        laplu = TOF(DADD(DDIV(DDIV(x, dx), dx), DDIV(DDIV(y, dy), dy)));
+
+        s1 = FADD(uc, FMUL(dt, FSUB(FSUB(FDIV(laplu, re), du2dx), duvdy)));
+        STF(&f[i][j], BLEND(FLUID(&flag[i][j], &flag[i+1][j]), s1, uc));
+    }
+    f_column_scalar(u, v, f, flag, i, j, j1, del_t, delx, dely, gamma, Re);
+}
+
+static TARGET void CAT(g_column, ISA)(float **u, float **v, float **g,
+    char **flag, int i, int j0, int j1, float del_t, float delx, float dely,
+    float gamma, float Re)
+{
+    int j;
+    FV vc, ve, vw, vn, vs, uc, un, uw, unw, s1, s0, duvdx, dv2dy, laplv;
+    DV t, x, y;
+    FV dt = F1(del_t), re = F1(Re);
+    DV gm = D1(gamma), two = D1(2.0), dx = D1(delx), dy = D1(dely);
+    DV four_dx = D1(4.0*delx), four_dy = D1(4.0*dely);
+
+    for (j = j0; j + W-1 <= j1; j += W) {
+        vc = LDF(&v[i][j]);
+        ve = LDF(&v[i+1][j]);
+        vw = LDF(&v[i-1][j]);
+        vn = LDF(&v[i][j+1]);
+        vs = LDF(&v[i][j-1]);
+        uc = LDF(&u[i][j]);
+        un = LDF(&u[i][j+1]);
+        uw = LDF(&u[i-1][j]);
+        unw = LDF(&u[i-1][j+1]);
+
+        s1 = FADD(uc, un);
+        s0 = FADD(uw, unw);
+        t = DADD(TOD(FMUL(s1, FADD(vc, ve))),
+            DMUL(DMUL(gm, DABS(TOD(s1))), TOD(FSUB(vc, ve))));
+        t = DSUB(t, TOD(FMUL(s0, FADD(vw, vc))));
+        t = DSUB(t, DMUL(DMUL(gm, DABS(TOD(s0))), TOD(FSUB(vw, vc))));
+        duvdx = TOF(DDIV(t, four_dx));
+
+        s1 = FADD(vc, vn);
+        s0 = FADD(vs, vc);
+        t = DADD(TOD(FMUL(s1, s1)),
+            DMUL(DMUL(gm, DABS(TOD(s1))), TOD(FSUB(vc, vn))));
+        t = DSUB(t, TOD(FMUL(s0, s0)));
+        t = DSUB(t, DMUL(DMUL(gm, DABS(TOD(s0))), TOD(FSUB(vs, vc))));
+        dv2dy = TOF(DDIV(t, four_dy));
+
+        x = DADD(DSUB(TOD(ve), DMUL(two, TOD(vc))), TOD(vw));
+        y = DADD(DSUB(TOD(vn), DMUL(two, TOD(vc))), TOD(vs));
+        laplv = TOF(DADD(DDIV(DDIV(x, dx), dx), DDIV(DDIV(y, dy), dy)));
+
+        s1 = FADD(vc, FMUL(dt, FSUB(FSUB(FDIV(laplv, re), duvdx), dv2dy)));
+        STF(&g[i][j], BLEND(FLUID(&flag[i][j], &flag[i][j+1]), s1, vc));
+    }
+    g_column_scalar(u, v, g, flag, i, j, j1, del_t, delx, dely, gamma, Re);
+}
+
+static TARGET void CAT(u_column, ISA)(float **u, float **f, preal **p,
+    char **flag, int i, int j0, int j1, float del_t, float delx)
+{
+    int j;
+    FV un;
+#ifdef PREAL_DOUBLE
+    DV dt = D1(del_t), dx = D1(delx);
+#else
+    FV dt = F1(del_t), dx = F1(delx);
+#endif
+
+    for (j = j0; j + W-1 <= j1; j += W) {
+#ifdef PREAL_DOUBLE
+        un = TOF(DSUB(TOD(LDF(&f[i][j])),
+            DDIV(DMUL(DSUB(LDP(&p[i+1][j]), LDP(&p[i][j])), dt), dx)));
+#else
+        un = FSUB(LDF(&f[i][j]),
+            FDIV(FMUL(FSUB(LDF(&p[i+1][j]), LDF(&p[i][j])), dt), dx));
+#endif
+        STF(&u[i][j], BLEND(FLUID(&flag[i][j], &flag[i+1][j]), un,
+            LDF(&u[i][j])));
+    }
+    u_column_scalar(u, f, p, flag, i, j, j1, del_t, delx);
+}
+
+static TARGET void CAT(v_column, ISA)(float **v, float **g, preal **p,
+    char **flag, int i, int j0, int j1, float del_t, float dely)
+{
+    int j;
+    FV vn;
+#ifdef PREAL_DOUBLE
+    DV dt = D1(del_t), dy = D1(dely);
+#else
+    FV dt = F1(del_t), dy = F1(dely);
+#endif
+
+    for (j = j0; j + W-1 <= j1; j += W) {
+#ifdef PREAL_DOUBLE
+        vn = TOF(DSUB(TOD(LDF(&g[i][j])),
+            DDIV(DMUL(DSUB(LDP(&p[i][j+1]), LDP(&p[i][j])), dt), dy)));
+#else
+        vn = FSUB(LDF(&g[i][j]),
+            FDIV(FMUL(FSUB(LDF(&p[i][j+1]), LDF(&p[i][j])), dt), dy));
+#endif
+        STF(&v[i][j], BLEND(FLUID(&flag[i][j], &flag[i][j+1]), vn,
+            LDF(&v[i][j])));
+    }
+    v_column_scalar(v, g, p, flag, i, j, j1, del_t, dely);
+}
+
+#undef CAT
+#undef CAT2
+#undef ISA
+#undef TARGET
+#undef W
+#undef FV
+#undef DV
+#undef LDF
+#undef STF
+#undef LDP
+#undef F1
+#undef FADD
+#undef FSUB
+#undef FMUL
+#undef FDIV
+#undef D1
+#undef DADD
+#undef DSUB
+#undef DMUL
+#undef DDIV
+#undef DABS
+#undef TOD
+#undef TOF
+#undef FLUID
+#undef BLEND
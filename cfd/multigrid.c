@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <mpi.h>
+#include "alloc.h"
+#include "datadef.h"
+#include "halo.h"
+#include "multigrid.h"
+#include "stencil.h"
+#include "timing.h"
+
+#define min(x,y) ((x)<(y)?(x):(y))
+
+extern int ileft, iright, jbottom, jtop;
+extern MPI_Comm cart_comm;
+extern int mg_cycle;
+
+#define MAXLEVELS 16    /* Most grid levels in the hierarchy */
+#define NU1       2     /* Red/black smoothing sweeps before coarsening */
+#define NU2       2     /* Red/black smoothing sweeps after coarsening */
+#define NU_COARSE 4     /* Red/black sweeps on the coarsest level between
+                           residual checks */
+#define MAX_COARSE 4096 /* Most red/black sweeps on the coarsest level */
+#define TOL_COARSE 1e-3 /* Reduction of the residual on the coarsest level */
+#define STALL     0.9   /* Stop once a cycle leaves more than this fraction
+                           of the residual */
+
+/* One level of the multigrid hierarchy. Level 0 is the simulation grid;
+ * each coarser level merges 2x2 cells, so coarse cell (I,J) covers fine
+ * cells 2I-1..2I x 2J-1..2J. A coarse cell belongs to the process that
+ * owns its first fine cell, which keeps the same process grid on every
+ * level.
+ * The obstacles enter the operator through the weights of the cell faces,
+ * which take the place of the eps_E/eps_N macros: 1 if the face is open
+ * on level 0, and on a coarse level the fraction of the fine faces under it
+ * that are open.
+ * The solver runs in the timestep's parallel region: the loops are shared
+ * out among the team, and the master thread does the MPI calls while the
+ * rest wait.
+ */
+struct level {
+    int imax, jmax;             /* Interior cells on this level */
+    int il, ir, jb, jt;         /* Block of this process */
+    preal rdx2, rdy2;
+    preal **x;                  /* Solution (p on level 0, else correction) */
+    preal **b;                  /* Right hand side */
+    preal **r;                  /* Residual */
+    preal **we;                 /* Weight of the face between (i,j), (i+1,j) */
+    preal **wn;                 /* Weight of the face between (i,j), (i,j+1) */
+    char **flag;
+    double nfluid;              /* Fluid cells of all processes */
+};
+
+static struct level levels[MAXLEVELS];
+static int nlevels = 0;
+static struct team_sum partial;     /* Threads' parts of a sum */
+
+
+/* Build the hierarchy below the imax x jmax grid. A coarse cell is fluid
+ * if any of the fine cells it covers is, so narrow channels between
+ * obstacles stay open, while the face weights keep the coarse operator from
+ * leaking through the fine obstacles. Coarsening stops when some process's
+ * block would become less than two cells across.
+ */
+static void setup_levels(char **flag, int imax, int jmax, real delx,
+    real dely)
+{
+    struct level *f, *c;
+    int i, j, l, local, narrowest;
+    double count;
+
+    f = &levels[0];
+    f->imax = imax;
+    f->jmax = jmax;
+    f->il = ileft;
+    f->ir = iright;
+    f->jb = jbottom;
+    f->jt = jtop;
+    f->rdx2 = 1.0/(delx*delx);
+    f->rdy2 = 1.0/(dely*dely);
+    f->flag = flag;
+    f->r = alloc_prealmatrix(imax+2, jmax+2);
+    f->we = alloc_prealmatrix(imax+2, jmax+2);
+    f->wn = alloc_prealmatrix(imax+2, jmax+2);
+    for (i = 0; i <= imax; i++) {
+        for (j = 0; j <= jmax; j++) {
+            f->we[i][j] = (flag[i][j] & flag[i+1][j] & C_F) ? 1.0 : 0.0;
+            f->wn[i][j] = (flag[i][j] & flag[i][j+1] & C_F) ? 1.0 : 0.0;
+        }
+    }
+    nlevels = 1;
+
+    while (nlevels < MAXLEVELS) {
+        f = &levels[nlevels-1];
+        c = &levels[nlevels];
+        c->imax = (f->imax+1)/2;
+        c->jmax = (f->jmax+1)/2;
+        c->il = f->il/2 + 1;
+        c->ir = (f->ir+1)/2;
+        c->jb = f->jb/2 + 1;
+        c->jt = (f->jt+1)/2;
+
+        local = min(c->ir - c->il + 1, c->jt - c->jb + 1);
+        MPI_Allreduce(&local, &narrowest, 1, MPI_INT, MPI_MIN, cart_comm);
+        if (narrowest < 2) {
+            break;
+        }
+
+        c->rdx2 = f->rdx2/4.0;
+        c->rdy2 = f->rdy2/4.0;
+        c->x = alloc_prealmatrix(c->imax+2, c->jmax+2);
+        c->b = alloc_prealmatrix(c->imax+2, c->jmax+2);
+        c->r = alloc_prealmatrix(c->imax+2, c->jmax+2);
+        c->we = alloc_prealmatrix(c->imax+2, c->jmax+2);
+        c->wn = alloc_prealmatrix(c->imax+2, c->jmax+2);
+        c->flag = alloc_charmatrix(c->imax+2, c->jmax+2);
+
+        /* Every process holds the whole flag matrix, so the coarse flags
+         * need no communication.
+         */
+        for (i = 0; i <= c->imax+1; i++) {
+            for (j = 0; j <= c->jmax+1; j++) {
+                c->flag[i][j] = C_B;
+                if (i < 1 || i > c->imax || j < 1 || j > c->jmax) {
+                    continue;
+                }
+                if ((f->flag[2*i-1][2*j-1] | f->flag[2*i][2*j-1] |
+                     f->flag[2*i-1][2*j] | f->flag[2*i][2*j]) & C_F) {
+                    c->flag[i][j] = C_F;
+                }
+            }
+        }
+        /* Faces on the edge of the domain stay closed */
+        for (i = 1; i <= c->imax; i++) {
+            for (j = 1; j <= c->jmax; j++) {
+                if (i < c->imax) {
+                    c->we[i][j] = (f->we[2*i][2*j-1] + f->we[2*i][2*j])/2;
+                }
+                if (j < c->jmax) {
+                    c->wn[i][j] = (f->wn[2*i-1][2*j] + f->wn[2*i][2*j])/2;
+                }
+            }
+        }
+        nlevels++;
+    }
+
+    for (l = 0; l < nlevels; l++) {
+        f = &levels[l];
+        count = 0.0;
+        for (i = f->il; i <= f->ir; i++) {
+            for (j = f->jb; j <= f->jt; j++) {
+                if (f->flag[i][j] & C_F) { count += 1.0; }
+            }
+        }
+        MPI_Allreduce(&count, &f->nfluid, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+    }
+}
+
+
+/* Sum x over the team and all processes. Called by every thread, which
+ * each get the total.
+ */
+static double team_allreduce(double x)
+{
+    static double tot;
+
+    team_add(&partial, x);
+    #pragma omp barrier
+    #pragma omp master
+    {
+        double local = team_total(&partial);
+        timed_allreduce(&local, &tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+    }
+    #pragma omp barrier
+    return tot;
+}
+
+
+/* Red/black Gauss-Seidel sweeps of the obstacle-aware five point star,
+ * leaving the halo of x current.
+ */
+static void smooth(struct level *lv, int sweeps)
+{
+    int s, rb, i;
+    char **flag = lv->flag;
+    preal **x = lv->x, **b = lv->b, **we = lv->we, **wn = lv->wn;
+
+    for (s = 0; s < sweeps; s++) {
+        for (rb = 0; rb <= 1; rb++) {
+            #pragma omp for schedule(static)
+            for (i = lv->il; i <= lv->ir; i++) {
+                int j;
+                preal diag;
+                for (j = lv->jb; j <= lv->jt; j++) {
+                    if ((i+j) % 2 != rb || !(flag[i][j] & C_F)) { continue; }
+                    diag = (we[i][j]+we[i-1][j])*lv->rdx2 +
+                        (wn[i][j]+wn[i][j-1])*lv->rdy2;
+                    if (diag > 0.0) {
+                        x[i][j] = ((we[i][j]*x[i+1][j]+we[i-1][j]*x[i-1][j])*lv->rdx2
+                                 + (wn[i][j]*x[i][j+1]+wn[i][j-1]*x[i][j-1])*lv->rdy2
+                                 - b[i][j]) / diag;
+                    }
+                }
+            }
+            #pragma omp master
+            exchange_halo_block_p(x, lv->il, lv->ir, lv->jb, lv->jt,
+                lv->imax, lv->jmax);
+            #pragma omp barrier
+        }
+    }
+}
+
+
+/* Compute r = b - Ax over the block, returning the calling thread's part
+ * of the sum of squares. The team does not wait for each other at the end.
+ */
+static double residual(struct level *lv)
+{
+    int i;
+    double sum = 0.0;
+    char **flag = lv->flag;
+    preal **x = lv->x, **b = lv->b, **r = lv->r, **we = lv->we, **wn = lv->wn;
+
+    #pragma omp for schedule(static) nowait
+    for (i = lv->il; i <= lv->ir; i++) {
+        int j;
+        preal add;
+        for (j = lv->jb; j <= lv->jt; j++) {
+            if (flag[i][j] & C_F) {
+                add = (we[i][j]*(x[i+1][j]-x[i][j]) -
+                    we[i-1][j]*(x[i][j]-x[i-1][j])) * lv->rdx2  +
+                    (wn[i][j]*(x[i][j+1]-x[i][j]) -
+                    wn[i][j-1]*(x[i][j]-x[i][j-1])) * lv->rdy2  -  b[i][j];
+                r[i][j] = -add;
+                sum += (double) add*add;
+            } else {
+                r[i][j] = 0.0;
+            }
+        }
+    }
+    return sum;
+}
+
+
+/* Restrict the residual into the coarse right hand side: the residual of
+ * the fluid cells under each coarse cell, summed and divided by all four
+ * of them. The coarse operator treats a partly fluid cell as a whole cell
+ * with partly open faces, so dividing by the fluid cells alone would
+ * overweight its right hand side. The fine residual halo must be current.
+ */
+static void restrict_residual(struct level *f, struct level *c)
+{
+    int i;
+    char **flag = f->flag;
+
+    #pragma omp for schedule(static)
+    for (i = c->il; i <= c->ir; i++) {
+        int j, di, dj, n;
+        preal sum;
+        for (j = c->jb; j <= c->jt; j++) {
+            sum = 0.0;
+            n = 0;
+            for (di = 2*i-1; di <= 2*i; di++) {
+                for (dj = 2*j-1; dj <= 2*j; dj++) {
+                    if (flag[di][dj] & C_F) {
+                        sum += f->r[di][dj];
+                        n++;
+                    }
+                }
+            }
+            c->b[i][j] = (n > 0) ? sum/4 : 0.0;
+        }
+    }
+}
+
+
+/* Add the bilinear interpolation of the coarse correction to the fine
+ * solution. Coarse cells that are not fluid are left out and the weights
+ * of the rest renormalised. The coarse halo must be current.
+ */
+static void prolong_correction(struct level *c, struct level *f)
+{
+    int i;
+    char **flag = f->flag, **cflag = c->flag;
+
+    #pragma omp for schedule(static)
+    for (i = f->il; i <= f->ir; i++) {
+        int j, ci, cj, ni, nj;
+        preal sum, wsum;
+        for (j = f->jb; j <= f->jt; j++) {
+            if (!(flag[i][j] & C_F)) { continue; }
+            /* The coarse cell covering (i,j), and its neighbour on the
+             * side nearest to the centre of (i,j)
+             */
+            ci = (i+1)/2;
+            cj = (j+1)/2;
+            ni = (i % 2) ? ci-1 : ci+1;
+            nj = (j % 2) ? cj-1 : cj+1;
+            sum = 0.0;
+            wsum = 0.0;
+            if (cflag[ci][cj] & C_F) { sum += 9*c->x[ci][cj]; wsum += 9; }
+            if (cflag[ni][cj] & C_F) { sum += 3*c->x[ni][cj]; wsum += 3; }
+            if (cflag[ci][nj] & C_F) { sum += 3*c->x[ci][nj]; wsum += 3; }
+            if (cflag[ni][nj] & C_F) { sum += c->x[ni][nj]; wsum += 1; }
+            if (wsum > 0.0) {
+                f->x[i][j] += sum/wsum;
+            }
+        }
+    }
+}
+
+
+/* The pressure equation only has Neumann boundaries, so its solution is
+ * fixed up to a constant, and it only has one if the right hand side sums
+ * to zero over the fluid cells. Take the mean of the fluid cells of the
+ * block out of a, and out of its halo, which stays current. Applied to
+ * the right hand side of every level, so that each is solvable, and to
+ * the coarsest correction, so that the cycles do not make p drift.
+ */
+static void remove_mean(struct level *lv, preal **a)
+{
+    int i, j;
+    double sum = 0.0;
+    preal mean;
+
+    #pragma omp for schedule(static) private(j) nowait
+    for (i = lv->il; i <= lv->ir; i++) {
+        for (j = lv->jb; j <= lv->jt; j++) {
+            if (lv->flag[i][j] & C_F) { sum += a[i][j]; }
+        }
+    }
+    sum = team_allreduce(sum);
+    if (lv->nfluid == 0.0) { return; }
+    mean = sum/lv->nfluid;
+    #pragma omp for schedule(static) private(j)
+    for (i = lv->il-1; i <= lv->ir+1; i++) {
+        for (j = lv->jb-1; j <= lv->jt+1; j++) {
+            if (lv->flag[i][j] & C_F) { a[i][j] -= mean; }
+        }
+    }
+}
+
+
+/* Solve the coarsest level until its residual is TOL_COARSE of the right
+ * hand side, checking every NU_COARSE sweeps.
+ */
+static void solve_coarsest(struct level *lv)
+{
+    int i, j, s;
+    double bb = 0.0, rr;
+
+    #pragma omp for schedule(static) private(j) nowait
+    for (i = lv->il; i <= lv->ir; i++) {
+        for (j = lv->jb; j <= lv->jt; j++) {
+            if (lv->flag[i][j] & C_F) { bb += lv->b[i][j]*lv->b[i][j]; }
+        }
+    }
+    bb = team_allreduce(bb);
+    for (s = 0; s < MAX_COARSE; s += NU_COARSE) {
+        smooth(lv, NU_COARSE);
+        rr = team_allreduce(residual(lv));
+        if (rr <= TOL_COARSE*TOL_COARSE*bb) { break; }
+    }
+    remove_mean(lv, lv->x);
+}
+
+
+/* One multigrid cycle on level l: mg_cycle is 1 for a V-cycle and 2 for
+ * a W-cycle.
+ */
+static void cycle(int l)
+{
+    int i, k;
+    struct level *f = &levels[l], *c = &levels[l+1];
+
+    if (l == nlevels-1) {
+        solve_coarsest(f);
+        return;
+    }
+
+    smooth(f, NU1);
+    residual(f);
+    #pragma omp barrier
+    #pragma omp master
+    exchange_halo_block_p(f->r, f->il, f->ir, f->jb, f->jt, f->imax, f->jmax);
+    #pragma omp barrier
+    restrict_residual(f, c);
+    remove_mean(c, c->b);
+
+    #pragma omp for schedule(static) private(k)
+    for (i = 0; i <= c->imax+1; i++) {
+        for (k = 0; k <= c->jmax+1; k++) {
+            c->x[i][k] = 0.0;
+        }
+    }
+    for (k = 0; k < mg_cycle; k++) {
+        cycle(l+1);
+    }
+
+    prolong_correction(c, f);
+    #pragma omp master
+    exchange_halo_block_p(f->x, f->il, f->ir, f->jb, f->jt, f->imax, f->jmax);
+    #pragma omp barrier
+    smooth(f, NU2);
+}
+
+
+/* Geometric multigrid solver for the poisson equation, a drop-in for
+ * poisson(), which every thread of the team calls. Returns the number of
+ * cycles, with the residual in *res normalised the same way.
+ */
+int multigrid(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, double *res, int ifull)
+{
+    int i, j, iter;
+    double p0 = 0.0, r, last = HUGE_VAL;
+
+    #pragma omp master
+    {
+        if (nlevels == 0) {
+            setup_levels(flag, imax, jmax, delx, dely);
+        }
+        team_sum_setup(&partial);
+        levels[0].x = p;
+        levels[0].b = rhs;
+    }
+    #pragma omp barrier
+
+    /* Calculate sum of squares */
+    #pragma omp for schedule(static) private(j) nowait
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (flag[i][j] & C_F) { p0 += p[i][j]*p[i][j]; }
+        }
+    }
+    p0 = sqrt(team_allreduce(p0)/ifull);
+    if (p0 < 0.0001) { p0 = 1.0; }
+
+    /* As in pcg(), the constant part of rhs cannot be matched by any
+     * pressure, so it is projected out
+     */
+    remove_mean(&levels[0], rhs);
+
+    for (iter = 0; iter < itermax; iter++) {
+        cycle(0);
+
+        r = sqrt(team_allreduce(residual(&levels[0]))/ifull)/p0;
+        #pragma omp master
+        *res = r;
+
+        /* convergence? A cycle that hardly reduces the residual has met
+         * the rounding error of p, which in the float build lies above eps
+         * on fine grids, and more cycles would not get below it.
+         */
+        if (r < eps || r > STALL*last) break;
+        last = r;
+    }
+    return iter;
+}
+
+/* Free the multigrid hierarchy */
+void multigrid_free(void)
+{
+    int l;
+
+    if (nlevels == 0) {
+        return;
+    }
+    for (l = 0; l < nlevels; l++) {
+        free_matrix(levels[l].r);
+        free_matrix(levels[l].we);
+        free_matrix(levels[l].wn);
+        if (l > 0) {
+            free_matrix(levels[l].x);
+            free_matrix(levels[l].b);
+            free_matrix(levels[l].flag);
+        }
+    }
+    nlevels = 0;
+}
@@ -0,0 +1,5 @@
+#include "precision.h"
+
+int multigrid(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, double *res, int ifull);
+void multigrid_free(void);
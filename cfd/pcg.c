@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <mpi.h>
+#include "alloc.h"
+#include "datadef.h"
+#include "halo.h"
+#include "pcg.h"
+#include "timing.h"
+
+extern int ileft, iright, jbottom, jtop;
+extern MPI_Comm cart_comm;
+extern int pcg_precond;
+
+/* The solver works with the negated pressure operator, which is symmetric
+ * positive semi-definite: (Ax)(i,j) = diag*x(i,j) minus the eps-weighted
+ * neighbours, with the same eps_E/eps_W/eps_N/eps_S macros as poisson().
+ */
+static preal **r, **z, **s, **q;    /* Residual, preconditioned residual,
+                                       search direction and A times it */
+static preal **dinv;                /* Inverse pivots of the preconditioner */
+static int setup = 0;
+
+
+/* Compute the inverse pivots for this process's block. For the Jacobi
+ * preconditioner they are the inverse diagonal of A. For the block
+ * incomplete Cholesky preconditioner they are those of the IC(0) factor
+ * of the block, dropping the couplings to the neighbouring blocks so that
+ * every process can apply it on its own.
+ */
+static void setup_precond(char **flag, int imax, int jmax, preal rdx2,
+    preal rdy2)
+{
+    int i, j;
+    preal diag, d;
+
+    r = alloc_prealmatrix(imax+2, jmax+2);
+    z = alloc_prealmatrix(imax+2, jmax+2);
+    s = alloc_prealmatrix(imax+2, jmax+2);
+    q = alloc_prealmatrix(imax+2, jmax+2);
+    dinv = alloc_prealmatrix(imax+2, jmax+2);
+
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (!(flag[i][j] & C_F)) { continue; }
+            diag = (eps_E+eps_W)*rdx2 + (eps_N+eps_S)*rdy2;
+            if (diag <= 0.0) { continue; }
+            d = diag;
+            if (pcg_precond == PRECOND_IC) {
+                if (i > ileft && dinv[i-1][j] > 0.0) {
+                    d -= eps_W*rdx2*eps_W*rdx2*dinv[i-1][j];
+                }
+                if (j > jbottom && dinv[i][j-1] > 0.0) {
+                    d -= eps_S*rdy2*eps_S*rdy2*dinv[i][j-1];
+                }
+                /* The whole domain is singular, so the last pivot can
+                 * vanish; fall back to the diagonal for it.
+                 */
+                if (d < 1e-3*diag) { d = diag; }
+            }
+            dinv[i][j] = 1.0/d;
+        }
+    }
+    setup = 1;
+}
+
+
+/* z = M^-1 r over this process's block */
+static void apply_precond(char **flag, preal rdx2, preal rdy2)
+{
+    int i, j;
+
+    if (pcg_precond == PRECOND_JACOBI) {
+        #pragma omp parallel for schedule(static) private(j)
+        for (i = ileft; i <= iright; i++) {
+            for (j = jbottom; j <= jtop; j++) {
+                z[i][j] = r[i][j]*dinv[i][j];
+            }
+        }
+        return;
+    }
+
+    /* Forward substitution with the lower triangular factor, then back
+     * substitution with its transpose. Both run in the order the pivots
+     * were computed.
+     */
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (dinv[i][j] == 0.0) { z[i][j] = 0.0; continue; }
+            z[i][j] = r[i][j];
+            if (i > ileft) { z[i][j] += eps_W*rdx2*z[i-1][j]; }
+            if (j > jbottom) { z[i][j] += eps_S*rdy2*z[i][j-1]; }
+            z[i][j] *= dinv[i][j];
+        }
+    }
+    for (i = iright; i >= ileft; i--) {
+        for (j = jtop; j >= jbottom; j--) {
+            if (dinv[i][j] == 0.0) { continue; }
+            if (i < iright) { z[i][j] += eps_E*rdx2*z[i+1][j]*dinv[i][j]; }
+            if (j < jtop) { z[i][j] += eps_N*rdy2*z[i][j+1]*dinv[i][j]; }
+        }
+    }
+}
+
+
+/* q = A x over this process's block; the halo of x must be current.
+ * Returns the local part of the dot product of x and q.
+ */
+static double apply_operator(preal **x, preal **q, char **flag, preal rdx2,
+    preal rdy2)
+{
+    int i, j;
+    double dot = 0.0;
+
+    #pragma omp parallel for schedule(static) private(j) reduction(+:dot)
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (flag[i][j] & C_F) {
+                q[i][j] = (eps_E*(x[i][j]-x[i+1][j]) +
+                    eps_W*(x[i][j]-x[i-1][j])) * rdx2  +
+                    (eps_N*(x[i][j]-x[i][j+1]) +
+                    eps_S*(x[i][j]-x[i][j-1])) * rdy2;
+                dot += (double) x[i][j]*q[i][j];
+            } else {
+                q[i][j] = 0.0;
+            }
+        }
+    }
+    return dot;
+}
+
+
+/* Preconditioned conjugate gradient solver for the poisson equation, a
+ * drop-in for poisson(). Dot products are summed in double precision and
+ * reduced over all processes. Returns the number of iterations, with the
+ * residual in *res normalised the same way as poisson() does.
+ */
+int pcg(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, double *res, int ifull)
+{
+    int i, j, iter;
+    preal rdx2 = 1.0/(delx*delx);
+    preal rdy2 = 1.0/(dely*dely);
+    double p0 = 0.0, alpha, beta, rz, rznew, rr;
+    double local[2], tot[2];
+
+    if (!setup) {
+        setup_precond(flag, imax, jmax, rdx2, rdy2);
+    }
+
+    /* Calculate sum of squares */
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (flag[i][j] & C_F) { p0 += p[i][j]*p[i][j]; }
+        }
+    }
+    timed_allreduce(&p0, &tot[0], 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+    p0 = sqrt(tot[0]/ifull);
+    if (p0 < 0.0001) { p0 = 1.0; }
+
+    /* r = -rhs - Ap. The constant part of r cannot be removed by any
+     * pressure, since the boundaries are all Neumann, so it is projected
+     * out to keep the iteration from stalling on it.
+     */
+    exchange_halo_p(p, imax, jmax);
+    apply_operator(p, q, flag, rdx2, rdy2);
+    local[0] = local[1] = 0.0;
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (flag[i][j] & C_F) {
+                r[i][j] = -rhs[i][j] - q[i][j];
+                local[0] += r[i][j];
+                local[1] += 1.0;
+            }
+        }
+    }
+    timed_allreduce(local, tot, 2, MPI_DOUBLE, MPI_SUM, cart_comm);
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (flag[i][j] & C_F) { r[i][j] -= tot[0]/tot[1]; }
+        }
+    }
+
+    apply_precond(flag, rdx2, rdy2);
+    local[0] = local[1] = 0.0;
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            s[i][j] = z[i][j];
+            local[0] += (double) r[i][j]*z[i][j];
+            local[1] += (double) r[i][j]*r[i][j];
+        }
+    }
+    timed_allreduce(local, tot, 2, MPI_DOUBLE, MPI_SUM, cart_comm);
+    rz = tot[0];
+    *res = sqrt(tot[1]/ifull)/p0;
+
+    for (iter = 0; iter < itermax && *res >= eps; iter++) {
+        exchange_halo_p(s, imax, jmax);
+        local[0] = apply_operator(s, q, flag, rdx2, rdy2);
+        timed_allreduce(local, tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+        if (tot[0] <= 0.0) { break; }
+        alpha = rz/tot[0];
+
+        #pragma omp parallel for schedule(static) private(j)
+        for (i = ileft; i <= iright; i++) {
+            for (j = jbottom; j <= jtop; j++) {
+                p[i][j] += alpha*s[i][j];
+                r[i][j] -= alpha*q[i][j];
+            }
+        }
+
+        apply_precond(flag, rdx2, rdy2);
+        rznew = rr = 0.0;
+        #pragma omp parallel for schedule(static) private(j) \
+            reduction(+:rznew,rr)
+        for (i = ileft; i <= iright; i++) {
+            for (j = jbottom; j <= jtop; j++) {
+                rznew += (double) r[i][j]*z[i][j];
+                rr += (double) r[i][j]*r[i][j];
+            }
+        }
+        local[0] = rznew;
+        local[1] = rr;
+        timed_allreduce(local, tot, 2, MPI_DOUBLE, MPI_SUM, cart_comm);
+        *res = sqrt(tot[1]/ifull)/p0;
+
+        beta = tot[0]/rz;
+        rz = tot[0];
+        #pragma omp parallel for schedule(static) private(j)
+        for (i = ileft; i <= iright; i++) {
+            for (j = jbottom; j <= jtop; j++) {
+                s[i][j] = z[i][j] + beta*s[i][j];
+            }
+        }
+    }
+
+    /* update_velocity() needs the pressure of the neighbouring cells */
+    exchange_halo_p(p, imax, jmax);
+    return iter;
+}
+
+/* Free the solver's work arrays */
+void pcg_free(void)
+{
+    if (!setup) {
+        return;
+    }
+    free_matrix(r);
+    free_matrix(z);
+    free_matrix(s);
+    free_matrix(q);
+    free_matrix(dinv);
+    setup = 0;
+}
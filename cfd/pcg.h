@@ -0,0 +1,9 @@
+#include "precision.h"
+
+/* Preconditioners for pcg() */
+#define PRECOND_JACOBI 0
+#define PRECOND_IC     1
+
+int pcg(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, double *res, int ifull);
+void pcg_free(void);
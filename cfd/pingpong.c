@@ -1,12 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <mpi.h>
 
 #define PING 1
 #define PONG 2
 
+/* Ways of moving a message between the two processes of a pair. Besides
+ * the ping-pong of blocking sends, the others are exchanges: both
+ * processes send and receive a message at once, as in a halo exchange.
+ * The strided ones send every other float of a column twice the message's
+ * length, as the red/black SOR halo exchange does, either with a vector
+ * datatype or by packing the floats into a buffer by hand.
+ */
+#define MODE_PINGPONG 0             /* Blocking MPI_Send and MPI_Recv */
+#define MODE_ISEND    1             /* MPI_Irecv, MPI_Isend and MPI_Waitall */
+#define MODE_SENDRECV 2             /* MPI_Sendrecv */
+#define MODE_VECTOR   3             /* MPI_Sendrecv of an MPI_Type_vector */
+#define MODE_PACK     4             /* Packed by hand, then MPI_Sendrecv */
+#define NMODES        5
+
+static const char *mode_names[NMODES] = {
+    "pingpong", "isend", "sendrecv", "vector", "pack"
+};
+
+#define MAXSIZE  (1 << 28)          /* Largest message */
+#define MAXBYTES (1 << 30)          /* Most to send each way at one size */
+
 static void print_usage(void);
 static void print_version(void);
 static void print_help(void);
@@ -23,20 +45,106 @@ static struct option long_opts[] = {
     { "minsize", 1, NULL, 'm' },
     { "maxsize", 1, NULL, 'n' },
     { "count",   1, NULL, 'c' },
+    { "mode",    1, NULL, 'M' },
+    { "spread",  0, NULL, 's' },
     { 0,         0, 0,    0   }
 };
 
-#define GETOPTS "c:hm:n:V"
+#define GETOPTS "c:hm:M:n:sV"
+
+static char *sendbuf, *recvbuf;     /* Messages, or strided columns of */
+static float *packbuf, *unpackbuf;  /* floats and their packed floats */
+
+/* A size in bytes, with an optional k or m for KiB or MiB. Returns 0 if
+ * it isn't one.
+ */
+static int parse_size(const char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if (*end == 'k' || *end == 'K') {
+        n *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        n *= 1024 * 1024;
+        end++;
+    }
+    return (*end == '\0' && n >= 1 && n <= MAXSIZE) ? n : 0;
+}
+
+/* Run iters of mode with partner, moving messages of size bytes; ping is
+ * non-zero for the process of the pair that sends first.
+ */
+static void run_mode(int mode, int size, int iters, int partner, int ping)
+{
+    int i, k, nf = size / sizeof(float);
+    float *s = (float *) sendbuf, *r = (float *) recvbuf;
+    MPI_Request req[2];
+    MPI_Datatype column;
+
+    if (mode == MODE_VECTOR) {
+        MPI_Type_vector(nf, 1, 2, MPI_FLOAT, &column);
+        MPI_Type_commit(&column);
+    }
+
+    for (i = 0; i < iters; i++) {
+        switch (mode) {
+            case MODE_PINGPONG:
+                if (ping) {
+                    MPI_Send(sendbuf, size, MPI_CHAR, partner, PING,
+                        MPI_COMM_WORLD);
+                    MPI_Recv(recvbuf, size, MPI_CHAR, partner, PONG,
+                        MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                } else {
+                    MPI_Recv(recvbuf, size, MPI_CHAR, partner, PING,
+                        MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    MPI_Send(sendbuf, size, MPI_CHAR, partner, PONG,
+                        MPI_COMM_WORLD);
+                }
+                break;
+            case MODE_ISEND:
+                MPI_Irecv(recvbuf, size, MPI_CHAR, partner, PING,
+                    MPI_COMM_WORLD, &req[0]);
+                MPI_Isend(sendbuf, size, MPI_CHAR, partner, PING,
+                    MPI_COMM_WORLD, &req[1]);
+                MPI_Waitall(2, req, MPI_STATUSES_IGNORE);
+                break;
+            case MODE_SENDRECV:
+                MPI_Sendrecv(sendbuf, size, MPI_CHAR, partner, PING,
+                    recvbuf, size, MPI_CHAR, partner, PING, MPI_COMM_WORLD,
+                    MPI_STATUS_IGNORE);
+                break;
+            case MODE_VECTOR:
+                MPI_Sendrecv(s, 1, column, partner, PING, r, 1, column,
+                    partner, PING, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                break;
+            case MODE_PACK:
+                for (k = 0; k < nf; k++) { packbuf[k] = s[2*k]; }
+                MPI_Sendrecv(packbuf, nf, MPI_FLOAT, partner, PING,
+                    unpackbuf, nf, MPI_FLOAT, partner, PING, MPI_COMM_WORLD,
+                    MPI_STATUS_IGNORE);
+                for (k = 0; k < nf; k++) { r[2*k] = unpackbuf[k]; }
+                break;
+        }
+    }
+
+    if (mode == MODE_VECTOR) {
+        MPI_Type_free(&column);
+    }
+}
 
 int main(int argc, char **argv)
 {
-    int i, n, p, size;
-    int iters = 1000, minsize = 1, maxsize = 32768;
+    int i, m, n, p, size, partner, npairs;
+    int iters = 1000, minsize = 1, maxsize = 4 * 1024 * 1024;
+    int want[NMODES], spread = 0, count, bytes;
     int show_help = 0, show_usage = 0, show_version = 0;
-    double start;
+    char *name;
+    double start, t, tmax, lat;
 
     progname = argv[0];
-
+    for (m = 0; m < NMODES; m++) { want[m] = 1; }
 
     int optc;
     while ((optc = getopt_long(argc, argv, GETOPTS, long_opts, NULL)) != -1) {
@@ -48,23 +156,40 @@ int main(int argc, char **argv)
                 show_version = 1;
                 break;
             case 'm':
-                minsize = atoi(optarg);
-                if (minsize < 1 || minsize > 65536) {
+                if ((minsize = parse_size(optarg)) == 0) {
                     show_usage = 1;
                 }
                 break;
             case 'n':
-                maxsize = atoi(optarg);
-                if (maxsize < 1 || maxsize > 65536) {
+                if ((maxsize = parse_size(optarg)) == 0) {
                     show_usage = 1;
                 }
                 break;
             case 'c':
-                printf("iters: %d\n", iters);
+                iters = atoi(optarg);
                 if (iters < 1) {
                     show_usage = 1;
                 }
                 break;
+            case 'M':
+                for (m = 0; m < NMODES; m++) { want[m] = 0; }
+                for (name = strtok(optarg, ","); name;
+                    name = strtok(NULL, ",")) {
+                    for (m = 0; m < NMODES; m++) {
+                        if (strcasecmp(name, mode_names[m]) == 0) { break; }
+                    }
+                    if (m == NMODES) {
+                        fprintf(stderr, "%s: Invalid mode '%s'\n", progname,
+                            name);
+                        show_usage = 1;
+                    } else {
+                        want[m] = 1;
+                    }
+                }
+                break;
+            case 's':
+                spread = 1;
+                break;
             default:
                 show_usage = 1;
         }
@@ -92,37 +217,82 @@ int main(int argc, char **argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &p);
 
 
-    if (n != 2) {
-        fprintf(stderr, "%s must be run on exactly 2 processors.\n", progname);
+    if (n < 2 || n % 2 != 0) {
+        if (p == 0) {
+            fprintf(stderr, "%s must be run on an even number of "
+                "processors.\n", progname);
+        }
         MPI_Finalize();
         return 1;
     }
 
-    char *dummy;
-    dummy = malloc(maxsize);
-    for (size = minsize; size <= maxsize; size *= 2) {
-        start = MPI_Wtime();
-        for (i = 0; i < iters; i++) {
-            MPI_Status s;
-            /* ping... */
-            if (p == 0) {
-                MPI_Send(dummy, size, MPI_CHAR, 1, PING, MPI_COMM_WORLD);
-            } else {
-                MPI_Recv(dummy, size, MPI_CHAR, 0, PING, MPI_COMM_WORLD, &s);
+    /* Every pair runs at once. Pairs are neighbouring ranks, or with
+     * --spread ranks half way round, which with the processes placed by
+     * node are on different nodes.
+     */
+    npairs = n / 2;
+    partner = spread ? (p + npairs) % n : (p ^ 1);
+
+    /* The strided modes need twice the room */
+    sendbuf = malloc(2 * (size_t) maxsize);
+    recvbuf = malloc(2 * (size_t) maxsize);
+    packbuf = malloc(maxsize);
+    unpackbuf = malloc(maxsize);
+    if (!sendbuf || !recvbuf || !packbuf || !unpackbuf) {
+        fprintf(stderr, "%s: Couldn't allocate the buffers.\n", progname);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    memset(sendbuf, 1, 2 * (size_t) maxsize);
+    memset(recvbuf, 0, 2 * (size_t) maxsize);
+
+    if (p == 0) {
+        printf("%d pair%s of processes\n", npairs, (npairs == 1) ? "" : "s");
+        printf("%-9s %10s %7s %12s %12s %12s\n", "mode", "bytes", "iters",
+            "latency(us)", "MB/s/pair", "MB/s");
+    }
+
+    for (m = 0; m < NMODES; m++) {
+        if (!want[m]) { continue; }
+        for (size = minsize; size <= maxsize; size *= 2) {
+            /* The strided modes send whole floats */
+            bytes = size;
+            if (m == MODE_VECTOR || m == MODE_PACK) {
+                if (size < sizeof(float)) { continue; }
+                bytes = size / sizeof(float) * sizeof(float);
             }
 
-            /* pong... */
-            if (p == 1) {
-                MPI_Send(dummy, size, MPI_CHAR, 0, PONG, MPI_COMM_WORLD);
-            } else {
-                MPI_Recv(dummy, size, MPI_CHAR, 1, PONG, MPI_COMM_WORLD, &s);
+            /* Fewer iterations for the large messages, moving no more than
+             * about a GiB each way
+             */
+            count = iters;
+            if ((double) count * bytes > MAXBYTES) {
+                count = (MAXBYTES / bytes > 10) ? MAXBYTES / bytes : 10;
+            }
+
+            run_mode(m, bytes, (count+9) / 10, partner, p < partner);
+            MPI_Barrier(MPI_COMM_WORLD);
+            start = MPI_Wtime();
+            run_mode(m, bytes, count, partner, p < partner);
+            t = MPI_Wtime() - start;
+            MPI_Reduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+            /* Latency is one way for the ping-pong, and of the whole
+             * exchange for the others, in which the message goes both ways
+             */
+            if (p == 0) {
+                lat = tmax / count / ((m == MODE_PINGPONG) ? 2 : 1);
+                i = (m == MODE_PINGPONG) ? 1 : 2;
+                printf("%-9s %10d %7d %12.3f %12.2f %12.2f\n", mode_names[m],
+                    bytes, count, lat * 1e6, (double) i * bytes / lat / 1e6,
+                    (double) npairs * i * bytes / lat / 1e6);
             }
-        }
-        if (p == 0) {
-            printf("%d %d byte pingpongs took %f seconds.\n", iters,
-                size, MPI_Wtime() - start);
         }
     }
+
+    free(sendbuf);
+    free(recvbuf);
+    free(packbuf);
+    free(unpackbuf);
     MPI_Finalize();
     return 0;
 }
@@ -142,9 +312,26 @@ static void print_help(void)
     fprintf(stderr, "%s. A utility for benchmarking MPI communications.\n\n",
         PACKAGE);
     fprintf(stderr, "Usage %s [OPTIONS]\n\n", progname);
+    fprintf(stderr, "Run on an even number of processes, in pairs that all communicate\n");
+    fprintf(stderr, "at once. For each message size, from the minimum doubling up to the\n");
+    fprintf(stderr, "maximum, the latency and bandwidth of each pair and the total\n");
+    fprintf(stderr, "bandwidth are printed.\n\n");
     fprintf(stderr, "  -h, --help           Print a summary of the options\n");
     fprintf(stderr, "  -V, --version        Print the version number\n");
-    fprintf(stderr, "  -m, --minsize        The minimum packet size. Must be 1-65536\n");
-    fprintf(stderr, "  -n, --maxsize        The maximum packet size. Must be 1-65536\n");
-    fprintf(stderr, "  -c, --count          The number of pings to send for a given size\n");
+    fprintf(stderr, "  -m, --minsize=SIZE   The minimum message size in bytes, or KiB or\n");
+    fprintf(stderr, "                       MiB if it ends in 'k' or 'm' (default is 1)\n");
+    fprintf(stderr, "  -n, --maxsize=SIZE   The maximum message size (default is 4m)\n");
+    fprintf(stderr, "  -c, --count=N        The number of messages to send for a given size\n");
+    fprintf(stderr, "                       (default is 1000, fewer for large messages)\n");
+    fprintf(stderr, "  -M, --mode=LIST      Run the comma separated LIST of modes (default\n");
+    fprintf(stderr, "                       is all of them):\n");
+    fprintf(stderr, "                       'pingpong'  blocking sends, one way at a time\n");
+    fprintf(stderr, "                       'isend'     an exchange with MPI_Isend/MPI_Irecv\n");
+    fprintf(stderr, "                       'sendrecv'  an exchange with MPI_Sendrecv\n");
+    fprintf(stderr, "                       'vector'    an exchange of every other float of a\n");
+    fprintf(stderr, "                                   column, as in the SOR halo exchange,\n");
+    fprintf(stderr, "                                   with a vector datatype\n");
+    fprintf(stderr, "                       'pack'      the same, packed into a buffer by hand\n");
+    fprintf(stderr, "  -s, --spread         Pair each process with the one half way round\n");
+    fprintf(stderr, "                       rather than its neighbour\n");
 }
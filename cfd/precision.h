@@ -0,0 +1,41 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+/* Floating point types, chosen at build time (see the Makefile): real for
+ * the velocities and the momentum equations, and preal for the pressure,
+ * the right hand side and the pressure solvers. With PRECISION_DOUBLE both
+ * are double, with PRECISION_MIXED only preal is, and by default both are
+ * float. Sums over the grid are accumulated in double in every build, and
+ * the state files hold the fields in the types of the build that wrote
+ * them.
+ */
+#if defined(PRECISION_DOUBLE)
+typedef double real;
+typedef double preal;
+#define REAL_DOUBLE
+#define PREAL_DOUBLE
+#define PRECISION_NAME "double"
+#elif defined(PRECISION_MIXED)
+typedef float real;
+typedef double preal;
+#define PREAL_DOUBLE
+#define PRECISION_NAME "mixed"
+#else
+typedef float real;
+typedef float preal;
+#define PRECISION_NAME "float"
+#endif
+
+/* The matching MPI datatypes */
+#ifdef REAL_DOUBLE
+#define REAL_MPI  MPI_DOUBLE
+#else
+#define REAL_MPI  MPI_FLOAT
+#endif
+#ifdef PREAL_DOUBLE
+#define PREAL_MPI MPI_DOUBLE
+#else
+#define PREAL_MPI MPI_FLOAT
+#endif
+
+#endif
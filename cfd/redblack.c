@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+#include "alloc.h"
+#include "datadef.h"
+#include "redblack.h"
+#include "stencil.h"
+
+extern int ileft, iright, jbottom, jtop;
+extern MPI_Comm cart_comm;
+extern int nbr_west, nbr_east, nbr_south, nbr_north;
+
+#define CHUNK 64        /* Cells whose squared residuals are buffered */
+
+/* Split red/black layout for the SOR solver. Cell (i,j) has colour
+ * (i+j)%2 and is stored at [i][j/2] of the arrays of its colour, so each
+ * column of a colour is contiguous and its north and south neighbours are
+ * adjacent entries in the same column of the other colour.
+ */
+static preal **pc[2], **rc[2];      /* p and rhs, one array per colour */
+static char **fc[2];                /* flag, one array per colour */
+static int ncol;                    /* Length of a column of one colour */
+static MPI_Datatype rowtype[2];     /* Every other cell of a block row */
+
+
+/* First and last index of the column of colour rb at i which lie in
+ * rows j0..j1
+ */
+static void colour_range(int i, int rb, int j0, int j1, int *k0, int *k1)
+{
+    int s = (i + rb) % 2;           /* Row parity of the colour here */
+
+    *k0 = (j0 - s + 1) / 2;
+    *k1 = (j1 - s) / 2;
+}
+
+/* Allocate the split arrays for an imax x jmax grid and split the flag
+ * matrix, which does not change during the simulation.
+ */
+void rb_setup(char **flag, int imax, int jmax)
+{
+    int i, j, rb, w = iright - ileft + 1;
+
+    ncol = (jmax + 3) / 2;
+    for (rb = 0; rb <= 1; rb++) {
+        pc[rb] = alloc_prealmatrix(imax+2, ncol);
+        rc[rb] = alloc_prealmatrix(imax+2, ncol);
+        fc[rb] = alloc_charmatrix(imax+2, ncol);
+        first_touch(pc[rb], ileft, iright, ncol, sizeof(preal));
+        first_touch(rc[rb], ileft, iright, ncol, sizeof(preal));
+        first_touch(fc[rb], ileft, iright, ncol, sizeof(char));
+    }
+    for (i = 0; i <= imax+1; i++) {
+        for (j = 0; j <= jmax+1; j++) {
+            fc[(i+j)%2][i][j/2] = flag[i][j];
+        }
+    }
+    /* Row cells of one colour are two columns apart. A row of odd length
+     * holds one more cell of the colour that starts it.
+     */
+    MPI_Type_vector((w+1)/2, 1, 2*ncol, PREAL_MPI, &rowtype[0]);
+    MPI_Type_vector(w/2, 1, 2*ncol, PREAL_MPI, &rowtype[1]);
+    MPI_Type_commit(&rowtype[0]);
+    MPI_Type_commit(&rowtype[1]);
+}
+
+/* Copy this process's block of p and rhs, with its halo, into the split
+ * arrays
+ */
+void rb_pack(preal **p, preal **rhs)
+{
+    int i, j;
+
+    #pragma omp for schedule(static) private(j)
+    for (i = ileft-1; i <= iright+1; i++) {
+        for (j = jbottom-1; j <= jtop+1; j++) {
+            pc[(i+j)%2][i][j/2] = p[i][j];
+            rc[(i+j)%2][i][j/2] = rhs[i][j];
+        }
+    }
+}
+
+/* Copy the split pressure back into this process's block of p */
+void rb_unpack(preal **p)
+{
+    int i, j;
+
+    #pragma omp for schedule(static) private(j)
+    for (i = ileft-1; i <= iright+1; i++) {
+        for (j = jbottom-1; j <= jtop+1; j++) {
+            p[i][j] = pc[(i+j)%2][i][j/2];
+        }
+    }
+}
+
+/* One SOR half-sweep of colour rb over the cells i0..i1 x j0..j1. The
+ * inner loop runs over consecutive cells of one colour, without branches.
+ * If ressum is not NULL the squares of the residuals of the cells before
+ * they are updated are added to it in double, as stencil_sweep() does,
+ * through a buffer of CHUNK cells so that the inner loop still vectorises.
+ * The team shares out the columns and does not wait at the end.
+ */
+void rb_sweep(int rb, int i0, int i1, int j0, int j1, preal omega,
+    preal rdx2, preal rdy2, preal beta_2, struct team_sum *ressum)
+{
+    int i;
+    double sum = 0.0;
+
+    #pragma omp for schedule(static) nowait
+    for (i = i0; i <= i1; i++) {
+        int k, k0, k1, s = (i + rb) % 2;
+        preal *x = pc[rb][i], *b = rc[rb][i], *xc = pc[1-rb][i];
+        preal *xe = pc[1-rb][i+1], *xw = pc[1-rb][i-1];
+        char *f = fc[rb][i], *fcol = fc[1-rb][i];
+        char *fe = fc[1-rb][i+1], *fw = fc[1-rb][i-1];
+        preal ee, ew, en, es, diag, beta_mod, nbrs, upd, add, sq[CHUNK];
+        int c, kc, kn;
+
+        colour_range(i, rb, j0, j1, &k0, &k1);
+        for (kc = k0; kc <= k1; kc += CHUNK) {
+            kn = (k1 - kc + 1 < CHUNK) ? k1 + 1 : kc + CHUNK;
+            #pragma omp simd
+            for (k = kc; k < kn; k++) {
+                ee = (fe[k] & C_F) ? 1 : 0;
+                ew = (fw[k] & C_F) ? 1 : 0;
+                en = (fcol[k+s] & C_F) ? 1 : 0;
+                es = (fcol[k+s-1] & C_F) ? 1 : 0;
+                diag = (ee+ew)*rdx2+(en+es)*rdy2;
+                beta_mod = -omega/diag;
+                beta_mod = (f[k] == (C_F | B_NSEW)) ? beta_2 : beta_mod;
+                nbrs = (ee*xe[k]+ew*xw[k])*rdx2
+                    + (en*xc[k+s]+es*xc[k+s-1])*rdy2
+                    - b[k];
+                add = (f[k] & C_F) ? nbrs - diag*x[k] : 0;
+                upd = (1.-omega)*x[k] - beta_mod*nbrs;
+                x[k] = (f[k] & C_F) ? upd : x[k];
+                sq[k-kc] = add*add;
+            }
+            if (!ressum) { continue; }
+            #pragma omp simd reduction(+:sum)
+            for (c = 0; c < kn - kc; c++) {
+                sum += sq[c];
+            }
+        }
+    }
+    if (ressum) { team_add(ressum, sum); }
+}
+
+/* Start sending the cells of colour rb along the edges of this process's
+ * block to the neighbouring blocks, and receiving theirs into the halo.
+ * Block columns of one colour are contiguous. The exchange is complete
+ * once all 8 requests in req have been waited on.
+ */
+void rb_start_exchange(int rb, MPI_Request *req)
+{
+    int k0, k1, kw0, kw1, ke0, ke1;
+    int rn = (ileft + jtop + rb) % 2;       /* First row cell of colour rb */
+    int rs = (ileft + jbottom + rb) % 2;
+
+    colour_range(ileft-1, rb, jbottom, jtop, &kw0, &kw1);
+    colour_range(iright+1, rb, jbottom, jtop, &ke0, &ke1);
+    MPI_Irecv(&pc[rb][ileft-1][kw0], kw1-kw0+1, PREAL_MPI, nbr_west, 0,
+        cart_comm, &req[0]);
+    MPI_Irecv(&pc[rb][iright+1][ke0], ke1-ke0+1, PREAL_MPI, nbr_east, 1,
+        cart_comm, &req[1]);
+    /* The halo beyond a row starts with the opposite colour */
+    MPI_Irecv(&pc[rb][ileft+1-rs][(jbottom-1)/2], 1, rowtype[1-rs],
+        nbr_south, 2, cart_comm, &req[2]);
+    MPI_Irecv(&pc[rb][ileft+1-rn][(jtop+1)/2], 1, rowtype[1-rn], nbr_north,
+        3, cart_comm, &req[3]);
+
+    colour_range(iright, rb, jbottom, jtop, &k0, &k1);
+    MPI_Isend(&pc[rb][iright][k0], k1-k0+1, PREAL_MPI, nbr_east, 0,
+        cart_comm, &req[4]);
+    colour_range(ileft, rb, jbottom, jtop, &k0, &k1);
+    MPI_Isend(&pc[rb][ileft][k0], k1-k0+1, PREAL_MPI, nbr_west, 1,
+        cart_comm, &req[5]);
+    MPI_Isend(&pc[rb][ileft+rn][jtop/2], 1, rowtype[rn], nbr_north, 2,
+        cart_comm, &req[6]);
+    MPI_Isend(&pc[rb][ileft+rs][jbottom/2], 1, rowtype[rs], nbr_south, 3,
+        cart_comm, &req[7]);
+}
+
+/* Free the split arrays */
+void rb_free(void)
+{
+    int rb;
+
+    for (rb = 0; rb <= 1; rb++) {
+        free_matrix(pc[rb]);
+        free_matrix(rc[rb]);
+        free_matrix(fc[rb]);
+        MPI_Type_free(&rowtype[rb]);
+    }
+}
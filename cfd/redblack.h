@@ -0,0 +1,12 @@
+#include <mpi.h>
+#include "precision.h"
+
+struct team_sum;                    /* See stencil.h */
+
+void rb_setup(char **flag, int imax, int jmax);
+void rb_pack(preal **p, preal **rhs);
+void rb_unpack(preal **p);
+void rb_sweep(int rb, int i0, int i1, int j0, int j1, preal omega,
+    preal rdx2, preal rdy2, preal beta_2, struct team_sum *ressum);
+void rb_start_exchange(int rb, MPI_Request *req);
+void rb_free(void);
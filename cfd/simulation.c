@@ -2,96 +2,84 @@
 #include <stdlib.h>
 #include <math.h>
 #include "datadef.h"
+#include "precision.h"
 #include "init.h"
+#include "kernels.h"
 //include mpi and openmp
 #include <mpi.h>
 #include <omp.h>
+#include "redblack.h"
+#include "stencil.h"
+#include "tiled.h"
+#include "timing.h"
 #define max(x,y) ((x)>(y)?(x):(y))
 #define min(x,y) ((x)<(y)?(x):(y))
 //remove the fact these were floats (no need)
-extern int ileft, iright;
+extern int ileft, iright, jbottom, jtop;
 extern int nprocs, proc;
-//define float tot
-float tot;
-
+extern MPI_Comm cart_comm;
+extern int nbr_west, nbr_east, nbr_south, nbr_north;
+extern int sor_overlap;
+extern int sor_split;
+extern int sor_check;
+
+/* The kernels below can be called by every thread of a parallel region,
+ * which then share out their loops (orphaned omp for constructs), as well
+ * as from outside one. They return once the whole team has finished, and
+ * only the master thread makes MPI calls, so MPI_THREAD_FUNNELED is
+ * enough. State that the team shares lives in static variables.
+ */
+static real team_max[2];            /* Velocity maxima of the team */
 
 /* Computation of tentative velocity field (f, g) */
-void compute_tentative_velocity(float **u, float **v, float **f, float **g,
-    char **flag, int imax, int jmax, float del_t, float delx, float dely,
-    float gamma, float Re)
+void compute_tentative_velocity(real **u, real **v, real **f, real **g,
+    char **flag, int imax, int jmax, real del_t, real delx, real dely,
+    real gamma, real Re)
 {
     int  i, j;
-    float du2dx, duvdy, duvdx, dv2dy, laplu, laplv;
-
-    for (i=1; i<=imax-1; i++) {
-        for (j=1; j<=jmax; j++) {
-            /* only if both adjacent cells are fluid cells */
-            if ((flag[i][j] & C_F) && (flag[i+1][j] & C_F)) {
-                du2dx = ((u[i][j]+u[i+1][j])*(u[i][j]+u[i+1][j])+
-                    gamma*fabs(u[i][j]+u[i+1][j])*(u[i][j]-u[i+1][j])-
-                    (u[i-1][j]+u[i][j])*(u[i-1][j]+u[i][j])-
-                    gamma*fabs(u[i-1][j]+u[i][j])*(u[i-1][j]-u[i][j]))
-                    /(4.0*delx);
-                duvdy = ((v[i][j]+v[i+1][j])*(u[i][j]+u[i][j+1])+
-                    gamma*fabs(v[i][j]+v[i+1][j])*(u[i][j]-u[i][j+1])-
-                    (v[i][j-1]+v[i+1][j-1])*(u[i][j-1]+u[i][j])-
-                    gamma*fabs(v[i][j-1]+v[i+1][j-1])*(u[i][j-1]-u[i][j]))
-                    /(4.0*dely);
-                laplu = (u[i+1][j]-2.0*u[i][j]+u[i-1][j])/delx/delx+
-                    (u[i][j+1]-2.0*u[i][j]+u[i][j-1])/dely/dely;
-
-                f[i][j] = u[i][j]+del_t*(laplu/Re-du2dx-duvdy);
-            } else {
-                f[i][j] = u[i][j];
-            }
-        }
+
+    /* Only this process's block is computed; the u and v halos, including
+     * the corner cells, must be current. The column kernels are the
+     * scalar or SIMD ones picked by select_kernels().
+     */
+    #pragma omp for schedule(static) nowait
+    for (i=max(1, ileft); i<=min(imax-1, iright); i++) {
+        f_column(u, v, f, flag, i, jbottom, jtop, del_t, delx, dely,
+            gamma, Re);
     }
 
-    for (i=1; i<=imax; i++) {
-        for (j=1; j<=jmax-1; j++) {
-            /* only if both adjacent cells are fluid cells */
-            if ((flag[i][j] & C_F) && (flag[i][j+1] & C_F)) {
-                duvdx = ((u[i][j]+u[i][j+1])*(v[i][j]+v[i+1][j])+
-                    gamma*fabs(u[i][j]+u[i][j+1])*(v[i][j]-v[i+1][j])-
-                    (u[i-1][j]+u[i-1][j+1])*(v[i-1][j]+v[i][j])-
-                    gamma*fabs(u[i-1][j]+u[i-1][j+1])*(v[i-1][j]-v[i][j]))
-                    /(4.0*delx);
-                dv2dy = ((v[i][j]+v[i][j+1])*(v[i][j]+v[i][j+1])+
-                    gamma*fabs(v[i][j]+v[i][j+1])*(v[i][j]-v[i][j+1])-
-                    (v[i][j-1]+v[i][j])*(v[i][j-1]+v[i][j])-
-                    gamma*fabs(v[i][j-1]+v[i][j])*(v[i][j-1]-v[i][j]))
-                    /(4.0*dely);
-
-                laplv = (v[i+1][j]-2.0*v[i][j]+v[i-1][j])/delx/delx+
-                    (v[i][j+1]-2.0*v[i][j]+v[i][j-1])/dely/dely;
-
-                g[i][j] = v[i][j]+del_t*(laplv/Re-duvdx-dv2dy);
-            } else {
-                g[i][j] = v[i][j];
-            }
-        }
+    #pragma omp for schedule(static) nowait
+    for (i=ileft; i<=iright; i++) {
+        g_column(u, v, g, flag, i, jbottom, min(jmax-1, jtop), del_t, delx,
+            dely, gamma, Re);
     }
 
     /* f & g at external boundaries */
-    for (j=1; j<=jmax; j++) {
-        f[0][j]    = u[0][j];
-        f[imax][j] = u[imax][j];
+    #pragma omp for schedule(static) nowait
+    for (j=jbottom; j<=jtop; j++) {
+        if (ileft == 1)     { f[0][j]    = u[0][j]; }
+        if (iright == imax) { f[imax][j] = u[imax][j]; }
     }
-    for (i=1; i<=imax; i++) {
-        g[i][0]    = v[i][0];
-        g[i][jmax] = v[i][jmax];
+    #pragma omp for schedule(static)
+    for (i=ileft; i<=iright; i++) {
+        if (jbottom == 1) { g[i][0]    = v[i][0]; }
+        if (jtop == jmax) { g[i][jmax] = v[i][jmax]; }
     }
 }
 
 
 /* Calculate the right hand side of the pressure equation */
-void compute_rhs(float **f, float **g, float **rhs, char **flag, int imax,
-    int jmax, float del_t, float delx, float dely)
+void compute_rhs(real **f, real **g, preal **rhs, char **flag, int imax,
+    int jmax, real del_t, real delx, real dely)
 {
     int i, j;
 
-    for (i=1;i<=imax;i++) {
-        for (j=1;j<=jmax;j++) {
+    /* Uses f[ileft-1] and g[i][jbottom-1], so the f and g halos must be
+     * exchanged beforehand.
+     */
+    #pragma omp for schedule(static) private(j)
+    for (i=ileft;i<=iright;i++) {
+        for (j=jbottom;j<=jtop;j++) {
             if (flag[i][j] & C_F) {
                 /* only for fluid and non-surface cells */
                 rhs[i][j] = (
@@ -104,119 +92,283 @@ void compute_rhs(float **f, float **g, float **rhs, char **flag, int imax,
 }
 
 
-/* Red/Black SOR to solve the poisson equation */
-int poisson(float **p, float **rhs, char **flag, int imax, int jmax,
-    float delx, float dely, float eps, int itermax, float omega,
-    float *res, int ifull, double startt, double endt){
+/* Offset from start to the first cell of colour rb in the row or column
+ * of the block at index k
+ */
+static int colour_offset(int k, int start, int rb)
+{
+    return (k + start + rb) % 2;
+}
 
+/* Start sending the cells of colour rb along the edges of this process's
+ * block to the neighbouring blocks, and receiving theirs into the halo.
+ * coltype[k] and rowtype[k] pick every other cell of a block column or row,
+ * starting k cells in from jbottom or ileft. The exchange is complete once
+ * all 8 requests in req have been waited on.
+ */
+static void start_colour_exchange(preal **p, int rb, MPI_Datatype *coltype,
+    MPI_Datatype *rowtype, MPI_Request *req)
+{
+    int ce = colour_offset(iright, jbottom, rb);
+    int cw = colour_offset(ileft, jbottom, rb);
+    int rn = colour_offset(jtop, ileft, rb);
+    int rs = colour_offset(jbottom, ileft, rb);
+
+    /* The halo beyond an edge starts with the opposite colour */
+    MPI_Irecv(&p[ileft-1][jbottom+1-cw], 1, coltype[1-cw], nbr_west, 0,
+        cart_comm, &req[0]);
+    MPI_Irecv(&p[iright+1][jbottom+1-ce], 1, coltype[1-ce], nbr_east, 1,
+        cart_comm, &req[1]);
+    MPI_Irecv(&p[ileft+1-rs][jbottom-1], 1, rowtype[1-rs], nbr_south, 2,
+        cart_comm, &req[2]);
+    MPI_Irecv(&p[ileft+1-rn][jtop+1], 1, rowtype[1-rn], nbr_north, 3,
+        cart_comm, &req[3]);
+
+    MPI_Isend(&p[iright][jbottom+ce], 1, coltype[ce], nbr_east, 0,
+        cart_comm, &req[4]);
+    MPI_Isend(&p[ileft][jbottom+cw], 1, coltype[cw], nbr_west, 1,
+        cart_comm, &req[5]);
+    MPI_Isend(&p[ileft+rn][jtop], 1, rowtype[rn], nbr_north, 2,
+        cart_comm, &req[6]);
+    MPI_Isend(&p[ileft+rs][jbottom], 1, rowtype[rs], nbr_south, 3,
+        cart_comm, &req[7]);
+}
 
-    //Define own datatype ftype to which halfs the data transfer by allowing send/receive to take every other number.
-    MPI_Status status;
-    MPI_Datatype ftype;
-    MPI_Type_vector(jmax/2, 1, 2, MPI_FLOAT, &ftype);
-    MPI_Type_commit(&ftype);
 
+/* Sweep colour rb over i0..i1 x j0..j1 in whichever layout is in use,
+ * adding the squares of the residuals before the update to *ressum unless
+ * it is NULL
+ */
+static void sweep(preal **p, preal **rhs, int rb, int i0, int i1,
+    int j0, int j1, preal omega, preal rdx2, preal rdy2, preal beta_2,
+    struct team_sum *ressum)
+{
+    if (i0 > i1 || j0 > j1) { return; }
+    if (sor_split) {
+        rb_sweep(rb, i0, i1, j0, j1, omega, rdx2, rdy2, beta_2, ressum);
+    } else {
+        stencil_sweep(p, rhs, rb, i0, i1, j0, j1, omega, rdx2, rdy2, ressum);
+    }
+}
+
+/* Start the exchange of colour rb in whichever layout is in use */
+static void start_exchange(preal **p, int rb, MPI_Datatype *coltype,
+    MPI_Datatype *rowtype, MPI_Request *req)
+{
+    if (sor_split) {
+        rb_start_exchange(rb, req);
+    } else {
+        start_colour_exchange(p, rb, coltype, rowtype, req);
+    }
+}
+
+
+/* Red/Black SOR to solve the poisson equation. Every thread of the team
+ * runs the iteration, sharing out the sweeps; the master thread exchanges
+ * the halos and reduces the residual, and the team waits for it.
+ */
+int poisson(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, real omega,
+    double *res, int ifull)
+{
+
+    /* Shared by the team */
+    static MPI_Datatype coltype[2], rowtype[2];
+    static MPI_Request req[8];
+    static double p0, tot;
+    static struct team_sum p0sum;
+    static struct team_sum ressum[2];   /* Sums of squares of the residual
+                                           by colour */
+    static double blacksum;     /* Black part kept for the next iteration */
+    static int converged;
 
     int i, j, iter;
-    float add, beta_2, beta_mod;
-    float p0 = 0.0;
+    preal beta_2;
+    double sum = 0.0, r;
+    struct team_sum *acc[2];
 
     int rb; /* Red-black value. */
 
-    float rdx2 = 1.0/(delx*delx);
-    float rdy2 = 1.0/(dely*dely);
+    preal rdx2 = 1.0/(delx*delx);
+    preal rdy2 = 1.0/(dely*dely);
     beta_2 = -omega/(2.0*(rdx2+rdy2));
 
+    if (sor_tile > 0) {
+        return tiled_poisson(p, rhs, flag, imax, jmax, delx, dely, eps,
+            itermax, omega, res, ifull);
+    }
+
+    #pragma omp master
+    {
+        //Define own datatypes which halve the data transfer by allowing send/receive to take every other number.
+        //Rows and columns of odd length hold one more cell of the colour that starts them.
+        int h = jtop - jbottom + 1, w = iright - ileft + 1;
+        MPI_Type_vector((h+1)/2, 1, 2, PREAL_MPI, &coltype[0]);
+        MPI_Type_vector(h/2, 1, 2, PREAL_MPI, &coltype[1]);
+        MPI_Type_vector((w+1)/2, 1, 2*(jmax+2), PREAL_MPI,
+            &rowtype[0]);
+        MPI_Type_vector(w/2, 1, 2*(jmax+2), PREAL_MPI,
+            &rowtype[1]);
+        MPI_Type_commit(&coltype[0]);
+        MPI_Type_commit(&coltype[1]);
+        MPI_Type_commit(&rowtype[0]);
+        MPI_Type_commit(&rowtype[1]);
+    }
+
+    #pragma omp single
+    {
+        team_sum_setup(&p0sum);
+        team_sum_setup(&ressum[0]);
+        team_sum_setup(&ressum[1]);
+        blacksum = 0.0;
+        converged = 0;
+        *res = HUGE_VAL;
+    }
+
     /* Calculate sum of squares */
+    #pragma omp for schedule(static) private(j) nowait
     for (i = ileft; i <= iright; i++) {
-        for (j=1; j<=jmax; j++) {
+        for (j = jbottom; j <= jtop; j++) {
 
-            if (flag[i][j] & C_F) { p0 += p[i][j]*p[i][j]; }
+            if (flag[i][j] & C_F) { sum += p[i][j]*p[i][j]; }
         }
     }
-    //Reduce p0 by summing to tot across  all partitions.
-    MPI_Allreduce(&p0, &tot, 1, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
-    p0 = sqrt(tot/ifull);
-    if (p0 < 0.0001) { p0 = 1.0; }
-    //start time-stamp
-    startt = MPI_Wtime();
-
-    /* Red/Black SOR-iteration */
-
+    team_add(&p0sum, sum);
+    #pragma omp barrier
+    #pragma omp master
+    {
+        //Reduce p0 by summing to tot across  all partitions.
+        p0 = team_total(&p0sum);
+        timed_allreduce(&p0, &tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+        p0 = sqrt(tot/ifull);
+        if (p0 < 0.0001) { p0 = 1.0; }
+    }
+    #pragma omp barrier
+
+    if (sor_split) { rb_pack(p, rhs); }
+
+    /* Red/Black SOR-iteration
+     * The residual is checked after every sor_check iterations without a
+     * separate pass over the block. The sweeps sum the squares of the
+     * residuals of the cells they update, as they were before the update.
+     * The black cells see the red cells' final values, and a cell's
+     * residual after its own update is 1-omega times the one before, so
+     * the black sweep gives the black part of the residual at the end of
+     * the iteration. The red part comes from the red sweep of the next
+     * iteration, after which the two parts are reduced together and the
+     * iteration stops if the residual was small enough. It then has done a
+     * further red half-sweep, which only brings p closer.
+     * If the iteration runs out without converging, the last check may
+     * have been up to sor_check iterations before the end, so *res is
+     * then taken afresh from the final p.
+     * The sweeps do not wait for each other, so the team synchronises
+     * before each exchange, which needs the cells it sends, and after it,
+     * since the next sweep reads the halo.
+     */
     for (iter = 0; iter < itermax; iter++) {
-        for (rb = 0; rb <= 1; rb++) {
+        /* Red part of the residual after the last iteration, and black
+         * part of the residual after this one
+         */
+        acc[0] = (iter > 0 && iter % sor_check == 0) ? &ressum[0] : NULL;
+        acc[1] = ((iter+1) % sor_check == 0) ? &ressum[1] : NULL;
 
- //OpenMP code for static parallelisation of the for loop for carrying out the Red/Black iterations.
-         #pragma omp parallel for schedule(static)
-
-            for (i = ileft; i <= iright; i++) {
-                for (j = 1; j <= jmax; j++) {
-                    if ((i+j) % 2 != rb) { continue; }
-                    if (flag[i][j] == (C_F | B_NSEW)) {
-                        /* five point star for interior fluid cells */
-                        p[i][j] = (1.-omega)*p[i][j] -
-                              beta_2*(
-                                    (p[i+1][j]+p[i-1][j])*rdx2
-                                  + (p[i][j+1]+p[i][j-1])*rdy2
-                                  -  rhs[i][j]
-                              );
-                    } else if (flag[i][j] & C_F) {
-                        /* modified star near boundary */
-                        beta_mod = -omega/((eps_E+eps_W)*rdx2+(eps_N+eps_S)*rdy2);
-                        p[i][j] = (1.-omega)*p[i][j] -
-                            beta_mod*(
-                                  (eps_E*p[i+1][j]+eps_W*p[i-1][j])*rdx2
-                                + (eps_N*p[i][j+1]+eps_S*p[i][j-1])*rdy2
-                                - rhs[i][j]
-                            );
-
-                    }
-                } /* end of j */
-            } /* end of i */
-
-//send /receive ileft and iright respectively to their neighouring sections. As defined datatype ftype to share every other value in the p array on the border between partitions.
-if(ileft > 1){
-
-    MPI_Send(p[ileft] + 1 + (((ileft+1) % 2) ^ rb), 1, ftype, proc-1, 666, MPI_COMM_WORLD);
-    MPI_Recv(p[ileft - 1] + 1 + (((ileft+1) % 2 ) ^ rb ^ 1), 1, ftype,  proc-1, 666, MPI_COMM_WORLD,&status);
-}
-
-if(iright < imax){
-
-    MPI_Send(p[iright] + 1 + (((iright +1) % 2) ^ rb), 1, ftype, proc+1, 666, MPI_COMM_WORLD);
-    MPI_Recv(p[iright + 1] +  1 + (((iright+1) % 2 ) ^ rb ^ 1), 1, ftype,  proc+1, 666, MPI_COMM_WORLD,&status);
- }
+        for (rb = 0; rb <= 1; rb++) {
 
+            timer_push(rb ? PH_SOR_BLACK : PH_SOR_RED);
+            if (sor_overlap) {
+                /* Update the cells along the edges of the block first and
+                 * start sending them, then sweep the interior while the
+                 * messages are in flight.
+                 */
+                sweep(p, rhs, rb, ileft, ileft, jbottom, jtop, omega, rdx2,
+                    rdy2, beta_2, acc[rb]);
+                if (iright > ileft) {
+                    sweep(p, rhs, rb, iright, iright, jbottom, jtop, omega,
+                        rdx2, rdy2, beta_2, acc[rb]);
+                }
+                sweep(p, rhs, rb, ileft+1, iright-1, jbottom, jbottom, omega,
+                    rdx2, rdy2, beta_2, acc[rb]);
+                if (jtop > jbottom) {
+                    sweep(p, rhs, rb, ileft+1, iright-1, jtop, jtop, omega,
+                        rdx2, rdy2, beta_2, acc[rb]);
+                }
+                #pragma omp barrier
+                #pragma omp master
+                {
+                    timer_push(PH_HALO);
+                    start_exchange(p, rb, coltype, rowtype, req);
+                    timer_pop();
+                }
+                sweep(p, rhs, rb, ileft+1, iright-1, jbottom+1, jtop-1, omega,
+                    rdx2, rdy2, beta_2, acc[rb]);
+                #pragma omp barrier
+                #pragma omp master
+                {
+                    timer_push(PH_HALO);
+                    MPI_Waitall(8, req, MPI_STATUSES_IGNORE);
+                    timer_pop();
+                }
+            } else {
+                sweep(p, rhs, rb, ileft, iright, jbottom, jtop, omega, rdx2,
+                    rdy2, beta_2, acc[rb]);
+                #pragma omp barrier
+
+                //send /receive the edges of the block to the neighbouring blocks on all four sides, using the datatypes to share every other value in the p array.
+                #pragma omp master
+                {
+                    timer_push(PH_HALO);
+                    start_exchange(p, rb, coltype, rowtype, req);
+                    MPI_Waitall(8, req, MPI_STATUSES_IGNORE);
+                    timer_pop();
+                }
+            }
+            timer_pop();
+
+            #pragma omp master
+            if (rb == 0 && acc[0]) {
+                /* Reduce the residual after the last iteration, whose
+                 * black part was kept from its black sweep, in double.
+                 */
+                r = team_total(&ressum[0]) + blacksum;
+                timed_allreduce(&r, &tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+                *res = sqrt(tot/ifull)/p0;
+                /* convergence? */
+                if (*res<eps) { converged = 1; }
+            } else if (rb == 1 && acc[1]) {
+                blacksum = (1.0-omega)*(1.0-omega)*team_total(&ressum[1]);
+            }
+            #pragma omp barrier
+            if (converged) { break; }
         } /* end of rb */
+        if (converged) { break; }
+    } /* end of iter */
+    if (sor_split) { rb_unpack(p); }
 
-        /* Partial computation of residual */
-        *res = 0.0;
+    if (!converged && itermax > 0) {
+        sum = 0.0;
+        #pragma omp for schedule(static) nowait
         for (i = ileft; i <= iright; i++) {
-            for (j = 1; j <= jmax; j++) {
-                if (flag[i][j] & C_F) {
-                    /* only fluid cells */
-                    add = (eps_E*(p[i+1][j]-p[i][j]) -
-                        eps_W*(p[i][j]-p[i-1][j])) * rdx2  +
-                        (eps_N*(p[i][j+1]-p[i][j]) -
-                        eps_S*(p[i][j]-p[i][j-1])) * rdy2  -  rhs[i][j];
-                    *res += add*add;
-                }
-            }
+            sum += stencil_column_residual(p, rhs, i, jbottom, jtop, rdx2,
+                rdy2);
         }
+        team_add(&ressum[0], sum);
+        #pragma omp barrier
+        #pragma omp master
+        {
+            r = team_total(&ressum[0]);
+            timed_allreduce(&r, &tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+            *res = sqrt(tot/ifull)/p0;
+        }
+    }
 
-        //Reduce res into tot across  all partitions.
-
-        MPI_Allreduce(&p0, &tot, 1, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
-        
-
-        *res = sqrt((tot)/ifull)/p0;
-        // end timestamp
-        endt = MPI_Wtime();
-        /* convergence? */
-        if (*res<eps) break;
-    } /* end of iter */
-        // free the user defined datatype
-    MPI_Type_free(&ftype);
+    #pragma omp master
+    {
+        // free the user defined datatypes
+        MPI_Type_free(&coltype[0]);
+        MPI_Type_free(&coltype[1]);
+        MPI_Type_free(&rowtype[0]);
+        MPI_Type_free(&rowtype[1]);
+    }
     return iter;
 }
 
@@ -224,64 +376,102 @@ if(iright < imax){
 /* Update the velocity values based on the tentative
  * velocity values and the new pressure matrix
  */
-void update_velocity(float **u, float **v, float **f, float **g, float **p,
-    char **flag, int imax, int jmax, float del_t, float delx, float dely)
+void update_velocity(real **u, real **v, real **f, real **g, preal **p,
+    char **flag, int imax, int jmax, real del_t, real delx, real dely)
 {
-    int i, j;
+    int i;
 
-    for (i=1; i<=imax-1; i++) {
-        for (j=1; j<=jmax; j++) {
-            /* only if both adjacent cells are fluid cells */
-            if ((flag[i][j] & C_F) && (flag[i+1][j] & C_F)) {
-                u[i][j] = f[i][j]-(p[i+1][j]-p[i][j])*del_t/delx;
-            }
-        }
+    #pragma omp for schedule(static) nowait
+    for (i=max(1, ileft); i<=min(imax-1, iright); i++) {
+        u_column(u, f, p, flag, i, jbottom, jtop, del_t, delx);
     }
-    for (i=1; i<=imax; i++) {
-        for (j=1; j<=jmax-1; j++) {
-            /* only if both adjacent cells are fluid cells */
-            if ((flag[i][j] & C_F) && (flag[i][j+1] & C_F)) {
-                v[i][j] = g[i][j]-(p[i][j+1]-p[i][j])*del_t/dely;
-            }
-        }
+    #pragma omp for schedule(static)
+    for (i=ileft; i<=iright; i++) {
+        v_column(v, g, p, flag, i, jbottom, min(jmax-1, jtop), del_t, dely);
     }
 }
 
 
+/* Set the timestep size from the largest velocity magnitudes umax and
+ * vmax of this process's block, as set_timestep_interval() does. Inside a
+ * parallel region only the master thread may call this.
+ */
+void set_timestep_from_max(real *del_t, real delx, real dely,
+    real umax, real vmax, real Re, real tau)
+{
+    real deltu, deltv, deltRe;
+    real local[2], global[2];
+
+    if (tau < 1.0e-10) { /* no time stepsize control */
+        return;
+    }
+
+    /* Every process must take the same timestep */
+    local[0] = umax;
+    local[1] = vmax;
+    timed_allreduce(local, global, 2, REAL_MPI, MPI_MAX, cart_comm);
+    umax = global[0];
+    vmax = global[1];
+
+    deltu = delx/umax;
+    deltv = dely/vmax;
+    deltRe = 1/(1/(delx*delx)+1/(dely*dely))*Re/2.0;
+
+    if (deltu<deltv) {
+        *del_t = min(deltu, deltRe);
+    } else {
+        *del_t = min(deltv, deltRe);
+    }
+    *del_t = tau * (*del_t); /* multiply by safety factor */
+}
+
+
 /* Set the timestep size so that we satisfy the Courant-Friedrichs-Lewy
  * conditions (ie no particle moves more than one cell width in one
  * timestep). Otherwise the simulation becomes unstable.
  */
-void set_timestep_interval(float *del_t, int imax, int jmax, float delx,
-    float dely, float **u, float **v, float Re, float tau)
+void set_timestep_interval(real *del_t, int imax, int jmax, real delx,
+    real dely, real **u, real **v, real Re, real tau)
 {
     int i, j;
-    float umax, vmax, deltu, deltv, deltRe;
+    real umax, vmax;
+
+    /* Block including any external boundary cells next to it */
+    int ilo = (ileft == 1) ? 0 : ileft;
+    int ihi = (iright == imax) ? imax+1 : iright;
+    int jlo = (jbottom == 1) ? 0 : jbottom;
+    int jhi = (jtop == jmax) ? jmax+1 : jtop;
 
     /* del_t satisfying CFL conditions */
     if (tau >= 1.0e-10) { /* else no time stepsize control */
         umax = 1.0e-10;
         vmax = 1.0e-10;
-        for (i=0; i<=imax+1; i++) {
-            for (j=1; j<=jmax+1; j++) {
+        #pragma omp single
+        {
+            team_max[0] = umax;
+            team_max[1] = vmax;
+        }
+        #pragma omp for schedule(static) private(j) nowait
+        for (i=ilo; i<=ihi; i++) {
+            for (j=max(1, jlo); j<=jhi; j++) {
                 umax = max(fabs(u[i][j]), umax);
             }
         }
-        for (i=1; i<=imax+1; i++) {
-            for (j=0; j<=jmax+1; j++) {
+        #pragma omp for schedule(static) private(j) nowait
+        for (i=max(1, ilo); i<=ihi; i++) {
+            for (j=jlo; j<=jhi; j++) {
                 vmax = max(fabs(v[i][j]), vmax);
             }
         }
-
-        deltu = delx/umax;
-        deltv = dely/vmax;
-        deltRe = 1/(1/(delx*delx)+1/(dely*dely))*Re/2.0;
-
-        if (deltu<deltv) {
-            *del_t = min(deltu, deltRe);
-        } else {
-            *del_t = min(deltv, deltRe);
+        #pragma omp critical (timestep_max)
+        {
+            team_max[0] = max(umax, team_max[0]);
+            team_max[1] = max(vmax, team_max[1]);
         }
-        *del_t = tau * (*del_t); /* multiply by safety factor */
+        #pragma omp barrier
+        #pragma omp master
+        set_timestep_from_max(del_t, delx, dely, team_max[0], team_max[1],
+            Re, tau);
+        #pragma omp barrier
     }
 }
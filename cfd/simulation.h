@@ -1,16 +1,21 @@
-void compute_tentative_velocity(float **u, float **v, float **f, float **g,
-    char **flag, int imax, int jmax, float del_t, float delx, float dely,
-    float gamma, float Re);
+#include "precision.h"
 
-void compute_rhs(float **f, float **g, float **rhs, char **flag, int imax,
-    int jmax, float del_t, float delx, float dely);
+void compute_tentative_velocity(real **u, real **v, real **f, real **g,
+    char **flag, int imax, int jmax, real del_t, real delx, real dely,
+    real gamma, real Re);
 
-int poisson(float **p, float **rhs, char **flag, int imax, int jmax,
-    float delx, float dely, float eps, int itermax, float omega,
-    float *res, int ifull);
+void compute_rhs(real **f, real **g, preal **rhs, char **flag, int imax,
+    int jmax, real del_t, real delx, real dely);
 
-void update_velocity(float **u, float **v, float **f, float **g, float **p,
-    char **flag, int imax, int jmax, float del_t, float delx, float dely);
+int poisson(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, real omega,
+    double *res, int ifull);
 
-void set_timestep_interval(float *del_t, int imax, int jmax, float delx,
-    float dely, float **u, float **v, float Re, float tau);
+void update_velocity(real **u, real **v, real **f, real **g, preal **p,
+    char **flag, int imax, int jmax, real del_t, real delx, real dely);
+
+void set_timestep_interval(real *del_t, int imax, int jmax, real delx,
+    real dely, real **u, real **v, real Re, real tau);
+
+void set_timestep_from_max(real *del_t, real delx, real dely,
+    real umax, real vmax, real Re, real tau);
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mpi.h>
+#include "halo.h"
+#include "statefile.h"
+#include "statemap.h"
+
+extern int ileft, iright, jbottom, jtop;
+extern int proc;
+extern MPI_Comm cart_comm;
+
+/* State files are written in version 2 of the format (see statemap.h),
+ * with u and v in the build's real type and p in its preal type. Each
+ * process writes only the cells it owns, its block and the external
+ * boundary cells next to it, with one collective MPI-IO call per field.
+ * A field's section has the layout of the matrix in memory, so the same
+ * subarray type picks the process's cells out of both and nothing is
+ * copied.
+ * Version 2 files are read by mapping them; each process copies its own
+ * cells, so only the pages holding them are read. Version 1 files are
+ * read with MPI-IO, each process reading its slab of the interleaved
+ * columns through a file view.
+ */
+#ifdef REAL_DOUBLE
+#define REAL_TYPE  STATE_FLOAT64
+#else
+#define REAL_TYPE  STATE_FLOAT32
+#endif
+#ifdef PREAL_DOUBLE
+#define PREAL_TYPE STATE_FLOAT64
+#else
+#define PREAL_TYPE STATE_FLOAT32
+#endif
+
+static const int field_types[STATE_NFIELDS] = {
+    REAL_TYPE, REAL_TYPE, PREAL_TYPE, STATE_INT8
+};
+
+/* Version 1 files: a header and then one record per column */
+#define V1_HEADER (2*sizeof(int) + 2*sizeof(float))
+#define V1_RECORD (3*(jmax+2)*sizeof(float) + (jmax+2))
+
+/* The cells owned by this process: columns ilo..ihi and rows jlo..jhi */
+static void owned_cells(int imax, int jmax, int *ilo, int *ihi, int *jlo,
+    int *jhi)
+{
+    *ilo = (ileft == 1) ? 0 : ileft;
+    *ihi = (iright == imax) ? imax+1 : iright;
+    *jlo = (jbottom == 1) ? 0 : jbottom;
+    *jhi = (jtop == jmax) ? jmax+1 : jtop;
+}
+
+/* The cells owned by this process within an imax x jmax matrix, or a
+ * field of a version 2 file, of the given type
+ */
+static MPI_Datatype owned_type(int imax, int jmax, MPI_Datatype type)
+{
+    int ilo, ihi, jlo, jhi;
+    int sizes[2] = { imax+2, jmax+2 }, sub[2], start[2];
+    MPI_Datatype cells;
+
+    owned_cells(imax, jmax, &ilo, &ihi, &jlo, &jhi);
+    sub[0] = ihi - ilo + 1;
+    sub[1] = jhi - jlo + 1;
+    start[0] = ilo;
+    start[1] = jlo;
+    MPI_Type_create_subarray(2, sizes, sub, start, MPI_ORDER_C, type,
+        &cells);
+    MPI_Type_commit(&cells);
+    return cells;
+}
+
+/* File type of the slab ilo..ihi x jlo..jhi of the records of a version 1
+ * file, in bytes. In each record the values are a 3 x (jmax+2) array of
+ * floats and the flags a (jmax+2) array of bytes, and the records an array
+ * of imax+2.
+ */
+static MPI_Datatype v1_slab_type(int imax, int jmax, int ilo, int ihi,
+    int jlo, int jhi)
+{
+    int h = jhi - jlo + 1, w = ihi - ilo + 1, n = imax + 2;
+    int vsizes[2] = { 3, (jmax+2)*sizeof(float) };
+    int vsub[2] = { 3, h*sizeof(float) };
+    int vstart[2] = { 0, jlo*sizeof(float) };
+    int fsize = jmax+2;
+    int blocks[2] = { 1, 1 };
+    MPI_Aint displs[2] = { 0, 3*(jmax+2)*sizeof(float) };
+    MPI_Datatype types[2], rec, record, slab;
+
+    MPI_Type_create_subarray(2, vsizes, vsub, vstart, MPI_ORDER_C, MPI_BYTE,
+        &types[0]);
+    MPI_Type_create_subarray(1, &fsize, &h, &jlo, MPI_ORDER_C, MPI_BYTE,
+        &types[1]);
+    MPI_Type_create_struct(2, blocks, displs, types, &rec);
+    MPI_Type_create_resized(rec, 0, V1_RECORD, &record);
+    MPI_Type_create_subarray(1, &n, &w, &ilo, MPI_ORDER_C, record, &slab);
+    MPI_Type_commit(&slab);
+
+    MPI_Type_free(&types[0]);
+    MPI_Type_free(&types[1]);
+    MPI_Type_free(&rec);
+    MPI_Type_free(&record);
+    return slab;
+}
+
+/* Fill in the header and directory of a state file written by this build.
+ * Returns the size of the file.
+ */
+static size_t make_header(struct state_header *h, struct state_field *dir,
+    int imax, int jmax, real xlength, real ylength,
+    const struct run_state *rs)
+{
+    size_t size = state_layout(imax, jmax, field_types, h, dir);
+
+    h->xlength = xlength;
+    h->ylength = ylength;
+    if (rs != NULL) {
+        h->t = rs->t;
+        h->del_t = rs->del_t;
+        h->iters = rs->iters;
+        h->ibound = rs->ibound;
+    }
+    return size;
+}
+
+/* Report a failed MPI-IO call on process 0 */
+static void io_error(const char *what, char *file, int err)
+{
+    char msg[MPI_MAX_ERROR_STRING];
+    int len;
+
+    if (proc == 0) {
+        MPI_Error_string(err, msg, &len);
+        fprintf(stderr, "Could not %s file '%s': %s\n", what, file, msg);
+    }
+}
+
+/* Check the size of the domain in a state file against the program's */
+static int check_domain(char *file, int i, int j, float xl, float yl,
+    int imax, int jmax, real xlength, real ylength)
+{
+    if (i!=imax || j!=jmax) {
+        if (proc == 0) {
+            fprintf(stderr, "Warning: imax/jmax have wrong values in %s\n",
+                file);
+            fprintf(stderr, "%s's imax = %d, jmax = %d\n", file, i, j);
+            fprintf(stderr, "Program's imax = %d, jmax = %d\n", imax, jmax);
+        }
+        return 1;
+    }
+    if (xl!=(float) xlength || yl!=(float) ylength) {
+        if (proc == 0) {
+            fprintf(stderr, "Warning: xlength/ylength have wrong values in "
+                "%s\n", file);
+            fprintf(stderr, "%s's xlength = %g,  ylength = %g\n", file, xl,
+                yl);
+            fprintf(stderr, "Program's xlength = %g, ylength = %g\n",
+                xlength, ylength);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Save the simulation state, and the run state rs if it isn't NULL, to a
+ * file. Called by every process.
+ */
+void write_bin(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength,
+    const struct run_state *rs, char *file)
+{
+    int f, err;
+    void *m0[STATE_NFIELDS] = { u[0], v[0], p[0], flag[0] };
+    MPI_Datatype types[STATE_NFIELDS] = {
+        REAL_MPI, REAL_MPI, PREAL_MPI, MPI_CHAR
+    };
+    MPI_Datatype cells;
+    struct state_header h;
+    struct state_field dir[STATE_NFIELDS];
+    MPI_Offset size;
+    MPI_File fh;
+
+    err = MPI_File_open(cart_comm, file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        MPI_INFO_NULL, &fh);
+    if (err != MPI_SUCCESS) {
+        io_error("open", file, err);
+        return;
+    }
+    size = make_header(&h, dir, imax, jmax, xlength, ylength, rs);
+    /* Truncate whatever was there before, so the padding is zeros */
+    MPI_File_set_size(fh, 0);
+    MPI_File_set_size(fh, size);
+
+    if (proc == 0) {
+        MPI_File_write_at(fh, 0, &h, sizeof(h), MPI_BYTE, MPI_STATUS_IGNORE);
+        MPI_File_write_at(fh, sizeof(h), dir, sizeof(dir), MPI_BYTE,
+            MPI_STATUS_IGNORE);
+    }
+
+    for (f = 0; f < STATE_NFIELDS; f++) {
+        cells = owned_type(imax, jmax, types[f]);
+        MPI_File_set_view(fh, dir[f].offset, types[f], cells, "native",
+            MPI_INFO_NULL);
+        err = MPI_File_write_all(fh, m0[f], 1, cells, MPI_STATUS_IGNORE);
+        MPI_Type_free(&cells);
+        if (err != MPI_SUCCESS) {
+            io_error("write", file, err);
+            break;
+        }
+    }
+    MPI_File_close(&fh);
+}
+
+/* Read a version 2 state file. rs, if it isn't NULL, is set from the
+ * header.
+ */
+static int read_v2(struct state *s, real **u, real **v, preal **p,
+    char **flag, int imax, int jmax, real xlength, real ylength, char *file,
+    struct run_state *rs)
+{
+    int i, j, ilo, ihi, jlo, jhi;
+    size_t k;
+
+    if (check_domain(file, s->imax, s->jmax, s->xlength, s->ylength, imax,
+            jmax, xlength, ylength)) {
+        return 1;
+    }
+    if (rs != NULL) {
+        rs->t = s->t;
+        rs->del_t = s->del_t;
+        rs->iters = s->iters;
+        rs->ibound = s->ibound;
+    }
+
+    owned_cells(imax, jmax, &ilo, &ihi, &jlo, &jhi);
+    #pragma omp parallel for private(j, k) schedule(static)
+    for (i = ilo; i <= ihi; i++) {
+        for (j = jlo; j <= jhi; j++) {
+            k = (size_t) i*(jmax+2) + j;
+            u[i][j] = state_get(s, STATE_U, k);
+            v[i][j] = state_get(s, STATE_V, k);
+            p[i][j] = state_get(s, STATE_P, k);
+        }
+    }
+    /* Every process holds all the flags, as the multigrid solver coarsens
+     * them over the whole grid
+     */
+    memcpy(flag[0], s->field[STATE_FLAG], (size_t) (imax+2)*(jmax+2));
+    return 0;
+}
+
+/* Read a version 1 state file */
+static int read_v1(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength, char *file)
+{
+    int i, j, ilo, ihi, jlo, jhi, h, err;
+    size_t rec;
+    float xl, yl;
+    char header[V1_HEADER], *buf;
+    MPI_Datatype slab, flagtype;
+    MPI_File fh;
+
+    err = MPI_File_open(cart_comm, file, MPI_MODE_RDONLY, MPI_INFO_NULL,
+        &fh);
+    if (err != MPI_SUCCESS) {
+        io_error("open", file, err);
+        return 1;
+    }
+
+    MPI_File_read_at_all(fh, 0, header, V1_HEADER, MPI_BYTE,
+        MPI_STATUS_IGNORE);
+    memcpy(&i, header, sizeof(int));
+    memcpy(&j, header + sizeof(int), sizeof(int));
+    memcpy(&xl, header + 2*sizeof(int), sizeof(float));
+    memcpy(&yl, header + 2*sizeof(int) + sizeof(float), sizeof(float));
+    if (check_domain(file, i, j, xl, yl, imax, jmax, xlength, ylength)) {
+        MPI_File_close(&fh);
+        return 1;
+    }
+
+    /* The flags, which follow the values in each record */
+    MPI_Type_vector(imax+2, jmax+2, V1_RECORD, MPI_BYTE, &flagtype);
+    MPI_Type_commit(&flagtype);
+    MPI_File_set_view(fh, V1_HEADER + 3*(jmax+2)*sizeof(float), MPI_BYTE,
+        flagtype, "native", MPI_INFO_NULL);
+    MPI_File_read_all(fh, flag[0], (imax+2)*(jmax+2), MPI_BYTE,
+        MPI_STATUS_IGNORE);
+    MPI_Type_free(&flagtype);
+
+    owned_cells(imax, jmax, &ilo, &ihi, &jlo, &jhi);
+    h = jhi - jlo + 1;
+    rec = 3*h*sizeof(float) + h;
+    if ((buf = malloc((ihi-ilo+1) * rec)) == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for the input.\n");
+        exit(1);
+    }
+    slab = v1_slab_type(imax, jmax, ilo, ihi, jlo, jhi);
+    MPI_File_set_view(fh, V1_HEADER, MPI_BYTE, slab, "native",
+        MPI_INFO_NULL);
+    err = MPI_File_read_all(fh, buf, (ihi-ilo+1) * rec, MPI_BYTE,
+        MPI_STATUS_IGNORE);
+    if (err != MPI_SUCCESS) { io_error("read", file, err); }
+    MPI_Type_free(&slab);
+    MPI_File_close(&fh);
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = ilo; i <= ihi; i++) {
+        float col[3*h];
+
+        memcpy(col, buf + (i-ilo)*rec, 3*h*sizeof(float));
+        for (j = jlo; j <= jhi; j++) {
+            u[i][j] = col[j-jlo];
+            v[i][j] = col[h+j-jlo];
+            p[i][j] = col[2*h+j-jlo];
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/* Read a state file of either version, and exchange the halos. Returns 0
+ * on success, -1 if the file can't be opened and 1 if it can't be used.
+ */
+static int read_state(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength, char *file,
+    struct run_state *rs)
+{
+    int err, code, worst;
+    struct state s;
+
+    /* Every process must take the same path */
+    err = state_map(file, &s);
+    code = (err == -1) ? STATE_BAD+1 : err;
+    MPI_Allreduce(&code, &worst, 1, MPI_INT, MPI_MAX, cart_comm);
+    if (err == 0 && worst != 0) { state_close(&s); }
+
+    if (worst == STATE_BAD+1) {
+        if (proc == 0) {
+            fprintf(stderr, "Could not open file '%s': %s\n", file,
+                (err == -1) ? strerror(errno) : "not on every process");
+        }
+        return -1;
+    } else if (worst == STATE_BAD) {
+        if (proc == 0) {
+            fprintf(stderr, "'%s' is not a usable state file\n", file);
+        }
+        return 1;
+    } else if (worst == STATE_NOT_V2) {
+        if (rs != NULL) {
+            if (proc == 0) {
+                fprintf(stderr, "'%s' has no run state to restart from\n",
+                    file);
+            }
+            return 1;
+        }
+        err = read_v1(u, v, p, flag, imax, jmax, xlength, ylength, file);
+    } else {
+        err = read_v2(&s, u, v, p, flag, imax, jmax, xlength, ylength, file,
+            rs);
+        state_close(&s);
+    }
+    if (err) { return err; }
+
+    exchange_halo(u, imax, jmax);
+    exchange_halo(v, imax, jmax);
+    exchange_halo_p(p, imax, jmax);
+    return 0;
+}
+
+/* Read the simulation state from a file. Called by every process, once
+ * the domain is decomposed. Each process reads its own block of u, v and
+ * p, and the halos are exchanged afterwards.
+ * Returns 0 on success, -1 if there is no file and 1 if it doesn't match
+ * the grid.
+ */
+int read_bin(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength, char *file)
+{
+    int err;
+
+    if (file == NULL) return -1;
+
+    err = read_state(u, v, p, flag, imax, jmax, xlength, ylength, file,
+        NULL);
+    if (err < 0 && proc == 0) {
+        fprintf(stderr, "Generating default state instead.\n");
+    }
+    return err;
+}
+
+/* read_bin() for a checkpoint or any other version 2 file, also filling
+ * in *rs. Returns 0 on success and non-zero, having said why, if the
+ * state cannot be restored.
+ */
+int read_checkpoint(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength, char *file,
+    struct run_state *rs)
+{
+    return read_state(u, v, p, flag, imax, jmax, xlength, ylength, file,
+        rs) != 0;
+}
+
+
+/* Checkpoints are written by a thread of each process with POSIX I/O
+ * (see checkpoint.c), from a copy of the process's cells. The copy holds
+ * each field's cells in turn, column by column, starting on 8 byte
+ * boundaries.
+ */
+static void slab_offsets(int imax, int jmax, size_t *off)
+{
+    int f, ilo, ihi, jlo, jhi;
+    size_t cells;
+
+    owned_cells(imax, jmax, &ilo, &ihi, &jlo, &jhi);
+    cells = (size_t) (ihi-ilo+1) * (jhi-jlo+1);
+    off[0] = 0;
+    for (f = 0; f < STATE_NFIELDS; f++) {
+        off[f+1] = (off[f] + cells*state_type_size(field_types[f]) + 7) / 8
+            * 8;
+    }
+}
+
+/* Size in bytes of the copy of this process's cells */
+size_t state_slab_size(int imax, int jmax)
+{
+    size_t off[STATE_NFIELDS+1];
+
+    slab_offsets(imax, jmax, off);
+    return off[STATE_NFIELDS];
+}
+
+/* Copy this process's cells of the state into buf */
+void state_pack(real **u, real **v, preal **p, char **flag, int imax,
+    int jmax, char *buf)
+{
+    int i, j, ilo, ihi, jlo, jhi, h;
+    size_t off[STATE_NFIELDS+1], k;
+    real *bu, *bv;
+    preal *bp;
+    char *bf;
+
+    owned_cells(imax, jmax, &ilo, &ihi, &jlo, &jhi);
+    h = jhi - jlo + 1;
+    slab_offsets(imax, jmax, off);
+    bu = (real *) (buf + off[STATE_U]);
+    bv = (real *) (buf + off[STATE_V]);
+    bp = (preal *) (buf + off[STATE_P]);
+    bf = buf + off[STATE_FLAG];
+
+    #pragma omp parallel for private(j, k) schedule(static)
+    for (i = ilo; i <= ihi; i++) {
+        k = (size_t) (i-ilo)*h;
+        for (j = jlo; j <= jhi; j++, k++) {
+            bu[k] = u[i][j];
+            bv[k] = v[i][j];
+            bp[k] = p[i][j];
+        }
+        memcpy(&bf[(i-ilo)*h], &flag[i][jlo], h);
+    }
+}
+
+/* Create a checkpoint file of the right size holding the header, with the
+ * run state *rs, for the processes to write their cells into with
+ * state_write_slab(). Called by process 0 only. Returns 0 on success, or
+ * -1 with errno set.
+ */
+int state_create(char *file, int imax, int jmax, real xlength,
+    real ylength, const struct run_state *rs)
+{
+    struct state_header h;
+    struct state_field dir[STATE_NFIELDS];
+    size_t size = make_header(&h, dir, imax, jmax, xlength, ylength, rs);
+    int fd, ok;
+
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        return -1;
+    }
+    ok = pwrite(fd, &h, sizeof(h), 0) == sizeof(h) &&
+        pwrite(fd, dir, sizeof(dir), sizeof(h)) == sizeof(dir) &&
+        ftruncate(fd, size) == 0;
+    return (close(fd) == 0 && ok) ? 0 : -1;
+}
+
+/* Write a copy from state_pack() into a file made by state_create(), with
+ * plain POSIX I/O so that any thread may call it, and flush it to disk.
+ * Whole columns are contiguous in the file, so blocks as high as the
+ * domain are written in one go per field. Returns 0 on success, or -1
+ * with errno set.
+ */
+int state_write_slab(char *file, const char *buf, int imax, int jmax)
+{
+    int i, f, fd, ok = 1, ilo, ihi, jlo, jhi, h, cols;
+    size_t off[STATE_NFIELDS+1], esize, n;
+    struct state_header hd;
+    struct state_field dir[STATE_NFIELDS];
+    off_t at;
+
+    if ((fd = open(file, O_WRONLY)) < 0) {
+        return -1;
+    }
+    state_layout(imax, jmax, field_types, &hd, dir);
+    owned_cells(imax, jmax, &ilo, &ihi, &jlo, &jhi);
+    h = jhi - jlo + 1;
+    slab_offsets(imax, jmax, off);
+
+    for (f = 0; f < STATE_NFIELDS && ok; f++) {
+        esize = state_type_size(field_types[f]);
+        cols = (h == jmax+2) ? 1 : ihi-ilo+1;
+        n = (h == jmax+2) ? (size_t) (ihi-ilo+1)*h*esize : h*esize;
+        for (i = 0; i < cols && ok; i++) {
+            at = dir[f].offset +
+                ((off_t) (ilo+i)*(jmax+2) + jlo)*esize;
+            ok = pwrite(fd, buf + off[f] + i*n, n, at) == n;
+        }
+    }
+    ok = ok && fsync(fd) == 0;
+    return (close(fd) == 0 && ok) ? 0 : -1;
+}
@@ -0,0 +1,32 @@
+#ifndef STATEFILE_H
+#define STATEFILE_H
+
+#include <stddef.h>
+#include "precision.h"
+
+/* Where a run had got to, saved in the header of a state file: the time
+ * and step number of the next timestep, the last timestep's size and the
+ * number of boundary cells
+ */
+struct run_state {
+    double t, del_t;
+    int iters, ibound;
+};
+
+void write_bin(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength,
+    const struct run_state *rs, char *file);
+int read_bin(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength, char *file);
+int read_checkpoint(real **u, real **v, preal **p, char **flag,
+    int imax, int jmax, real xlength, real ylength, char *file,
+    struct run_state *rs);
+
+size_t state_slab_size(int imax, int jmax);
+void state_pack(real **u, real **v, preal **p, char **flag, int imax,
+    int jmax, char *buf);
+int state_create(char *file, int imax, int jmax, real xlength,
+    real ylength, const struct run_state *rs);
+int state_write_slab(char *file, const char *buf, int imax, int jmax);
+
+#endif
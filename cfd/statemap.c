@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statemap.h"
+
+static const char *field_names[STATE_NFIELDS] = { "u", "v", "p", "flag" };
+
+#define CELLS(s) ((size_t) ((s)->imax+2) * ((s)->jmax+2))
+
+/* Size in bytes of an element of the given type, or 0 if there is no
+ * such type
+ */
+size_t state_type_size(int type)
+{
+    switch (type) {
+        case STATE_FLOAT32: return 4;
+        case STATE_FLOAT64: return 8;
+        case STATE_INT8:    return 1;
+        default:            return 0;
+    }
+}
+
+/* Fill in the header and the directory of a version 2 file holding
+ * fields of the given types, all but the domain size and the run state.
+ * Returns the size of the file.
+ */
+size_t state_layout(int imax, int jmax, const int *type,
+    struct state_header *h, struct state_field *dir)
+{
+    int f;
+    size_t cells = (size_t) (imax+2) * (jmax+2);
+    size_t off = sizeof(*h) + STATE_NFIELDS*sizeof(*dir);
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, STATE_MAGIC, sizeof(h->magic));
+    h->version = STATE_VERSION;
+    h->endian = STATE_ENDIAN;
+    h->nfields = STATE_NFIELDS;
+    h->imax = imax;
+    h->jmax = jmax;
+
+    for (f = 0; f < STATE_NFIELDS; f++) {
+        off = (off + STATE_ALIGN-1) / STATE_ALIGN * STATE_ALIGN;
+        memset(&dir[f], 0, sizeof(dir[f]));
+        strncpy(dir[f].name, field_names[f], sizeof(dir[f].name));
+        dir[f].type = type[f];
+        dir[f].offset = off;
+        dir[f].size = cells * state_type_size(type[f]);
+        off += dir[f].size;
+    }
+    return off;
+}
+
+
+/* Set up s from a version 2 file in memory. The fields are found by name
+ * in the directory and used where they are.
+ */
+static int parse_v2(char *buf, size_t len, struct state *s)
+{
+    struct state_header *h = (struct state_header *) buf;
+    struct state_field *dir = (struct state_field *) (h + 1);
+    unsigned k;
+    int f;
+
+    if (len < sizeof(*h) || memcmp(h->magic, STATE_MAGIC, 8) != 0) {
+        return STATE_NOT_V2;
+    }
+    if (h->version != STATE_VERSION || h->endian != STATE_ENDIAN ||
+        len < sizeof(*h) + h->nfields*sizeof(*dir) ||
+        h->imax < 1 || h->jmax < 1) {
+        return STATE_BAD;
+    }
+    s->version = STATE_VERSION;
+    s->imax = h->imax;
+    s->jmax = h->jmax;
+    s->xlength = h->xlength;
+    s->ylength = h->ylength;
+    s->t = h->t;
+    s->del_t = h->del_t;
+    s->iters = h->iters;
+    s->ibound = h->ibound;
+
+    for (f = 0; f < STATE_NFIELDS; f++) {
+        s->field[f] = NULL;
+        for (k = 0; k < h->nfields; k++) {
+            if (strncmp(dir[k].name, field_names[f], 8) != 0) { continue; }
+            s->type[f] = dir[k].type;
+            if (state_type_size(dir[k].type) == 0 ||
+                (f == STATE_FLAG) != (dir[k].type == STATE_INT8) ||
+                dir[k].size != CELLS(s) * state_type_size(dir[k].type) ||
+                dir[k].offset % state_type_size(dir[k].type) != 0 ||
+                dir[k].offset > len || dir[k].size > len - dir[k].offset) {
+                return STATE_BAD;
+            }
+            s->field[f] = buf + dir[k].offset;
+        }
+        if (s->field[f] == NULL) { return STATE_BAD; }
+    }
+    return 0;
+}
+
+/* Set up s from a version 1 file in memory, copying the fields out */
+static int parse_v1(const char *buf, size_t len, struct state *s)
+{
+    int i, f;
+    float xl, yl;
+    size_t cells, col;
+    char *mem;
+
+    if (len < 2*sizeof(int) + 2*sizeof(float)) { return STATE_BAD; }
+    memcpy(&s->imax, buf, sizeof(int));
+    memcpy(&s->jmax, buf + sizeof(int), sizeof(int));
+    memcpy(&xl, buf + 2*sizeof(int), sizeof(float));
+    memcpy(&yl, buf + 2*sizeof(int) + sizeof(float), sizeof(float));
+    if (s->imax < 1 || s->jmax < 1) { return STATE_BAD; }
+    cells = CELLS(s);
+    col = s->jmax+2;
+    if ((len - 2*sizeof(int) - 2*sizeof(float)) / 13 < cells) {
+        return STATE_BAD;
+    }
+    s->version = 1;
+    s->xlength = xl;
+    s->ylength = yl;
+    s->t = s->del_t = 0.0;
+    s->iters = s->ibound = 0;
+
+    if ((mem = malloc(13*cells)) == NULL) { return -1; }
+    for (f = 0; f < STATE_NFIELDS; f++) {
+        s->type[f] = (f == STATE_FLAG) ? STATE_INT8 : STATE_FLOAT32;
+        s->field[f] = mem + f*4*cells;
+    }
+    buf += 2*sizeof(int) + 2*sizeof(float);
+    for (i = 0; i < s->imax+2; i++, buf += 13*col) {
+        for (f = 0; f < STATE_FLAG; f++) {
+            memcpy((char *) s->field[f] + i*4*col, buf + f*4*col, 4*col);
+        }
+        memcpy((char *) s->field[STATE_FLAG] + i*col, buf + 12*col, col);
+    }
+    s->mem = mem;
+    return 0;
+}
+
+/* Read the whole of fp into memory */
+static char *slurp(FILE *fp, size_t *len)
+{
+    size_t n = 0, cap = 1 << 20, got;
+    char *buf = malloc(cap), *more;
+
+    while (buf != NULL && (got = fread(buf + n, 1, cap - n, fp)) > 0) {
+        n += got;
+        if (n == cap) {
+            more = realloc(buf, cap *= 2);
+            if (more == NULL) { free(buf); }
+            buf = more;
+        }
+    }
+    *len = n;
+    return buf;
+}
+
+
+/* Map a version 2 state file, setting up s to use its fields in place.
+ * Returns 0 on success, -1 with errno set if the file can't be opened or
+ * mapped, STATE_NOT_V2 if it isn't a version 2 file and STATE_BAD if it
+ * is but can't be used.
+ */
+int state_map(const char *file, struct state *s)
+{
+    int fd, err;
+    struct stat st;
+    void *map;
+
+    memset(s, 0, sizeof(*s));
+    if ((fd = open(file, O_RDONLY)) < 0) { return -1; }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return STATE_NOT_V2;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return -1; }
+
+    if ((err = parse_v2(map, st.st_size, s)) != 0) {
+        munmap(map, st.st_size);
+        return err;
+    }
+    s->map = map;
+    s->maplen = st.st_size;
+    return 0;
+}
+
+/* Open a state file of either version, or standard input if file is NULL
+ * or "-". Version 2 files are mapped; others are read into memory. Says
+ * why and returns non-zero if the file can't be used.
+ */
+int state_open(const char *file, struct state *s)
+{
+    int err = STATE_NOT_V2;
+    size_t len;
+    char *buf;
+    FILE *fp = stdin;
+    const char *name = (file == NULL) ? "-" : file;
+
+    if (file != NULL && strcmp(file, "-") != 0) {
+        if ((err = state_map(file, s)) == 0) { return 0; }
+        if (err == STATE_NOT_V2 && (fp = fopen(file, "rb")) == NULL) {
+            err = -1;
+        }
+    }
+    if (err == STATE_NOT_V2) {
+        memset(s, 0, sizeof(*s));
+        buf = slurp(fp, &len);
+        if (fp != stdin) { fclose(fp); }
+        if (buf == NULL) {
+            err = -1;
+        } else if ((err = parse_v2(buf, len, s)) == 0) {
+            s->mem = buf;
+        } else {
+            if (err == STATE_NOT_V2) { err = parse_v1(buf, len, s); }
+            free(buf);
+        }
+    }
+
+    if (err == -1) {
+        fprintf(stderr, "Could not read '%s': %s\n", name, strerror(errno));
+    } else if (err != 0) {
+        fprintf(stderr, "'%s' is not a usable state file\n", name);
+    }
+    return err;
+}
+
+/* Unmap or free a state file */
+void state_close(struct state *s)
+{
+    if (s->map != NULL) { munmap(s->map, s->maplen); }
+    free(s->mem);
+    s->map = s->mem = NULL;
+}
+
+/* Pointers to the columns of field f, so that it can be used as a matrix
+ * in place. Free them with free().
+ */
+void **state_columns(const struct state *s, int f)
+{
+    int i;
+    size_t col = (s->jmax+2) * state_type_size(s->type[f]);
+    void **m = malloc((s->imax+2) * sizeof(void *));
+
+    for (i = 0; m != NULL && i < s->imax+2; i++) {
+        m[i] = (char *) s->field[f] + i*col;
+    }
+    return m;
+}
+
+/* Write a state to a file in the given version of the format. Version 1
+ * files hold u, v and p as floats, and drop the run state. Returns 0 on
+ * success, or -1 with errno set.
+ */
+int state_save(const char *file, const struct state *s, int version)
+{
+    static const char zeros[STATE_ALIGN];
+    struct state_header h;
+    struct state_field dir[STATE_NFIELDS];
+    size_t off, k, col = s->jmax+2;
+    int i, f, ok = 1;
+    float xl = s->xlength, yl = s->ylength, *x;
+    FILE *fp;
+
+    if ((fp = fopen(file, "wb")) == NULL) { return -1; }
+
+    if (version == 1) {
+        if ((x = malloc(col * sizeof(float))) == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        ok = fwrite(&s->imax, sizeof(int), 1, fp) == 1 &&
+            fwrite(&s->jmax, sizeof(int), 1, fp) == 1 &&
+            fwrite(&xl, sizeof(float), 1, fp) == 1 &&
+            fwrite(&yl, sizeof(float), 1, fp) == 1;
+        for (i = 0; i < s->imax+2 && ok; i++) {
+            for (f = 0; f < STATE_FLAG && ok; f++) {
+                for (k = 0; k < col; k++) { x[k] = state_get(s, f, i*col+k); }
+                ok = fwrite(x, sizeof(float), col, fp) == col;
+            }
+            ok = ok && fwrite((char *) s->field[STATE_FLAG] + i*col, 1, col,
+                fp) == col;
+        }
+        free(x);
+    } else {
+        state_layout(s->imax, s->jmax, s->type, &h, dir);
+        h.xlength = s->xlength;
+        h.ylength = s->ylength;
+        h.t = s->t;
+        h.del_t = s->del_t;
+        h.iters = s->iters;
+        h.ibound = s->ibound;
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+            fwrite(dir, sizeof(dir), 1, fp) == 1;
+        off = sizeof(h) + sizeof(dir);
+        for (f = 0; f < STATE_NFIELDS && ok; f++) {
+            ok = fwrite(zeros, 1, dir[f].offset - off, fp) ==
+                    dir[f].offset - off &&
+                fwrite(s->field[f], 1, dir[f].size, fp) == dir[f].size;
+            off = dir[f].offset + dir[f].size;
+        }
+    }
+    return (fclose(fp) == 0 && ok) ? 0 : -1;
+}
@@ -0,0 +1,93 @@
+#ifndef STATEMAP_H
+#define STATEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Version 2 state files. A file starts with a struct state_header and a
+ * directory of nfields struct state_field entries, all in the byte order
+ * of the machine that wrote it, which the endian field records. Each field
+ * then follows in a section of its own, starting on a page boundary: the
+ * (imax+2) x (jmax+2) cells in the same column-major order as the
+ * matrices in memory, so a reader can map the file and use the fields in
+ * place.
+ * Version 1 files, the original karman.bin format, have no magic number:
+ * imax, jmax, xlength and ylength followed by the columns of u, v, p (as
+ * floats) and the flags interleaved.
+ */
+#define STATE_MAGIC   "KARMANSF"
+#define STATE_VERSION 2
+#define STATE_ENDIAN  0x01020304
+#define STATE_ALIGN   4096
+
+/* Fields, in directory order */
+#define STATE_U     0
+#define STATE_V     1
+#define STATE_P     2
+#define STATE_FLAG  3
+#define STATE_NFIELDS 4
+
+/* Element types */
+#define STATE_FLOAT32 1
+#define STATE_FLOAT64 2
+#define STATE_INT8    3
+
+/* state_map() results besides 0 and -1 */
+#define STATE_NOT_V2 1              /* Not a version 2 file */
+#define STATE_BAD    2              /* A version 2 file that can't be used */
+
+struct state_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t nfields;
+    uint32_t reserved;
+    int32_t imax, jmax;
+    double xlength, ylength;
+    double t, del_t;                /* Time of the next timestep, and the */
+    int32_t iters, ibound;          /* size of the last; its step number
+                                       and the number of boundary cells */
+};
+
+struct state_field {
+    char name[8];                   /* NUL padded */
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;                /* From the start of the file */
+    uint64_t size;                  /* In bytes */
+};
+
+/* A state file in memory, mapped or read in */
+struct state {
+    int version;                    /* Of the file it came from */
+    int imax, jmax;
+    double xlength, ylength;
+    double t, del_t;
+    int iters, ibound;
+    int type[STATE_NFIELDS];
+    void *field[STATE_NFIELDS];     /* (imax+2)*(jmax+2) cells each */
+    void *map;                      /* The mapping, or NULL */
+    size_t maplen;
+    void *mem;                      /* Memory it was read into, or NULL */
+};
+
+size_t state_type_size(int type);
+size_t state_layout(int imax, int jmax, const int *type,
+    struct state_header *h, struct state_field *dir);
+int state_map(const char *file, struct state *s);
+int state_open(const char *file, struct state *s);
+void state_close(struct state *s);
+void **state_columns(const struct state *s, int f);
+int state_save(const char *file, const struct state *s, int version);
+
+/* Cell k of field f as a double, whatever its type */
+static inline double state_get(const struct state *s, int f, size_t k)
+{
+    switch (s->type[f]) {
+        case STATE_FLOAT32: return ((const float *) s->field[f])[k];
+        case STATE_FLOAT64: return ((const double *) s->field[f])[k];
+        default:            return ((const char *) s->field[f])[k];
+    }
+}
+
+#endif
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "datadef.h"
+#include "stencil.h"
+
+#define max(x,y) ((x)>(y)?(x):(y))
+#define min(x,y) ((x)<(y)?(x):(y))
+
+extern int ileft, iright, jbottom, jtop;
+
+/* Precomputed pressure stencil of this process's block, widened by a
+ * margin of cells for the tiled solver. The fluid cells of each column are
+ * split into runs of interior cells, whose four neighbours are all fluid
+ * and which take the plain five point star, and a list of cells next to an
+ * obstacle or the edge of the domain, which carry their own neighbour
+ * weights and relaxation factor.
+ * Column i's runs are runs[run_start[i-icol0]] up to
+ * runs[run_start[i-icol0+1]-1], and likewise for its boundary cells.
+ */
+struct run {
+    int j0, j1;                     /* Interior fluid cells j0..j1 */
+};
+
+struct bcell {
+    int j;
+    preal eps_e, eps_w, eps_n, eps_s;   /* 1 if the neighbour is fluid */
+    preal diag;                         /* Diagonal of the stencil */
+    preal beta_mod;                     /* -omega/diag */
+};
+
+static struct run *runs;
+static int *run_start;
+static struct bcell *bcells;
+static int *bcell_start;
+static preal diag_int, beta_int;    /* diag and beta_mod of an interior
+                                     * cell */
+static int icol0;                   /* First column of the tables */
+
+
+/* Classify the fluid cells of this process's block, and of the margin
+ * cells around it that lie inside the domain, from the flag matrix.
+ * The flags do not change, so this is done once before the main loop.
+ */
+void build_stencil(char **flag, int imax, int jmax, real delx, real dely,
+    real omega, int margin)
+{
+    int i, j, nruns = 0, nbcells = 0;
+    int i0 = max(1, ileft-margin), i1 = min(imax, iright+margin);
+    int j0 = max(1, jbottom-margin), j1 = min(jmax, jtop+margin);
+    int w = i1 - i0 + 1, h = j1 - j0 + 1;
+    preal rdx2 = 1.0/(delx*delx);
+    preal rdy2 = 1.0/(dely*dely);
+    struct bcell *b;
+
+    icol0 = i0;
+    /* A column holds at most (h+1)/2 runs */
+    runs = malloc(w * ((h+1)/2) * sizeof(struct run));
+    run_start = malloc((w+1) * sizeof(int));
+    bcells = malloc(w * h * sizeof(struct bcell));
+    bcell_start = malloc((w+1) * sizeof(int));
+    if (!runs || !run_start || !bcells || !bcell_start) {
+        fprintf(stderr, "Couldn't allocate memory for the stencil.\n");
+        exit(1);
+    }
+
+    for (i = i0; i <= i1; i++) {
+        run_start[i-i0] = nruns;
+        bcell_start[i-i0] = nbcells;
+        for (j = j0; j <= j1; j++) {
+            if (!(flag[i][j] & C_F)) { continue; }
+            if (eps_E && eps_W && eps_N && eps_S) {
+                if (nruns > run_start[i-i0] && runs[nruns-1].j1 == j-1) {
+                    runs[nruns-1].j1 = j;
+                } else {
+                    runs[nruns].j0 = runs[nruns].j1 = j;
+                    nruns++;
+                }
+            } else {
+                b = &bcells[nbcells++];
+                b->j = j;
+                b->eps_e = eps_E;
+                b->eps_w = eps_W;
+                b->eps_n = eps_N;
+                b->eps_s = eps_S;
+                b->diag = (eps_E+eps_W)*rdx2+(eps_N+eps_S)*rdy2;
+                b->beta_mod = -omega/b->diag;
+            }
+        }
+    }
+    run_start[w] = nruns;
+    bcell_start[w] = nbcells;
+    diag_int = (1+1)*rdx2+(1+1)*rdy2;
+    beta_int = -omega/diag_int;
+}
+
+
+/* One red/black SOR half-sweep of colour rb over cells j0..j1 of column
+ * i. If want is non-zero, returns the sum of the squares of the residuals
+ * of the cells before they are updated; a cell's residual after its update
+ * is 1-omega times that. The sum is kept in double. GCC cannot vectorise
+ * the strided float loop with a double sum in it, so the runs store their
+ * squares in a buffer, CHUNK cells at a time, which a second loop adds up.
+ */
+#define CHUNK 64        /* Cells whose squared residuals are buffered */
+
+double stencil_column(preal **p, preal **rhs, int rb, int i, int j0, int j1,
+    preal omega, preal rdx2, preal rdy2, int want)
+{
+    int j, k, n, c, jlo, jhi;
+    preal nbrs, add, sq[CHUNK];
+    double sum = 0.0;
+    struct run *r;
+    struct bcell *b;
+
+    for (k = run_start[i-icol0]; k < run_start[i-icol0+1]; k++) {
+        r = &runs[k];
+        jlo = max(r->j0, j0);
+        jhi = min(r->j1, j1);
+        /* First cell of colour rb in the run */
+        jlo += (i + jlo + rb) % 2;
+        for (; jlo <= jhi; jlo += 2*CHUNK) {
+            n = min(CHUNK, (jhi - jlo)/2 + 1);
+            for (c = 0; c < n; c++) {
+                j = jlo + 2*c;
+                nbrs = (p[i+1][j]+p[i-1][j])*rdx2
+                    + (p[i][j+1]+p[i][j-1])*rdy2
+                    - rhs[i][j];
+                add = nbrs - diag_int*p[i][j];
+                sq[c] = add*add;
+                p[i][j] = (1.-omega)*p[i][j] - beta_int*nbrs;
+            }
+            if (!want) { continue; }
+            #pragma omp simd reduction(+:sum)
+            for (c = 0; c < n; c++) {
+                sum += sq[c];
+            }
+        }
+    }
+    for (k = bcell_start[i-icol0]; k < bcell_start[i-icol0+1]; k++) {
+        b = &bcells[k];
+        j = b->j;
+        if ((i+j) % 2 != rb || j < j0 || j > j1) { continue; }
+        nbrs = (b->eps_e*p[i+1][j]+b->eps_w*p[i-1][j])*rdx2
+            + (b->eps_n*p[i][j+1]+b->eps_s*p[i][j-1])*rdy2
+            - rhs[i][j];
+        if (want) {
+            add = nbrs - b->diag*p[i][j];
+            sum += (double) add*add;
+        }
+        p[i][j] = (1.-omega)*p[i][j] - b->beta_mod*nbrs;
+    }
+    return sum;
+}
+
+/* One red/black SOR half-sweep of colour rb over the cells i0..i1 x j0..j1
+ * of this process's block. If ressum is not NULL the squares of the
+ * residuals of the cells before they are updated are added to it, as
+ * stencil_column() returns them. The team shares out the columns and does
+ * not wait at the end.
+ */
+void stencil_sweep(preal **p, preal **rhs, int rb, int i0, int i1, int j0,
+    int j1, preal omega, preal rdx2, preal rdy2, struct team_sum *ressum)
+{
+    int i;
+    double sum = 0.0;
+
+    #pragma omp for schedule(static) nowait
+    for (i = i0; i <= i1; i++) {
+        sum += stencil_column(p, rhs, rb, i, j0, j1, omega, rdx2, rdy2,
+            ressum != NULL);
+    }
+    if (ressum) { team_add(ressum, sum); }
+}
+
+/* Sum of squares of the residual over cells j0..j1 of column i */
+double stencil_column_residual(preal **p, preal **rhs, int i, int j0,
+    int j1, preal rdx2, preal rdy2)
+{
+    int j, k;
+    preal add;
+    double sum = 0.0;
+    struct run *r;
+    struct bcell *b;
+
+    for (k = run_start[i-icol0]; k < run_start[i-icol0+1]; k++) {
+        r = &runs[k];
+        for (j = max(r->j0, j0); j <= min(r->j1, j1); j++) {
+            add = (p[i+1][j]+p[i-1][j])*rdx2 + (p[i][j+1]+p[i][j-1])*rdy2
+                - rhs[i][j] - diag_int*p[i][j];
+            sum += (double) add*add;
+        }
+    }
+    for (k = bcell_start[i-icol0]; k < bcell_start[i-icol0+1]; k++) {
+        b = &bcells[k];
+        j = b->j;
+        if (j < j0 || j > j1) { continue; }
+        add = (b->eps_e*p[i+1][j]+b->eps_w*p[i-1][j])*rdx2
+            + (b->eps_n*p[i][j+1]+b->eps_s*p[i][j-1])*rdy2
+            - rhs[i][j] - b->diag*p[i][j];
+        sum += (double) add*add;
+    }
+    return sum;
+}
+
+/* Free the stencil tables */
+void free_stencil(void)
+{
+    free(runs);
+    free(run_start);
+    free(bcells);
+    free(bcell_start);
+}
+
+
+/* Team sums. Slots are SLOT doubles apart, so no two threads' slots share
+ * a cache line.
+ */
+#define SLOT 8
+
+/* Make a slot for each thread of the team, and zero them. Called by one
+ * thread, before the team adds to them.
+ */
+void team_sum_setup(struct team_sum *s)
+{
+    int n = omp_get_num_threads();
+
+    if (n > s->n) {
+        free(s->part);
+        s->part = malloc(n * SLOT * sizeof(double));
+        if (s->part == NULL) {
+            fprintf(stderr, "Couldn't allocate memory for team sums.\n");
+            exit(1);
+        }
+        s->n = n;
+    }
+    memset(s->part, 0, s->n * SLOT * sizeof(double));
+}
+
+/* Add x to the calling thread's slot */
+void team_add(struct team_sum *s, double x)
+{
+    s->part[omp_get_thread_num() * SLOT] += x;
+}
+
+/* The sum of the slots, in thread order, which are zeroed for the next
+ * sum. Called by one thread once the team has finished adding.
+ */
+double team_total(struct team_sum *s)
+{
+    int k, n = omp_get_num_threads();
+    double sum = 0.0;
+
+    for (k = 0; k < n; k++) {
+        sum += s->part[k * SLOT];
+        s->part[k * SLOT] = 0.0;
+    }
+    return sum;
+}
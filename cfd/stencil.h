@@ -0,0 +1,23 @@
+#include "precision.h"
+
+/* A sum over a team of threads. Each thread adds to a slot of its own, and
+ * team_total() adds the slots up in thread order, so the sum comes out the
+ * same from run to run, whichever thread finishes first.
+ */
+struct team_sum {
+    double *part;
+    int n;                          /* Slots allocated */
+};
+
+void build_stencil(char **flag, int imax, int jmax, real delx, real dely,
+    real omega, int margin);
+double stencil_column(preal **p, preal **rhs, int rb, int i, int j0, int j1,
+    preal omega, preal rdx2, preal rdy2, int want);
+void stencil_sweep(preal **p, preal **rhs, int rb, int i0, int i1, int j0,
+    int j1, preal omega, preal rdx2, preal rdy2, struct team_sum *ressum);
+double stencil_column_residual(preal **p, preal **rhs, int i, int j0,
+    int j1, preal rdx2, preal rdy2);
+void free_stencil(void);
+void team_sum_setup(struct team_sum *s);
+void team_add(struct team_sum *s, double x);
+double team_total(struct team_sum *s);
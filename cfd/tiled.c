@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <mpi.h>
+#include <omp.h>
+#include "datadef.h"
+#include "halo.h"
+#include "stencil.h"
+#include "tiled.h"
+#include "timing.h"
+
+#define max(x,y) ((x)>(y)?(x):(y))
+#define min(x,y) ((x)<(y)?(x):(y))
+
+extern int ileft, iright, jbottom, jtop;
+extern int nprocs, proc;
+extern MPI_Comm cart_comm;
+extern int sor_check;
+
+/* Temporally blocked red/black SOR. Instead of sweeping the whole block
+ * once per half-iteration, sor_tile iterations at a time are run as a
+ * wavefront over the columns: at each step the front moves one column
+ * east, and half-sweep h is done on the column h behind it. Half-sweep h
+ * of a column needs half-sweep h-1 of the columns either side, which the
+ * front has just passed, so every cell is updated from exactly the values
+ * the plain solver would use and the result is the same. The columns the
+ * front works on, about 2*sor_tile of them, stay in cache, so p and rhs
+ * are read from memory once per sor_tile iterations rather than twice per
+ * iteration.
+ * With neighbouring processes a halo 2*sor_tile+1 cells deep is exchanged
+ * before each tile, and half-sweep h also updates the nh-h cells around
+ * the block that it can still get right (nh being the number of
+ * half-sweeps), repeating the neighbours' work. The last half-sweeps leave
+ * a ring of one cell current, so the residual of the block can be taken
+ * just behind the front.
+ * The team shares the front out by rows: each thread runs it over a strip
+ * of the block's rows, and the team waits for each other once the front
+ * has moved a column. The cells a half-sweep reads across the edge of a
+ * strip were updated by the half-sweep before it on the same column, one
+ * step earlier, and are next updated one step later, so the strips never
+ * race and the result is still that of the plain solver.
+ */
+int sor_tile = 0;                   /* Iterations per tile, 0 for off */
+
+static struct team_sum ressum;      /* Residual of the strips */
+static int converged;               /* Shared by the team */
+
+
+/* Check that the blocks are deep enough for the halo of sor_tile
+ * iterations, reducing it if not. Returns the margin of cells around the
+ * block that the stencil must cover.
+ */
+int tiled_setup(int imax, int jmax)
+{
+    int local, smallest;
+
+    if (sor_tile <= 0) { return 0; }
+
+    /* Only edges with a neighbour need the deep halo */
+    local = imax + jmax;
+    if (ileft > 1 || iright < imax) { local = min(local, iright-ileft+1); }
+    if (jbottom > 1 || jtop < jmax) { local = min(local, jtop-jbottom+1); }
+    MPI_Allreduce(&local, &smallest, 1, MPI_INT, MPI_MIN, cart_comm);
+    if (2*sor_tile+1 > smallest) {
+        sor_tile = (smallest-1) / 2;
+        if (proc == 0) {
+            fprintf(stderr, "Blocks of %d cells only allow tiles of %d "
+                "iterations.\n", smallest, sor_tile);
+        }
+    }
+    return 2*sor_tile;
+}
+
+
+/* Run nt iterations as one wavefront over this thread's strip of rows,
+ * with the rest of the team on theirs. If want is non-zero, adds the sum
+ * of squares of the residual of the strip at the end to ressum.
+ */
+static void wavefront(preal **p, preal **rhs, int imax, int jmax, int nt,
+    preal omega, preal rdx2, preal rdy2, int want)
+{
+    int c, h, i, e, nh = 2*nt;
+    int t = omp_get_thread_num(), nth = omp_get_num_threads();
+    int rows = jtop - jbottom + 1;
+    int j0 = jbottom + t*rows/nth;              /* Rows of the strip */
+    int j1 = jbottom + (t+1)*rows/nth - 1;
+    double sum = 0.0;
+
+    for (c = max(1, ileft-nh); c <= iright+nh; c++) {
+        for (h = 0; h < nh; h++) {
+            i = c - h;
+            e = nh - h;
+            if (i < max(1, ileft-e) || i > min(imax, iright+e)) { continue; }
+            /* The strips at the ends take the margin rows */
+            stencil_column(p, rhs, h%2, i,
+                (t == 0) ? max(1, jbottom-e) : j0,
+                (t == nth-1) ? min(jmax, jtop+e) : j1,
+                omega, rdx2, rdy2, 0);
+        }
+        /* Column i and its neighbours have had their last half-sweep */
+        i = c - nh;
+        if (want && i >= ileft && i <= iright && j0 <= j1) {
+            sum += stencil_column_residual(p, rhs, i, j0, j1, rdx2, rdy2);
+        }
+        #pragma omp barrier
+    }
+    if (want) { team_add(&ressum, sum); }
+}
+
+/* poisson() with temporal blocking. Every thread of the team runs it; the
+ * master thread exchanges the halos and reduces the residual. The residual
+ * is checked after the tiles that end on or cross a multiple of sor_check
+ * iterations and after the last one, so that *res is that of the final p
+ * if the iteration runs out, and the p halo is current on return.
+ */
+int tiled_poisson(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, real omega,
+    double *res, int ifull)
+{
+    static double p0, tot;          /* Shared by the team */
+    int i, j, iter, nt, check;
+    double sum = 0.0;
+    preal rdx2 = 1.0/(delx*delx);
+    preal rdy2 = 1.0/(dely*dely);
+
+    #pragma omp single
+    {
+        team_sum_setup(&ressum);
+        converged = 0;
+        *res = HUGE_VAL;
+    }
+
+    #pragma omp for schedule(static) private(j) nowait
+    for (i = ileft; i <= iright; i++) {
+        for (j = jbottom; j <= jtop; j++) {
+            if (flag[i][j] & C_F) { sum += p[i][j]*p[i][j]; }
+        }
+    }
+    team_add(&ressum, sum);
+    #pragma omp barrier
+    #pragma omp master
+    {
+        p0 = team_total(&ressum);
+        timed_allreduce(&p0, &tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+        p0 = sqrt(tot/ifull);
+        if (p0 < 0.0001) { p0 = 1.0; }
+
+        /* The margin cells need the right hand side as well */
+        exchange_halo_deep_p(rhs, 2*sor_tile, imax, jmax);
+    }
+
+    for (iter = 0; iter < itermax; ) {
+        nt = min(sor_tile, itermax - iter);
+        check = (iter + nt) / sor_check != iter / sor_check ||
+            iter + nt == itermax;
+        #pragma omp master
+        exchange_halo_deep_p(p, 2*nt+1, imax, jmax);
+        #pragma omp barrier
+        wavefront(p, rhs, imax, jmax, nt, omega, rdx2, rdy2, check);
+        iter += nt;
+        if (check) {
+            #pragma omp barrier
+            #pragma omp master
+            {
+                sum = team_total(&ressum);
+                timed_allreduce(&sum, &tot, 1, MPI_DOUBLE, MPI_SUM, cart_comm);
+                *res = sqrt(tot/ifull)/p0;
+                converged = *res < eps;
+            }
+            #pragma omp barrier
+            if (converged) { break; }
+        }
+    }
+    #pragma omp master
+    exchange_halo_p(p, imax, jmax);
+    #pragma omp barrier
+    return iter;
+}
@@ -0,0 +1,8 @@
+#include "precision.h"
+
+extern int sor_tile;
+
+int tiled_setup(int imax, int jmax);
+int tiled_poisson(preal **p, preal **rhs, char **flag, int imax, int jmax,
+    real delx, real dely, real eps, int itermax, real omega,
+    double *res, int ifull);
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <mpi.h>
+#include <omp.h>
+#include "halo.h"
+#include "timing.h"
+
+extern int ileft, iright, jbottom, jtop;
+extern int nprocs, proc;
+extern MPI_Comm cart_comm;
+
+/* Timing of the phases of the timesteps on each process, by the master
+ * thread, so a phase run by the whole team includes the wait for the rest
+ * of the team only if it ends with a barrier. The phases in progress are
+ * kept on a stack, and the time since the last push or pop is charged to
+ * the one on top, so nested phases are not counted twice and the phases
+ * add up to the time of the main loop.
+ * At the end the times are collected on process 0 and written out as JSON
+ * or CSV, with their minimum, average and maximum over the processes.
+ */
+char *timing_file = NULL;           /* Where to write the times, or NULL
+                                       for no timing */
+
+#define TIMER_DEPTH 16
+
+static const char *phase_names[NPHASES] = {
+    "other", "timestep", "tentative", "rhs", "solver", "sor_red",
+    "sor_black", "halo", "allreduce", "update", "boundary", "checkpoint",
+    "frames"
+};
+
+static int timer_on;                /* Between timer_begin and timer_end */
+static int stack[TIMER_DEPTH], depth;
+static double last;                 /* Time of the last push or pop */
+static double loop_start, loop_time;
+static double phase_time[NPHASES];
+static long phase_calls[NPHASES];
+
+
+/* Start timing, at the start of the main loop, if it was asked for */
+void timer_begin(void)
+{
+    if (timing_file == NULL) { return; }
+    timer_on = 1;
+    depth = 0;
+    stack[0] = PH_OTHER;
+    last = loop_start = MPI_Wtime();
+}
+
+/* Stop timing, at the end of the main loop */
+void timer_end(void)
+{
+    double now;
+
+    if (!timer_on) { return; }
+    now = MPI_Wtime();
+    phase_time[stack[depth]] += now - last;
+    loop_time += now - loop_start;
+    timer_on = 0;
+}
+
+/* Enter a phase. Called by every thread or the master thread alone; only
+ * the master's calls count.
+ */
+void timer_push(int phase)
+{
+    double now;
+
+    if (!timer_on || omp_get_thread_num() != 0) { return; }
+    now = MPI_Wtime();
+    phase_time[stack[depth]] += now - last;
+    stack[++depth] = phase;
+    phase_calls[phase]++;
+    last = now;
+}
+
+/* Leave the phase entered last */
+void timer_pop(void)
+{
+    double now;
+
+    if (!timer_on || omp_get_thread_num() != 0) { return; }
+    now = MPI_Wtime();
+    phase_time[stack[depth--]] += now - last;
+    last = now;
+}
+
+/* MPI_Allreduce, timed as the allreduce phase */
+int timed_allreduce(void *sendbuf, void *recvbuf, int count,
+    MPI_Datatype type, MPI_Op op, MPI_Comm comm)
+{
+    int err;
+
+    timer_push(PH_ALLREDUCE);
+    err = MPI_Allreduce(sendbuf, recvbuf, count, type, op, comm);
+    timer_pop();
+    return err;
+}
+
+
+/* Statistic s of column c of the nprocs rows of n values: 0 for the
+ * minimum, 1 for the average and 2 for the maximum. For the minimum and
+ * maximum *at is set to the process.
+ */
+static double stat(const double *rows, int n, int c, int s, int *at)
+{
+    int r;
+    double x = rows[c];
+
+    *at = 0;
+    for (r = 1; r < nprocs; r++) {
+        double y = rows[r*n + c];
+        if (s == 1) {
+            x += y;
+        } else if ((s == 0 && y < x) || (s == 2 && y > x)) {
+            x = y;
+            *at = r;
+        }
+    }
+    return (s == 1) ? x/nprocs : x;
+}
+
+static void write_json(FILE *fp, const double *rows, const int *blocks,
+    int steps, long solver_iters, int imax, int jmax)
+{
+    static const char *stats[3] = { "min", "avg", "max" };
+    int n = NPHASES + 1, c, r, s, at;
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"imax\": %d, \"jmax\": %d,\n", imax, jmax);
+    fprintf(fp, "  \"processes\": %d, \"grid\": [%d, %d], \"threads\": %d,\n",
+        nprocs, decomposition_dim(0), decomposition_dim(1),
+        omp_get_max_threads());
+    fprintf(fp, "  \"steps\": %d, \"solver_iters\": %ld,\n", steps,
+        solver_iters);
+
+    fprintf(fp, "  \"summary\": {\n");
+    for (c = 0; c < n; c++) {
+        fprintf(fp, "    \"%s\": {", (c == 0) ? "loop" : phase_names[c-1]);
+        for (s = 0; s < 3; s++) {
+            fprintf(fp, "%s\"%s\": %.9g", (s > 0) ? ", " : " ", stats[s],
+                stat(rows, n, c, s, &at));
+            if (s != 1) { fprintf(fp, ", \"%s_rank\": %d", stats[s], at); }
+        }
+        if (c > 0) { fprintf(fp, ", \"calls\": %ld", phase_calls[c-1]); }
+        fprintf(fp, " }%s\n", (c < n-1) ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    fprintf(fp, "  \"ranks\": [\n");
+    for (r = 0; r < nprocs; r++) {
+        fprintf(fp, "    { \"rank\": %d, \"block\": [%d, %d, %d, %d]", r,
+            blocks[4*r], blocks[4*r+1], blocks[4*r+2], blocks[4*r+3]);
+        for (c = 0; c < n; c++) {
+            fprintf(fp, ", \"%s\": %.9g", (c == 0) ? "loop" :
+                phase_names[c-1], rows[r*n + c]);
+        }
+        fprintf(fp, " }%s\n", (r < nprocs-1) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void write_csv(FILE *fp, const double *rows, const int *blocks,
+    int steps, long solver_iters)
+{
+    static const char *stats[3] = { "min", "avg", "max" };
+    int n = NPHASES + 1, c, r, s, at;
+
+    fprintf(fp, "rank,ileft,iright,jbottom,jtop,steps,solver_iters,loop");
+    for (c = 0; c < NPHASES; c++) { fprintf(fp, ",%s", phase_names[c]); }
+    fprintf(fp, "\n");
+
+    for (r = 0; r < nprocs; r++) {
+        fprintf(fp, "%d,%d,%d,%d,%d,%d,%ld", r, blocks[4*r], blocks[4*r+1],
+            blocks[4*r+2], blocks[4*r+3], steps, solver_iters);
+        for (c = 0; c < n; c++) { fprintf(fp, ",%.9g", rows[r*n + c]); }
+        fprintf(fp, "\n");
+    }
+    for (s = 0; s < 3; s++) {
+        fprintf(fp, "%s,,,,,%d,%ld", stats[s], steps, solver_iters);
+        for (c = 0; c < n; c++) {
+            fprintf(fp, ",%.9g", stat(rows, n, c, s, &at));
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+/* Collect every process's times on process 0 and write them to the timing
+ * file: as CSV if its name ends in .csv, or else as JSON. steps is the
+ * number of timesteps and solver_iters the pressure solver iterations
+ * they took.
+ */
+void timing_report(int steps, long solver_iters, int imax, int jmax)
+{
+    double mine[NPHASES + 1], *rows = NULL;
+    int block[4] = { ileft, iright, jbottom, jtop }, *blocks = NULL;
+    const char *dot;
+    FILE *fp;
+
+    if (timing_file == NULL) { return; }
+
+    mine[0] = loop_time;
+    memcpy(&mine[1], phase_time, sizeof(phase_time));
+    if (proc == 0) {
+        rows = malloc(nprocs * sizeof(mine));
+        blocks = malloc(nprocs * sizeof(block));
+        if (!rows || !blocks) {
+            fprintf(stderr, "Couldn't allocate memory for the timing.\n");
+            MPI_Abort(cart_comm, 1);
+        }
+    }
+    MPI_Gather(mine, NPHASES + 1, MPI_DOUBLE, rows, NPHASES + 1, MPI_DOUBLE,
+        0, cart_comm);
+    MPI_Gather(block, 4, MPI_INT, blocks, 4, MPI_INT, 0, cart_comm);
+    if (proc != 0) { return; }
+
+    if ((fp = fopen(timing_file, "w")) == NULL) {
+        fprintf(stderr, "Could not open '%s'\n", timing_file);
+    } else {
+        dot = strrchr(timing_file, '.');
+        if (dot != NULL && strcasecmp(dot, ".csv") == 0) {
+            write_csv(fp, rows, blocks, steps, solver_iters);
+        } else {
+            write_json(fp, rows, blocks, steps, solver_iters, imax, jmax);
+        }
+        fclose(fp);
+    }
+    free(rows);
+    free(blocks);
+}
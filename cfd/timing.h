@@ -0,0 +1,35 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <mpi.h>
+
+/* Phases of a timestep. Time spent in a phase inside another one counts
+ * towards the inner phase only.
+ */
+#define PH_OTHER      0             /* None of the below */
+#define PH_TIMESTEP   1             /* Timestep control */
+#define PH_TENTATIVE  2             /* Tentative velocities */
+#define PH_RHS        3             /* Right hand side of the pressure
+                                       equation */
+#define PH_SOLVER     4             /* Pressure solver, but for the below */
+#define PH_SOR_RED    5             /* SOR sweeps of each colour */
+#define PH_SOR_BLACK  6
+#define PH_HALO       7             /* Halo exchanges */
+#define PH_ALLREDUCE  8
+#define PH_UPDATE     9             /* Velocity update */
+#define PH_BOUNDARY  10             /* Boundary conditions */
+#define PH_CHECKPOINT 11
+#define PH_FRAMES    12
+#define NPHASES      13
+
+extern char *timing_file;
+
+void timer_begin(void);
+void timer_end(void);
+void timer_push(int phase);
+void timer_pop(void);
+int timed_allreduce(void *sendbuf, void *recvbuf, int count,
+    MPI_Datatype type, MPI_Op op, MPI_Comm comm);
+void timing_report(int steps, long solver_iters, int imax, int jmax);
+
+#endif